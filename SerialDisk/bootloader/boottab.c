@@ -0,0 +1,44 @@
+/*
+	boottab.c: the BOOT2 and BOOT3 code sent to a HELP style bootloader
+
+	Shared by hlpgen and the server. hlpgen -c turns these tables into the
+	byte streams the server sends (bootstream.h), so the encoding is done
+	once at build time.
+
+	If BOOT1 is toggled in and started, BOOT2 is sent in HELP loader
+	format. BOOT3 is then sent in BOOT2 loader format, followed by the
+	important parts of block 0 in BOOT3 format.
+*/
+
+int boot2[] = {
+	//		00000, // Must be 0, not sent
+	00000, // Must have 01000 clear
+	00000, 05032,
+	07032, 07012, 01003, 03036,
+	04020, 03002, 04020, 03013,
+	05010, 00000, 00000, 00000,
+	00000, 04032, 07006, 07006,
+	07006, 03000, 04032, 01000,
+	03030,
+	05004-1, // Decrement because of ISZ
+	00000,   // Send NUL to get to JMP
+};
+
+int boot3[] = {
+	05420, 00000, 03402,	// Actually the required patch
+	00041, 04020,		// BOOT3 proper
+	00042, 03002,
+	00043, 04020,
+	00044, 03001,
+	00045, 04020,
+	00046, 03047,
+	00047, 00000,
+	00050, 04020,
+	00051, 03402,
+	00052, 02002,
+	00053, 07000,
+	00054, 02001,
+	00055, 05050,
+	00056, 05041,
+	00014, 05041,		// Kludge to start BOOT3
+};
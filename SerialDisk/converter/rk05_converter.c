@@ -1,107 +1,374 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#ifdef DJG_TO_MAC
-#define NUM_IN 4
-#define NUM_OUT 3
-#endif
-
-#ifdef MAC_TO_DJG
-#define NUM_IN 3
-#define NUM_OUT 4
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 #endif
 
 /*
  * convert from Mac to dumprest
  * convert from dumprest to Mac
+ *
+ * Usage: rk05_converter [-d mac2djg|djg2mac] [-j jobs] [-c MB] input output
+ *        rk05_converter [-d mac2djg|djg2mac] [-j jobs] [-c MB] -o directory input...
+ *
+ * The direction may also come from the name the program is run as
+ * (mac2djg or djg2mac). With -o each input is converted to a file of the
+ * same name in the directory, several at a time on a pool of threads.
  */
 
-FILE *input;
-FILE *output;
+//Mac: ABCD EFGH = aaabbbcc cdddeeef ffggghhh
+//DJG: ABCD EFGH = bbcccddd 0000aaab ffggghhh 0000eeef
 
-char in_file[256];
-char out_file[256];
+#define MAC_BYTES 3 //per pair of words
+#define DJG_BYTES 4
+#define CHUNK_MB 4 //default chunk size
+#define SLACK 16 //the vector loops load and store a little past the end
 
-char in_buf[6];
-char out_buf[6];
+static const char usage[] = "Usage: %s [-d mac2djg|djg2mac] [-j jobs] [-c MB] input output\n"
+			    "       %s [-d mac2djg|djg2mac] [-j jobs] [-c MB] -o directory input...\n";
 
-int c, count_in, count_out = 0;
+int mac_to_djg = -1;
+long chunk_pairs; //word pairs per chunk
+int jobs;
+char *out_dir;
+char **in_files;
+int file_count;
+int next_file;
+int failures;
+long long total_in, total_out;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
-int main(int argc, char* argv[])
+void mac2djg_scalar(const unsigned char *in, unsigned char *out, long pairs)
 {
-	if (argc == 3)
+	for (long i = 0; i < pairs; i++, in += MAC_BYTES, out += DJG_BYTES)
 	{
-		strcpy(in_file, argv[1]);
-		strcpy(out_file, argv[2]);
+		out[0] = ((in[0] << 4) & 0xF0) | ((in[1] >> 4) & 0x0F);
+		out[1] = (in[0] >> 4) & 0x0F;
+		out[2] = in[2];
+		out[3] = in[1] & 0x0F;
 	}
-	else
+}
+
+void djg2mac_scalar(const unsigned char *in, unsigned char *out, long pairs)
+{
+	for (long i = 0; i < pairs; i++, in += DJG_BYTES, out += MAC_BYTES)
 	{
-		printf("Usage: %s [input] [output]\n", argv[0]);
-		exit(1);
+		out[0] = ((in[1] << 4) & 0xF0) | ((in[0] >> 4) & 0x0F);
+		out[1] = ((in[0] << 4) & 0xF0) | (in[3] & 0xF);
+		out[2] = in[2];
 	}
-	input = fopen(in_file, "r");
-	output = fopen(out_file, "w");
-	
-	if (input == NULL)
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Four pairs at a time: one shuffle lines the input bytes up under the
+ * output bytes they mostly come from, a second lines up the ones that
+ * supply the other nibble, and shifts and masks put the nibbles together.
+ */
+__attribute__((target("ssse3")))
+void mac2djg_ssse3(const unsigned char *in, unsigned char *out, long pairs)
+{
+	const __m128i lead = _mm_setr_epi8(0, 0, 2, 1, 3, 3, 5, 4, 6, 6, 8, 7, 9, 9, 11, 10);
+	const __m128i other = _mm_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+	const __m128i high = _mm_set1_epi32(0x000000F0);
+	const __m128i shifted_other = _mm_set1_epi32(0x0000000F);
+	const __m128i shifted_lead = _mm_set1_epi32(0x00000F00);
+	const __m128i whole = _mm_set1_epi32(0x0FFF0000);
+	long i;
+
+	for (i = 0; i + 4 <= pairs; i += 4, in += 4 * MAC_BYTES, out += 4 * DJG_BYTES)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) in); //the last four bytes are slack
+		__m128i x = _mm_shuffle_epi8(v, lead); //b0 b0 b2 b1
+		__m128i y = _mm_shuffle_epi8(v, other); //b1 0 0 0
+		__m128i o = _mm_and_si128(_mm_slli_epi16(x, 4), high); //b0 << 4
+		o = _mm_or_si128(o, _mm_and_si128(_mm_srli_epi16(y, 4), shifted_other)); //| b1 >> 4
+		o = _mm_or_si128(o, _mm_and_si128(_mm_srli_epi16(x, 4), shifted_lead)); //b0 >> 4
+		o = _mm_or_si128(o, _mm_and_si128(x, whole)); //b2, b1 & 0x0F
+		_mm_storeu_si128((__m128i *) out, o);
+	}
+	mac2djg_scalar(in, out, pairs - i);
+}
+
+__attribute__((target("ssse3")))
+void djg2mac_ssse3(const unsigned char *in, unsigned char *out, long pairs)
+{
+	const __m128i lead = _mm_setr_epi8(1, 0, 2, 5, 4, 6, 9, 8, 10, 13, 12, 14, -1, -1, -1, -1);
+	const __m128i other = _mm_setr_epi8(0, 3, -1, 4, 7, -1, 8, 11, -1, 12, 15, -1, -1, -1, -1, -1);
+	const __m128i high = _mm_setr_epi8(-16, -16, 0, -16, -16, 0, -16, -16, 0, -16, -16, 0, 0, 0, 0, 0);
+	const __m128i shifted = _mm_setr_epi8(15, 0, 0, 15, 0, 0, 15, 0, 0, 15, 0, 0, 0, 0, 0, 0);
+	const __m128i nibble = _mm_setr_epi8(0, 15, 0, 0, 15, 0, 0, 15, 0, 0, 15, 0, 0, 0, 0, 0);
+	const __m128i whole = _mm_setr_epi8(0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, 0, 0);
+	long i;
+
+	for (i = 0; i + 4 <= pairs; i += 4, in += 4 * DJG_BYTES, out += 4 * MAC_BYTES)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) in);
+		__m128i x = _mm_shuffle_epi8(v, lead); //d1 d0 d2
+		__m128i y = _mm_shuffle_epi8(v, other); //d0 d3 0
+		__m128i o = _mm_and_si128(_mm_slli_epi16(x, 4), high); //d1 << 4, d0 << 4
+		o = _mm_or_si128(o, _mm_and_si128(_mm_srli_epi16(y, 4), shifted)); //| d0 >> 4
+		o = _mm_or_si128(o, _mm_and_si128(y, nibble)); //| d3 & 0x0F
+		o = _mm_or_si128(o, _mm_and_si128(x, whole)); //d2
+		_mm_storeu_si128((__m128i *) out, o); //the last four bytes are slack
+	}
+	djg2mac_scalar(in, out, pairs - i);
+}
+#endif
+
+void (*convert)(const unsigned char *in, unsigned char *out, long pairs);
+
+// Read until length bytes or end of file. Returns the count, or -1.
+long read_full(int fd, unsigned char *buf, long length)
+{
+	long done = 0, c;
+
+	while (done < length)
+	{
+		if ((c = read(fd, buf + done, length - done)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (c == 0)
+			break;
+		done += c;
+	}
+	return done;
+}
+
+int write_full(int fd, unsigned char *buf, long length)
+{
+	long c;
+
+	while (length > 0)
+	{
+		if ((c = write(fd, buf, length)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += c;
+		length -= c;
+	}
+	return 0;
+}
+
+// Convert one file. Returns 0, or 1 after reporting an error.
+int convert_file(const char *in_file, const char *out_file, unsigned char *in_buf, unsigned char *out_buf)
+{
+	int num_in = mac_to_djg ? MAC_BYTES : DJG_BYTES;
+	int num_out = mac_to_djg ? DJG_BYTES : MAC_BYTES;
+	long long count_in = 0, count_out = 0;
+	long c;
+	int input, output;
+	struct stat in_st, out_st;
+
+	if ((input = open(in_file, O_RDONLY)) < 0)
 	{
 		fprintf(stderr, "On file %s ", in_file);
 		perror("open failed");
-		exit(1);
+		return 1;
 	}
-	if (output == NULL)
+	// Opening the output truncates it, so it must not be the input
+	if (fstat(input, &in_st) == 0 && stat(out_file, &out_st) == 0 &&
+	    in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino)
+	{
+		fprintf(stderr, "%s: the output %s is the input file\n", in_file, out_file);
+		close(input);
+		return 1;
+	}
+	if ((output = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
 	{
 		fprintf(stderr, "On file %s ", out_file);
 		perror("open failed");
-		exit(1);
+		close(input);
+		return 1;
 	}
-
-	while (!feof(input))
+	while ((c = read_full(input, in_buf, chunk_pairs * num_in)) > 0)
 	{
-		int num_in = NUM_IN;
-		int num_out = NUM_OUT;
-		
-		if ((c = fread(in_buf, 1, num_in, input)) < 0)
-		{
-			perror("file read failed");
-			exit(1);
-		}
+		long pairs = c / num_in;
+
 		count_in += c;
-		
-		if (!feof(input) && c != num_in)
+		if (c % num_in)
+			fprintf(stderr, "%s: ignoring %ld bytes at the end\n", in_file, c % num_in);
+		convert(in_buf, out_buf, pairs);
+		if (write_full(output, out_buf, pairs * num_out))
 		{
-			fprintf(stderr, "Failed to read %d bytes! Got %d bytes.\n", num_in, c);
-			exit(1);
+			fprintf(stderr, "On file %s ", out_file);
+			perror("file write failed");
+			close(input);
+			close(output);
+			return 1;
 		}
-		else if (feof(input))
-			break;
+		count_out += pairs * num_out;
+	}
+	if (c < 0)
+	{
+		fprintf(stderr, "On file %s ", in_file);
+		perror("file read failed");
+	}
+	close(input);
+	if (close(output) < 0)
+	{
+		fprintf(stderr, "On file %s ", out_file);
+		perror("file write failed");
+		return 1;
+	}
+	if (c < 0)
+		return 1;
 
-//Mac: ABCD EFGH = aaabbbcc cdddeeef ffggghhh
-//DJG: ABCD EFGH = bbcccddd 0000aaab ffggghhh 0000eeef
+	pthread_mutex_lock(&lock);
+	total_in += count_in;
+	total_out += count_out;
+	if (file_count > 1)
+		printf("%s: read %lld bytes and wrote %lld bytes\n", in_file, count_in, count_out);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
 
-#ifdef DJG_TO_MAC
-		out_buf[0] = ((in_buf[1] << 4) & 0xF0) | ((in_buf[0] >> 4) & 0x0F);
-		out_buf[1] = ((in_buf[0] << 4) & 0xF0) | (in_buf[3] & 0xF);
-		out_buf[2] = in_buf[2];
-#elif defined(MAC_TO_DJG)
-		out_buf[0] = ((in_buf[0] << 4) & 0xF0) | ((in_buf[1] >> 4) & 0x0F);
-		out_buf[1] = (in_buf[0] >> 4) & 0x0F;
-		out_buf[2] = in_buf[2];
-		out_buf[3] = in_buf[1] & 0x0F;
-#endif
-		
-		if ((c = fwrite(out_buf, 1, num_out, output)) < 0)
+void *worker(void *arg)
+{
+	unsigned char *in_buf = malloc(chunk_pairs * DJG_BYTES + SLACK);
+	unsigned char *out_buf = malloc(chunk_pairs * DJG_BYTES + SLACK);
+	char out_file[4096];
+
+	if (in_buf == NULL || out_buf == NULL)
+	{
+		perror("malloc");
+		exit(1);
+	}
+	for (;;)
+	{
+		int i, failed;
+
+		pthread_mutex_lock(&lock);
+		i = next_file++;
+		pthread_mutex_unlock(&lock);
+		if (i >= file_count)
+			break;
+		if (out_dir)
 		{
-			perror("file write failed");
-			exit(1);
+			char *name = strdup(in_files[i]);
+			snprintf(out_file, sizeof(out_file), "%s/%s", out_dir, basename(name));
+			free(name);
 		}
-		count_out += c;
-		if (c != num_out)
+		else
+			snprintf(out_file, sizeof(out_file), "%s", in_files[1]);
+		failed = convert_file(in_files[i], out_file, in_buf, out_buf);
+		pthread_mutex_lock(&lock);
+		failures += failed;
+		pthread_mutex_unlock(&lock);
+	}
+	free(in_buf);
+	free(out_buf);
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	char *name = basename(argv[0]);
+	long chunk_mb = CHUNK_MB;
+	struct timespec start, end;
+	int c;
+
+	if (strstr(name, "mac2djg"))
+		mac_to_djg = 1;
+	else if (strstr(name, "djg2mac"))
+		mac_to_djg = 0;
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(argc, argv, "d:j:c:o:")) != -1)
+	{
+		switch (c)
 		{
-			fprintf(stderr, "Failed to write %d bytes! Got %d bytes.\n", num_in, c);
-			exit(1);
+			case 'd':
+				if (!strcmp(optarg, "mac2djg"))
+					mac_to_djg = 1;
+				else if (!strcmp(optarg, "djg2mac"))
+					mac_to_djg = 0;
+				else
+					mac_to_djg = -1;
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				break;
+			case 'c':
+				chunk_mb = atol(optarg);
+				break;
+			case 'o':
+				out_dir = optarg;
+				break;
+			default:
+				mac_to_djg = -1;
+				break;
 		}
 	}
-	printf("Read %d bytes and wrote %d bytes\n", count_in, count_out);
-	return 0;
+	in_files = argv + optind;
+	file_count = argc - optind;
+	if (mac_to_djg < 0 || chunk_mb <= 0 || (out_dir ? file_count < 1 : file_count != 2))
+	{
+		printf(usage, argv[0], argv[0]);
+		exit(1);
+	}
+	if (!out_dir)
+		file_count = 1; //the second name is the output
+	else
+	{
+		// Inputs of the same name would be converted to the same output
+		int collisions = 0;
+
+		for (int i = 0; i < file_count; i++)
+			for (int j = 0; j < i; j++)
+			{
+				char *a = strdup(in_files[i]), *b = strdup(in_files[j]);
+
+				if (!strcmp(basename(a), basename(b)))
+				{
+					fprintf(stderr, "%s and %s would both be converted to %s/%s\n",
+						in_files[j], in_files[i], out_dir, basename(a));
+					collisions++;
+				}
+				free(a);
+				free(b);
+			}
+		if (collisions)
+			exit(1);
+	}
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > file_count)
+		jobs = file_count;
+	chunk_pairs = chunk_mb * 1024 * 1024 / DJG_BYTES;
+
+	convert = mac_to_djg ? mac2djg_scalar : djg2mac_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3"))
+		convert = mac_to_djg ? mac2djg_ssse3 : djg2mac_ssse3;
+#endif
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_t threads[jobs];
+	for (int i = 0; i < jobs; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+	for (int i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Read %lld bytes and wrote %lld bytes", total_in, total_out);
+	if (file_count > 1)
+		printf(" in %d files (%d failed)", file_count, failures);
+	printf(", %.1f MB/s\n", (seconds > 0 ? total_in / seconds / 1e6 : 0));
+	return failures != 0;
 }
@@ -0,0 +1,65 @@
+/*
+	accessfmt.c: the access log's file format
+
+	Shared by the server (accesslog.c writes it) and sdsklog and sdsksim
+	(which read it). A log file is a header followed by fixed-size
+	records, one per request, or per extent of a scatter/gather list, in
+	host byte order. Times are in microseconds unless the name says
+	otherwise.
+*/
+
+#include <stdint.h>
+
+#define ACCESS_MAGIC "SDSKLOG1"
+
+struct access_header
+{
+	char magic[8];
+	uint32_t record_bytes; //sizeof(struct access_record)
+	uint32_t bits_per_sec; //of the serial line
+	char port[48]; //the serial device
+};
+
+struct access_record
+{
+	uint64_t time_ns; //CLOCK_REALTIME when the wakeup character came in
+	uint8_t wakeup; //the wakeup character, with its dense and checksum bits
+	uint8_t region; //disk * 2 + side
+	uint8_t flags;
+	uint8_t pages;
+	uint16_t block; //first block within the side
+	uint16_t status; //the last acknowledgment: 0 done, or NACK | code
+	uint32_t header_us; //wakeup to all the request headers read (first extent only)
+	uint32_t disk_us; //reading or writing the image (or the read-ahead cache)
+	uint32_t data_us; //the data phase on the line, with the check for stray characters
+	uint32_t total_us; //from the start of the extent to the last acknowledgment sent
+};
+
+#define ACCESS_WRITE 01
+#define ACCESS_EXTENT 02 //a later extent of a scatter/gather list
+#define ACCESS_DIAL 04 //served in DIAL mode
+#define ACCESS_CACHED 010 //a read served from the read-ahead cache
+
+// Append the records of a log file to *records, fill in its header. Returns the number read.
+long access_load(const char *name, struct access_header *header, struct access_record **records, long *count)
+{
+	FILE *f = fopen(name, "rb");
+	long size;
+
+	if (f == NULL)
+		err(1, "%s", name);
+	if (fread(header, sizeof(*header), 1, f) != 1 || memcmp(header->magic, ACCESS_MAGIC, sizeof(header->magic)))
+		errx(1, "%s is not an access log", name);
+	if (header->record_bytes != sizeof(struct access_record))
+		errx(1, "%s has %u byte records, not %zu", name, header->record_bytes, sizeof(struct access_record));
+	fseek(f, 0, SEEK_END);
+	size = (ftell(f) - sizeof(*header)) / sizeof(struct access_record);
+	fseek(f, sizeof(*header), SEEK_SET);
+	if ((*records = realloc(*records, (*count + size) * sizeof(struct access_record))) == NULL)
+		err(1, "%s", name);
+	size = fread(*records + *count, sizeof(struct access_record), size, f);
+	*count += size;
+	fclose(f);
+	header->port[sizeof(header->port) - 1] = 0;
+	return size;
+}
@@ -0,0 +1,191 @@
+/*
+	accesslog.c: the binary access log
+
+	With -L file, each request (each extent of a scatter/gather list) is
+	recorded in a fixed-size binary record (see accessfmt.c): when it
+	came, the drive and side, direction, block, pages, how it ended and
+	how long each phase took. sdsklog reads the files back.
+
+	Records are kept in memory and written ACCESS_BUFFERED at a time,
+	when the line has been idle for a second, and at exit. When a file
+	would grow past ACCESS_LOG_BYTES it is renamed file.1 (file.1 to
+	file.2 and so on, keeping ACCESS_LOG_KEEP) and a new one started.
+	There are two buffers, so that with -R one can be written by the
+	writer thread (see realtime.c) while the other fills.
+
+	With or without -L the last ACCESS_RECENT records, and the requests
+	and pages of each side, are kept for the control socket's stats
+	command (control.c), which sdsktop shows.
+*/
+
+#include "accessfmt.c"
+
+#define ACCESS_BUFFERED 0200 //records held before they are written
+#define ACCESS_LOG_BYTES (4 * 1024 * 1024) //before the log is rotated
+#define ACCESS_LOG_KEEP 4 //old logs kept
+#define ACCESS_IDLE_MS 1000 //line idle before held records are written
+#define ACCESS_RECENT 64 //records kept for stats
+
+char *access_path;
+int access_file = -1;
+long access_file_bytes;
+struct access_header access_header;
+struct access_record access_buf[2][ACCESS_BUFFERED];
+int access_fill; //the buffer being filled
+int access_count, access_writing; //records in it, and in the one being written
+struct timespec access_flushed;
+
+// For stats.
+struct access_record access_recent[ACCESS_RECENT];
+long access_recent_count; //ended, the latest ACCESS_RECENT kept
+long access_requests[DISK_COUNT * 2][2], access_pages[DISK_COUNT * 2][2]; //reads, writes of each side
+long access_nacks;
+
+// What the current extent has done so far.
+struct access_record access_rec;
+struct timespec access_start;
+
+static long access_us(struct timespec *from)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) * 1000000 + (now.tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int access_open()
+{
+	if ((access_file = open(access_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+	{
+		fprintf(stderr, MAKE_RED "Warning: can't open the access log %s: %s\n" RESET_COLOR, access_path, strerror(errno));
+		return -1;
+	}
+	access_file_bytes = lseek(access_file, 0, SEEK_END);
+	if (access_file_bytes == 0 && write(access_file, &access_header, sizeof(access_header)) == sizeof(access_header))
+		access_file_bytes = sizeof(access_header);
+	return 0;
+}
+
+// Start a new log, keeping the old ones as file.1 ... file.ACCESS_LOG_KEEP.
+static void access_rotate()
+{
+	char from[512], to[512];
+
+	close(access_file);
+	for (int i = ACCESS_LOG_KEEP; i > 0; i--)
+	{
+		if (i == 1)
+			snprintf(from, sizeof(from), "%s", access_path);
+		else
+			snprintf(from, sizeof(from), "%s.%d", access_path, i - 1);
+		snprintf(to, sizeof(to), "%s.%d", access_path, i);
+		rename(from, to);
+	}
+	access_open();
+}
+
+// Write access_writing records, as an rt_defer job.
+static void access_write(void *records)
+{
+	long bytes = access_writing * sizeof(struct access_record);
+
+	if (access_file_bytes + bytes > ACCESS_LOG_BYTES && access_file_bytes > sizeof(access_header))
+		access_rotate();
+	if (access_file >= 0 && write(access_file, records, bytes) != bytes)
+	{
+		fprintf(stderr, MAKE_RED "Warning: can't write the access log %s, no longer logging\n" RESET_COLOR, access_path);
+		close(access_file);
+		access_file = -1;
+	}
+	access_file_bytes += bytes;
+}
+
+void access_flush()
+{
+	clock_gettime(CLOCK_MONOTONIC, &access_flushed);
+	if (access_file < 0 || access_count == 0)
+		return;
+	rt_drain(); //the other buffer has been written
+	access_writing = access_count;
+	rt_defer(access_write, access_buf[access_fill]);
+	access_fill ^= 1;
+	access_count = 0;
+}
+
+void access_init(const char *port, long bits_per_sec)
+{
+	if (access_path == NULL)
+		return;
+	memcpy(access_header.magic, ACCESS_MAGIC, sizeof(access_header.magic));
+	access_header.record_bytes = sizeof(struct access_record);
+	access_header.bits_per_sec = bits_per_sec;
+	strncpy(access_header.port, port, sizeof(access_header.port) - 1);
+	if (access_open() == 0)
+		printf("Logging requests to %s\n", access_path);
+}
+
+// Called while the line is idle.
+void access_idle()
+{
+	if (access_count && access_us(&access_flushed) >= ACCESS_IDLE_MS * 1000)
+		access_flush();
+}
+
+// A wakeup character came in at start. The headers have just been read.
+void access_begin(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(&access_rec, 0, sizeof(access_rec));
+	access_rec.time_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec - access_us(start) * 1000;
+	access_rec.wakeup = wakeup;
+	access_rec.header_us = access_us(start);
+	clock_gettime(CLOCK_MONOTONIC, &access_start);
+}
+
+// Add the time since from to one of the current extent's phases.
+void access_phase(uint32_t *phase, struct timespec *from)
+{
+	*phase += access_us(from);
+}
+
+// The current extent, which asked for pages at block of a side, has ended with status.
+void access_end(int region, int block, int pages, int write, int status)
+{
+	struct access_record *r = &access_recent[access_recent_count++ % ACCESS_RECENT];
+
+	*r = access_rec;
+	r->region = region;
+	r->block = block;
+	r->pages = pages;
+	r->flags |= (write ? ACCESS_WRITE : 0) | (dial_mode ? ACCESS_DIAL : 0);
+	r->status = status;
+	r->total_us = access_us(&access_start);
+	access_requests[region][write != 0]++;
+	access_pages[region][write != 0] += pages;
+	if (status & NACK)
+		access_nacks++;
+
+	if (access_file >= 0)
+	{
+		access_buf[access_fill][access_count] = *r;
+		if (++access_count == ACCESS_BUFFERED)
+			access_flush();
+	}
+
+	// The next extent of the list starts now.
+	access_rec.flags = ACCESS_EXTENT;
+	access_rec.header_us = access_rec.disk_us = access_rec.data_us = 0;
+	clock_gettime(CLOCK_MONOTONIC, &access_start);
+}
+
+void access_close()
+{
+	if (access_file < 0)
+		return;
+	access_flush();
+	rt_drain();
+	if (access_file >= 0)
+		close(access_file);
+}
@@ -0,0 +1,149 @@
+/*
+	blockstore.c: identical blocks kept once
+
+	The same pack is often attached more than once (a copy, a packed
+	copy, a variant with a few files changed), and OS/8 packs share much
+	of their contents anyway. The read-ahead cache (prefetch.c) keeps the
+	data of its blocks here, by content: a block that holds the same
+	bytes as one already stored, on any side of any disk, shares it and
+	adds a user. Stored blocks never change. A write lets go of the
+	blocks it covers, so a block shared with another image keeps its
+	data and the written one is read afresh: copy on write.
+
+	Data is shared between images in the same format (packed images keep
+	their blocks packed). At startup the attached images are surveyed, to
+	show how much they have in common.
+*/
+
+#include <stdint.h>
+
+#define STORE_BUCKETS 010000 //hash chains
+
+struct store_block
+{
+	struct store_block *chain;
+	uint64_t hash;
+	int users;
+	int length;
+	unsigned char bytes[];
+};
+
+struct store_block *store_table[STORE_BUCKETS];
+long store_blocks, store_users; //distinct blocks, and blocks using them
+long store_bytes, store_user_bytes; //what they take, and would take unshared
+long store_peak_bytes, store_peak_user_bytes;
+long store_lookups, store_shared; //blocks added, and those already stored
+
+static uint64_t store_hash(const unsigned char *bytes, int length)
+{
+	uint64_t h = 14695981039346656037ULL; //FNV-1a
+
+	for (int i = 0; i < length; i++)
+		h = (h ^ bytes[i]) * 1099511628211ULL;
+	return h;
+}
+
+// Add a user of a block holding these bytes. Returns NULL if memory runs out.
+struct store_block *store_get(const unsigned char *bytes, int length)
+{
+	uint64_t h = store_hash(bytes, length);
+	struct store_block **head = &store_table[h % STORE_BUCKETS], *s;
+
+	store_lookups++;
+	for (s = *head; s != NULL; s = s->chain)
+	{
+		if (s->hash == h && s->length == length && !memcmp(s->bytes, bytes, length))
+			break;
+	}
+	if (s != NULL)
+		store_shared++;
+	else
+	{
+		if ((s = malloc(sizeof(*s) + length)) == NULL)
+			return NULL;
+		s->hash = h;
+		s->users = 0;
+		s->length = length;
+		memcpy(s->bytes, bytes, length);
+		s->chain = *head;
+		*head = s;
+		store_blocks++;
+		store_bytes += sizeof(*s) + length;
+		if (store_bytes > store_peak_bytes)
+			store_peak_bytes = store_bytes;
+	}
+	s->users++;
+	store_users++;
+	store_user_bytes += sizeof(*s) + length;
+	if (store_user_bytes > store_peak_user_bytes)
+		store_peak_user_bytes = store_user_bytes;
+	return s;
+}
+
+// Let go of a block; the last user frees it.
+void store_put(struct store_block *s)
+{
+	struct store_block **p;
+
+	store_users--;
+	store_user_bytes -= sizeof(*s) + s->length;
+	if (--s->users > 0)
+		return;
+	for (p = &store_table[s->hash % STORE_BUCKETS]; *p != s; p = &(*p)->chain)
+		;
+	*p = s->chain;
+	store_blocks--;
+	store_bytes -= sizeof(*s) + s->length;
+	free(s);
+}
+
+// Count the distinct blocks of the attached images.
+void store_survey()
+{
+	static unsigned char side_buf[NUMBER_OF_BLOCKS * BLOCK_SIZE * BYTES_PER_WORD];
+	uint64_t *seen = calloc(STORE_BUCKETS * 16, sizeof(uint64_t)); //open addressing, 0 for empty
+	long total = 0, distinct = 0, slots = STORE_BUCKETS * 16;
+	int sides = 0;
+
+	if (seen == NULL)
+		return;
+	for (int side = 0; side < DISK_COUNT * 2; side++)
+	{
+		struct disk_state *disk = &disks[side / 2];
+		int length = (disk->packed ? BLOCK_SIZE / 2 * 3 : BLOCK_SIZE * BYTES_PER_WORD); //as the store keeps them
+
+		// Read the file as it is; read_from_file would unpack packed images.
+		if (!disk->in_use ||
+		    storage_read_finish(storage_read_start(disk->file, (side & 1) * NUMBER_OF_BLOCKS * length, side_buf,
+							   NUMBER_OF_BLOCKS * length)))
+			continue;
+		sides++;
+		for (int b = 0; b < NUMBER_OF_BLOCKS; b++)
+		{
+			uint64_t h = store_hash(side_buf + b * length, length) | 1;
+			long i = h % slots;
+
+			while (seen[i] != 0 && seen[i] != h)
+				i = (i + 1) % slots;
+			if (seen[i] == 0)
+			{
+				seen[i] = h;
+				distinct++;
+			}
+			total++;
+		}
+	}
+	free(seen);
+	if (sides > 1 || total > distinct)
+		printf("Images: %ld blocks on %d side%s, %ld distinct (%ld%% repeated)\n", total, sides, (sides == 1 ? "" : "s"),
+		       distinct, (total - distinct) * 100 / (total ? total : 1));
+}
+
+void store_report()
+{
+	if (store_lookups == 0)
+		return;
+	printf("Block store: %ld of %ld blocks cached were already held, at most %ld KB for %ld KB of cached blocks (%ld%% saved)\n",
+	       store_shared, store_lookups, (store_peak_bytes + 1023) / 1024, (store_peak_user_bytes + 1023) / 1024,
+	       (store_peak_user_bytes - store_peak_bytes) * 100 / (store_peak_user_bytes ? store_peak_user_bytes : 1));
+}
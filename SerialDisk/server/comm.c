@@ -1,9 +1,330 @@
 /*
 	comm.c: based on David Gesswein's dumprest/comm.c
+
+	USB serial adapters (FTDI, CP210x and the like) hold what they
+	receive until their latency timer runs out, 16 ms by default, before
+	passing it on: every header and acknowledgment turnaround waits for
+	it. init_comm notices such a port, sets the FTDI latency_timer in
+	sysfs to 1 ms and asks the driver for ASYNC_LOW_LATENCY, and puts
+	both back at exit (server.c exits through cleanup_and_exit on
+	SIGTERM and SIGHUP too). Small writes that go out together (the words that
+	answer a request header, the status and page number before a checked
+	page) can be gathered between comm_hold and comm_push, so they leave
+	in one USB packet rather than one each. Only these are gathered: the
+	data of a transfer is written as it is, in one write or a page at a
+	time, and the driver cuts it into packets itself. How long the
+	request headers take to come in beyond their line time is reported
+	at exit, which shows the latency timer at work.
+
+	With -T the port is served by two threads of its own, joined to
+	the rest of the server by rings (ring.c). The receive thread reads
+	whatever arrives into one, so input is taken off the port even while
+	the server waits on the disk; ser_read takes it from there, waiting
+	at most 0.1 second as the port's VTIME would. ser_write puts bytes in
+	the other, and the transmit thread writes them to the port, so the
+	server goes on converting while they go out. Each ring is a FIFO
+	with one producer and one consumer, so the order of bytes on the
+	line is exactly the order they were written and read.
 */
 
-#define ser_read(a,b,c) read(a,b,c)
-#define ser_write(a,b,c) write(a,b,c)
+#include <limits.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#include "ring.c"
+
+#define ser_read(a,b,c) comm_read(a,b,c)
+#define ser_write(a,b,c) comm_write(a,b,c)
+
+#define COMM_GATHER 64 //bytes gathered for one write, a full speed USB packet; longer writes go as they are
+#define COMM_SAMPLES 1024 //header turnarounds kept for the report
+#define COMM_RING_BYTES 0200000 //each way, more than the largest transfer
+#define COMM_READ_MS 100 //as VTIME 1
+
+int comm_threaded = 0; //receive and transmit threads (-T)
+struct ring comm_rx, comm_tx;
+pthread_t comm_rx_thread, comm_tx_thread;
+int comm_port = -1;
+int comm_rx_error;
+
+int comm_gather; //between comm_hold and comm_push
+unsigned char comm_held[COMM_GATHER];
+int comm_held_count;
+
+// What was changed, to put back at exit.
+int comm_fd = -1;
+char comm_latency_path[PATH_MAX];
+int comm_latency_old = -1;
+struct serial_struct comm_serial_old;
+int comm_serial_changed;
+
+long comm_bytes_in, comm_bytes_out; //for stats (control.c)
+long comm_bytes_sent; //written to the port, by the transmit thread if there is one
+
+void rt_sent(long sent); //realtime.c
+
+long comm_turnarounds[COMM_SAMPLES]; //us beyond the line time, the latest COMM_SAMPLES
+long comm_turnaround_count;
+
+static void *comm_receive(void *unused)
+{
+	unsigned char bytes[4096];
+	int c;
+
+	trace_thread(2);
+	for (;;)
+	{
+		if ((c = read(comm_port, bytes, sizeof(bytes))) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			comm_rx_error = errno;
+			ring_close(&comm_rx);
+			return NULL;
+		}
+		if (c > 0)
+		{
+			ring_put(&comm_rx, bytes, c);
+			ring_publish(&comm_rx);
+		}
+	}
+}
+
+static void *comm_transmit(void *unused)
+{
+	unsigned char *p;
+	size_t n;
+	int c;
+
+	trace_thread(3);
+	for (;;)
+	{
+		n = ring_peek(&comm_tx, &p, -1);
+
+		uint64_t traced = trace_now();
+		if ((c = write(comm_port, p, n)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("Serial write failure");
+			exit(1);
+		}
+		trace_span("transmit", traced);
+		ring_consume(&comm_tx, c);
+		rt_sent(comm_bytes_sent += c);
+	}
+}
+
+// Start the receive and transmit threads, with no signals (^C is for the main thread).
+static void comm_start(int port_fd)
+{
+	sigset_t all, old;
+	int r;
+
+	if (ring_init(&comm_rx, COMM_RING_BYTES) < 0 || ring_init(&comm_tx, COMM_RING_BYTES) < 0)
+	{
+		perror("init_comm: rings");
+		exit(1);
+	}
+	comm_port = port_fd;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if ((r = pthread_create(&comm_rx_thread, NULL, comm_receive, NULL)) != 0 ||
+	    (r = pthread_create(&comm_tx_thread, NULL, comm_transmit, NULL)) != 0)
+	{
+		fprintf(stderr, "init_comm: can't start a thread: %s\n", strerror(r));
+		exit(1);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Read what has come in, waiting up to 0.1 second for something.
+int comm_read(int fd, void *data, int length)
+{
+	int c;
+
+	if (!comm_threaded)
+		c = read(fd, data, length);
+	else if ((c = ring_get(&comm_rx, data, length, COMM_READ_MS)) == 0 && atomic_load(&comm_rx.closed))
+	{
+		errno = comm_rx_error;
+		return -1;
+	}
+	if (c > 0)
+		comm_bytes_in += c;
+	return c;
+}
+
+// Wait until everything written has gone to the port.
+void comm_drain()
+{
+	if (!comm_threaded)
+		return;
+	ring_publish(&comm_tx);
+	ring_drain(&comm_tx);
+}
+
+// Hold small writes back until comm_push.
+void comm_hold()
+{
+	comm_gather = 1;
+}
+
+// Write, gathering with what is held if comm_hold asked for it.
+int comm_write(int fd, const void *data, int length)
+{
+	struct iovec iov[2] = { { comm_held, comm_held_count }, { (void *) data, length } };
+	uint64_t traced;
+	int c;
+
+	comm_bytes_out += length;
+	if (comm_threaded)
+	{
+		ring_put(&comm_tx, data, length);
+		if (!comm_gather)
+			ring_publish(&comm_tx);
+		return length;
+	}
+	if (comm_gather && comm_held_count + length <= sizeof(comm_held))
+	{
+		memcpy(comm_held + comm_held_count, data, length);
+		comm_held_count += length;
+		return length;
+	}
+	traced = trace_now();
+	if (comm_held_count == 0)
+		c = write(fd, data, length);
+	else if ((c = writev(fd, iov, 2)) >= 0)
+		c = (c < comm_held_count ? 0 : c - comm_held_count);
+	if (c >= 0)
+		rt_sent(comm_bytes_sent = comm_bytes_out - length + c);
+	comm_held_count = 0;
+	trace_span("transmit", traced);
+	return c;
+}
+
+// Send what is held, and stop gathering.
+void comm_push(int fd)
+{
+	comm_gather = 0;
+	if (comm_threaded)
+		ring_publish(&comm_tx);
+	else if (comm_held_count)
+	{
+		uint64_t traced = trace_now();
+
+		if (write(fd, comm_held, comm_held_count) != comm_held_count)
+			fprintf(stderr, MAKE_RED "Warning: failed to send entire buffer!\n" RESET_COLOR);
+		rt_sent(comm_bytes_sent = comm_bytes_out);
+		trace_span("transmit", traced);
+	}
+	comm_held_count = 0;
+}
+
+static int comm_read_number(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	int n = -1;
+
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%d", &n) != 1)
+		n = -1;
+	fclose(f);
+	return n;
+}
+
+static int comm_write_number(const char *path, int n)
+{
+	FILE *f = fopen(path, "w");
+
+	if (f == NULL)
+		return -1;
+	fprintf(f, "%d\n", n);
+	return fclose(f);
+}
+
+// Put back the latency settings init_comm changed.
+static void comm_restore()
+{
+	if (comm_latency_old >= 0)
+		comm_write_number(comm_latency_path, comm_latency_old);
+	if (comm_serial_changed)
+		ioctl(comm_fd, TIOCSSERIAL, &comm_serial_old);
+}
+
+// If the port is a USB serial adapter, turn its latency down.
+static void comm_tune_usb(int port_fd, const char *port)
+{
+	char dev[PATH_MAX], device[256], link[PATH_MAX];
+	struct serial_struct serial;
+	const char *name;
+	int latency;
+
+	if (realpath(port, dev) == NULL)
+		return;
+	name = strrchr(dev, '/') + 1;
+	snprintf(device, sizeof(device), "/sys/class/tty/%s/device", name);
+	if (realpath(device, link) == NULL || strstr(link, "/usb") == NULL)
+		return;
+	comm_fd = port_fd;
+	printf("USB serial adapter %s:", name);
+	snprintf(comm_latency_path, sizeof(comm_latency_path), "%s/latency_timer", device);
+	if ((latency = comm_read_number(comm_latency_path)) < 0)
+		printf(" no latency timer,");
+	else if (latency <= 1)
+		printf(" latency timer %d ms,", latency);
+	else if (comm_write_number(comm_latency_path, 1) == 0 && comm_read_number(comm_latency_path) == 1)
+	{
+		comm_latency_old = latency;
+		printf(" latency timer %d -> 1 ms,", latency);
+	}
+	else
+		printf(" latency timer %d ms (can't change it: %s),", latency, strerror(errno));
+	if (ioctl(port_fd, TIOCGSERIAL, &serial) < 0)
+		printf(" low latency not supported\n");
+	else if (serial.flags & ASYNC_LOW_LATENCY)
+		printf(" low latency already on\n");
+	else
+	{
+		comm_serial_old = serial;
+		serial.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(port_fd, TIOCSSERIAL, &serial) == 0)
+		{
+			comm_serial_changed = 1;
+			printf(" low latency on\n");
+		}
+		else
+			printf(" low latency not supported\n");
+	}
+	if (comm_latency_old >= 0 || comm_serial_changed)
+		atexit(comm_restore);
+}
+
+// The headers of a request took us to come in, of which line_us was the line.
+void comm_turnaround(long us, long line_us)
+{
+	comm_turnarounds[comm_turnaround_count++ % COMM_SAMPLES] = (us > line_us ? us - line_us : 0);
+}
+
+static int comm_compare_long(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+	return (x > y) - (x < y);
+}
+
+void comm_report()
+{
+	long n = (comm_turnaround_count < COMM_SAMPLES ? comm_turnaround_count : COMM_SAMPLES);
+
+	if (n == 0)
+		return;
+	qsort(comm_turnarounds, n, sizeof(long), comm_compare_long);
+	printf("Header turnaround beyond the line time: median %.1f ms, 90%% %.1f ms, max %.1f ms (last %ld request%s)\n",
+	       comm_turnarounds[n / 2] / 1e3, comm_turnarounds[n * 9 / 10] / 1e3, comm_turnarounds[n - 1] / 1e3,
+	       n, (n == 1 ? "" : "s"));
+}
 
 #ifdef _STDC_
 int init_comm(char *, long, int);
@@ -52,6 +373,9 @@ int init_comm(char* port, long baud, int two_stop)
 	}
 	
 	tcflush(port_fd,TCIOFLUSH);
+	comm_tune_usb(port_fd, port);
+	if (comm_threaded)
+		comm_start(port_fd);
 	
 	return(port_fd);
 }
@@ -0,0 +1,444 @@
+/*
+	control.c: the control socket
+
+	With -C path the server listens on a UNIX socket and, while the
+	serial line is idle between requests, takes commands from it. Each
+	connection carries one command line and gets back zero or more lines
+	of output and a last line starting with "ok", "busy" or "error":
+
+	dir A                  list the OS/8 directory of side A
+	put A NAME.EX words    followed by 2 * words bytes of data (disk
+	                       format: low byte, then high four bits),
+	                       make or replace the file
+	delete A NAME.EX       delete the file
+	heat A [n]             the n (default 10) most used blocks of side A
+	heatmap A              the map of side A's block accesses (heatmap.c)
+	save A                 write the memory disk holding side A to its
+	                       file (memdisk.c)
+	stats                  counters for sdsktop, one per line: the time,
+	                       line rate, bytes each way, requests, cache,
+	                       each side's activity, the response time
+	                       histogram (realtime.c) and the last requests
+
+	A-H name the sides as the wakeup characters do. A new file goes in
+	the first empty area that holds it. The data is written before the
+	directory, and both go through the storage engine and the read-ahead
+	cache like the PDP-8's own writes, so the next read sees them.
+
+	The PDP-8 keeps no copy of the directory between USR calls, but it
+	does between reading a segment and writing it back. So that we do
+	not change it under the PDP-8's feet, a side is busy while a file is
+	open for output (a tentative entry) and for a while after the PDP-8
+	reads the directory without writing it; sdskctl retries then. A
+	program that already looked a file up and reads it later will still
+	see whatever is there by then.
+
+	While something asks for stats at least every CONTROL_WATCH_MS, the
+	server leaves out the lines it prints for each request; the
+	dashboard shows them instead. Warnings are still printed.
+*/
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONTROL_QUIET_MS 1000 //after a directory read, before we change it
+#define CONTROL_CHUNK 8 //blocks per image read or write
+#define CONTROL_WATCH_MS 3000 //after stats, before request lines come back
+
+char *control_path;
+int control_socket = -1;
+struct timespec control_dir_read[PREFETCH_SIDES]; //0 once written back
+unsigned char control_buf[CONTROL_CHUNK * BLOCK_BYTES];
+struct os8_volume control_volume;
+struct timespec control_watched; //the last stats
+
+void control_init()
+{
+	struct sockaddr_un addr = { AF_UNIX };
+
+	if (control_path == NULL)
+		return;
+	if (strlen(control_path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, MAKE_RED "Warning: control socket path %s is too long\n" RESET_COLOR, control_path);
+		return;
+	}
+	strcpy(addr.sun_path, control_path);
+	unlink(control_path);
+	if ((control_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+	    bind(control_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(control_socket, 4) < 0)
+	{
+		perror("Control socket");
+		if (control_socket >= 0)
+			close(control_socket);
+		control_socket = -1;
+		return;
+	}
+	printf("Control socket %s\n", control_path);
+}
+
+void control_close()
+{
+	if (control_socket < 0)
+		return;
+	close(control_socket);
+	unlink(control_path);
+}
+
+// The PDP-8 read or wrote count blocks at block of a side.
+void control_note(int side, int block, int count, int write)
+{
+	if (control_socket < 0 || block > OS8_DIR_LAST || block + count <= OS8_DIR_FIRST)
+		return;
+	if (write)
+		control_dir_read[side] = (struct timespec) { 0 };
+	else
+		clock_gettime(CLOCK_MONOTONIC, &control_dir_read[side]);
+}
+
+// Whether a dashboard is watching, so the request lines can be left out.
+int control_watching()
+{
+	struct timespec now;
+
+	if (control_watched.tv_sec == 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - control_watched.tv_sec) * 1000 + (now.tv_nsec - control_watched.tv_nsec) / 1000000 <
+	       CONTROL_WATCH_MS;
+}
+
+// The counters sdsktop turns into rates; it keeps the previous ones.
+static void control_stats(FILE *out)
+{
+	long retransmits = 0, first = access_recent_count - ACCESS_RECENT;
+
+	clock_gettime(CLOCK_MONOTONIC, &control_watched);
+	fprintf(out, "time %ld.%06ld\n", (long) control_watched.tv_sec, control_watched.tv_nsec / 1000);
+	fprintf(out, "line %ld\n", bits_per_sec);
+	fprintf(out, "bytes %ld %ld\n", comm_bytes_in, comm_bytes_out);
+	for (int i = DISK_NUM_MIN; i < DISK_COUNT; i++)
+		retransmits += disks[i].retransmits;
+	fprintf(out, "errors %ld %ld\n", access_nacks, retransmits);
+	fprintf(out, "cache %ld %ld\n", prefetch_hits, prefetch_misses);
+	for (int side = 0; side < DISK_COUNT * 2; side++)
+	{
+		if (disks[side / 2].in_use)
+			fprintf(out, "side %c %s %d %ld %ld %ld %ld\n", 'A' + side, disk_num_strings[side / 2], side & 1,
+				access_requests[side][0], access_requests[side][1], access_pages[side][0], access_pages[side][1]);
+	}
+	fprintf(out, "latency");
+	for (int b = 0; b < RT_BUCKETS; b++)
+		fprintf(out, " %ld", rt_latency[b]);
+	fprintf(out, "\n");
+	for (long i = (first > 0 ? first : 0); i < access_recent_count; i++)
+	{
+		struct access_record *r = &access_recent[i % ACCESS_RECENT];
+
+		fprintf(out, "recent %llu %c %c %05o %d %04o %u%s\n", (unsigned long long) r->time_ns / 1000000, 'A' + r->region,
+			(r->flags & ACCESS_WRITE ? 'w' : 'r'), r->block, r->pages, r->status, r->total_us,
+			(r->flags & ACCESS_CACHED ? " cached" : ""));
+	}
+	fprintf(out, "ok\n");
+}
+
+static int control_busy(int side)
+{
+	struct timespec now;
+
+	if (control_dir_read[side].tv_sec == 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - control_dir_read[side].tv_sec) * 1000 +
+	       (now.tv_nsec - control_dir_read[side].tv_nsec) / 1000000 < CONTROL_QUIET_MS;
+}
+
+// Move count words at block of a side between words and the image. Returns 0 on success.
+static int control_transfer(int side, int block, unsigned short *words, long count, int write)
+{
+	struct disk_state *disk = &disks[side / 2];
+
+	for (long done = 0; done < count; done += CONTROL_CHUNK * BLOCK_SIZE)
+	{
+		int n = count - done < CONTROL_CHUNK * BLOCK_SIZE ? count - done : CONTROL_CHUNK * BLOCK_SIZE;
+		int offset = ((side & 1) * NUMBER_OF_BLOCKS + block + done / BLOCK_SIZE) * BLOCK_BYTES;
+
+		if (write)
+		{
+			for (int i = 0; i < n; i++)
+			{
+				control_buf[2 * i] = words[done + i] & 0377;
+				control_buf[2 * i + 1] = (words[done + i] >> 8) & 017;
+			}
+			if (write_to_file(disk, offset, control_buf, n * BYTES_PER_WORD))
+				return -1;
+		}
+		else
+		{
+			if (read_from_file(disk, offset, control_buf, n * BYTES_PER_WORD))
+				return -1;
+			for (int i = 0; i < n; i++)
+				words[done + i] = ((control_buf[2 * i + 1] & 017) << 8) | control_buf[2 * i];
+		}
+	}
+	if (write && side == 0 && block == 0)
+		build_boot_images(); //what NUL and @ send comes from there
+	return 0;
+}
+
+// Read a put's data, padded to whole blocks. Returns NULL if it is too long or short.
+static unsigned short *control_receive(FILE *in, long words)
+{
+	int blocks = (words + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	unsigned short *data;
+
+	if (words <= 0 || blocks > NUMBER_OF_BLOCKS || (data = calloc(blocks, BLOCK_SIZE * sizeof(*data))) == NULL)
+		return NULL;
+	for (long i = 0; i < words; i++)
+	{
+		int low = getc(in), high = getc(in);
+
+		if (high == EOF)
+		{
+			free(data);
+			return NULL;
+		}
+		data[i] = (high << 8 | low) & 07777;
+	}
+	return data;
+}
+
+static const char *control_error(int status)
+{
+	switch (status)
+	{
+		case OS8_ERR_BAD: return "error no OS/8 directory";
+		case OS8_ERR_TENTATIVE: return "busy a file is open for output";
+		case OS8_ERR_FULL: return "error directory full";
+		case OS8_ERR_SPACE: return "error no room";
+		case OS8_ERR_NAME: return "error bad file name";
+	}
+	return "error";
+}
+
+// Run one command. Replies go to out; put data comes from in.
+static void control_command(char *line, FILE *in, FILE *out)
+{
+	static unsigned short dir[OS8_DIR_LAST][OS8_DIR_WORDS];
+	struct os8_volume *v = &control_volume;
+	char command[16], drive, name[16];
+	long words = 0;
+	int side, status, e;
+	int fields = sscanf(line, "%15s %c %15s %ld", command, &drive, name, &words);
+
+	if (fields == 1 && !strcmp(command, "stats"))
+	{
+		control_stats(out);
+		return;
+	}
+	if (fields < 2 || drive < 'A' || drive > 'H')
+	{
+		fprintf(out, "error usage: dir A | put A NAME.EX words | delete A NAME.EX | heat A [n] | heatmap A | save A | stats\n");
+		return;
+	}
+	side = drive - 'A';
+	if (disks[side / 2].in_use && !strcmp(command, "heat"))
+	{
+		heat_top(side, (fields >= 3 && atoi(name) > 0 ? atoi(name) : HEAT_TOP), out);
+		fprintf(out, "ok\n");
+		return;
+	}
+	if (disks[side / 2].in_use && !strcmp(command, "heatmap") && fields == 2)
+	{
+		int touched = heat_map(side, out);
+		fprintf(out, "ok %d block%s touched\n", touched, (touched == 1 ? "" : "s"));
+		return;
+	}
+	if (disks[side / 2].in_use && !strcmp(command, "save") && fields == 2)
+	{
+		if (!disks[side / 2].in_memory)
+			fprintf(out, "error disk %c is not in memory\n", drive);
+		else if (memdisk_save_path[side / 2] == NULL)
+			fprintf(out, "error disk %c has no file to save to\n", drive);
+		else if (memdisk_save(side / 2) < 0)
+			fprintf(out, "error saving disk %c: %s\n", drive, strerror(errno));
+		else
+			fprintf(out, "ok saved to %s\n", memdisk_save_path[side / 2]);
+		return;
+	}
+	if (!disks[side / 2].in_use || dial_mode)
+	{
+		fprintf(out, "error no OS/8 disk %c\n", drive);
+		return;
+	}
+	if (strcmp(command, "dir") && disks[side / 2].write_protect)
+	{
+		fprintf(out, "error disk %c is write-protected\n", drive);
+		return;
+	}
+	if (control_transfer(side, OS8_DIR_FIRST, dir[0], OS8_DIR_LAST * OS8_DIR_WORDS, 0))
+	{
+		fprintf(out, "error reading the directory\n");
+		return;
+	}
+	status = os8_read_volume(dir, NUMBER_OF_BLOCKS, v);
+
+	if (!strcmp(command, "dir") && fields == 2 && status != OS8_ERR_BAD)
+	{
+		int files = 0, free_blocks = 0;
+		char entry_name[11];
+
+		for (e = 0; e < v->entry_count; e++)
+		{
+			if (v->entries[e].name[0] == 0)
+			{
+				free_blocks += v->entries[e].length;
+				continue;
+			}
+			os8_entry_name(&v->entries[e], entry_name);
+			fprintf(out, "%-10s %5d %05o", entry_name, v->entries[e].length, v->entries[e].start);
+			if (v->info_words && v->entries[e].info[0])
+			{
+				int date = v->entries[e].info[0];
+				fprintf(out, " %02d/%02d/%d", date >> 8, (date >> 3) & 037, 1970 + (date & 7));
+			}
+			fprintf(out, "%s\n", (v->entries[e].length ? "" : " (tentative)"));
+			files++;
+		}
+		fprintf(out, "ok %d file%s, %d free block%s\n", files, (files == 1 ? "" : "s"), free_blocks, (free_blocks == 1 ? "" : "s"));
+		return;
+	}
+	if ((!strcmp(command, "put") && fields == 4) || (!strcmp(command, "delete") && fields == 3))
+	{
+		unsigned short name_words[4];
+		int old = os8_find(v, name), blocks = 0, first = 0;
+		unsigned short *data = NULL;
+		struct timespec start, end;
+
+		if (command[0] == 'p')
+		{
+			blocks = (words + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			if ((data = control_receive(in, words)) == NULL)
+			{
+				fprintf(out, "error bad length or short data\n");
+				return;
+			}
+		}
+		if (status == 0 && control_busy(side))
+		{
+			free(data);
+			fprintf(out, "busy the PDP-8 is using the directory\n");
+			return;
+		}
+		if (status == 0 && os8_name_words(name, name_words))
+			status = OS8_ERR_NAME;
+		if (status == 0 && command[0] == 'd' && old < 0)
+		{
+			fprintf(out, "error no file %s\n", name);
+			return;
+		}
+		if (status != 0)
+		{
+			free(data);
+			fprintf(out, "%s\n", control_error(status));
+			return;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (command[0] == 'p')
+		{
+			// Keep the old file until the new one is written, if there is room.
+			int count = v->entry_count;
+
+			e = os8_allocate(v, name_words, blocks, os8_date(time(NULL)));
+			if (e == OS8_ERR_SPACE && old >= 0)
+			{
+				os8_delete(v, old);
+				old = -1;
+				e = os8_allocate(v, name_words, blocks, os8_date(time(NULL)));
+			}
+			if (e < 0)
+			{
+				free(data);
+				fprintf(out, "%s\n", control_error(e));
+				return;
+			}
+			if (old >= e && v->entry_count > count)
+				old++;
+			first = v->entries[e].start;
+			os8_entry_name(&v->entries[e], name);
+		}
+		if (old >= 0)
+		{
+			if (blocks == 0)
+				os8_entry_name(&v->entries[old], name);
+			os8_delete(v, old);
+		}
+		if ((status = os8_write_volume(v, dir)) < 0)
+		{
+			free(data);
+			fprintf(out, "%s\n", control_error(status));
+			return;
+		}
+		if (data != NULL && control_transfer(side, first, data, (long) blocks * BLOCK_SIZE, 1))
+			status = -1;
+		free(data);
+		if (status >= 0 && control_transfer(side, OS8_DIR_FIRST, dir[0], OS8_DIR_LAST * OS8_DIR_WORDS, 1))
+			status = -1;
+		if (status < 0)
+		{
+			fprintf(out, "error writing the image\n");
+			return;
+		}
+		if (blocks)
+			prefetch_after_write(side, first, blocks);
+		prefetch_after_write(side, OS8_DIR_FIRST, OS8_DIR_LAST);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+		if (blocks)
+		{
+			if (!control_watching())
+				printf(MAKE_GREEN "Control: put %s, %d block%s at %05o of side %d on %s disk in %.1f ms\n" RESET_COLOR,
+				       name, blocks, (blocks == 1 ? "" : "s"), first, side & 1, disk_num_strings[side / 2], ms);
+			fprintf(out, "ok %s %d block%s at %05o\n", name, blocks, (blocks == 1 ? "" : "s"), first);
+		}
+		else
+		{
+			if (!control_watching())
+				printf(MAKE_GREEN "Control: deleted %s from side %d on %s disk in %.1f ms\n" RESET_COLOR,
+				       name, side & 1, disk_num_strings[side / 2], ms);
+			fprintf(out, "ok deleted %s\n", name);
+		}
+		return;
+	}
+	if (status == OS8_ERR_BAD)
+		fprintf(out, "%s\n", control_error(status));
+	else
+		fprintf(out, "error usage: dir A | put A NAME.EX words | delete A NAME.EX | heat A [n] | heatmap A | save A | stats\n");
+}
+
+// Take any commands waiting on the control socket. Called while the line is idle.
+void control_poll()
+{
+	struct timeval timeout = { 2, 0 };
+	char line[128];
+	FILE *in, *out;
+	int c;
+
+	if (control_socket < 0)
+		return;
+	while ((c = accept(control_socket, NULL, NULL)) >= 0)
+	{
+		setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		in = fdopen(c, "r");
+		out = fdopen(dup(c), "w");
+		if (in == NULL || out == NULL)
+			err(1, "fdopen");
+		if (fgets(line, sizeof(line), in))
+			control_command(line, in, out);
+		fclose(out);
+		fclose(in);
+	}
+}
@@ -0,0 +1,232 @@
+/*
+	harness.c: run the server over a pseudo-terminal, for the test drivers
+
+	Included by loadgen.c and pdp8e.c. The server is started on the
+	slave side of a pty, in a scratch directory holding its own disk.cfg
+	and a copy of the image (packed three bytes per two words with -k),
+	with its output going to a log there. image[] holds what the image
+	should hold, both sides; the driver keeps it up to date as it writes,
+	and when the server has exited the image file is compared with it.
+*/
+
+#define SERVER_TIMEOUT 10 //seconds to wait for the server to answer
+
+int master;
+unsigned short *image; //what the image should hold
+long image_words;
+struct os8_dir dir;
+
+int packed;
+
+char scratch[32], image_path[256], cfg_path[256], log_path[256];
+pid_t server_pid;
+int to_server;
+
+// Write the expected image in the server's format. Returns 0 on success.
+int save_image(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	int ok = f != NULL;
+
+	for (long i = 0; ok && i < image_words; i += 2)
+	{
+		unsigned a = image[i], b = image[i + 1];
+		if (packed)
+			ok = putc(a >> 4, f) != EOF && putc(((a & 017) << 4) | (b >> 8), f) != EOF && putc(b & 0377, f) != EOF;
+		else
+			ok = fwrite(&image[i], 2, 2, f) == 2;
+	}
+	return (f == NULL || fclose(f) != 0 || !ok);
+}
+
+// Compare the image file with what it should hold. Returns the number of bad words.
+long check_image(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	long bad = 0;
+	int c[4];
+
+	if (f == NULL)
+		return image_words;
+	for (long i = 0; i < image_words; i += 2)
+	{
+		unsigned a, b;
+		for (int j = 0; j < (packed ? 3 : 4); j++)
+			c[j] = getc(f);
+		if (c[packed ? 2 : 3] == EOF)
+			return bad + image_words - i;
+		if (packed)
+		{
+			a = (c[0] << 4) | (c[1] >> 4);
+			b = ((c[1] & 017) << 8) | c[2];
+		}
+		else
+		{
+			a = (c[0] | (c[1] << 8)) & 07777;
+			b = (c[2] | (c[3] << 8)) & 07777;
+		}
+		bad += (a != image[i]) + (b != image[i + 1]);
+	}
+	fclose(f);
+	return bad;
+}
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void send_bytes(unsigned char *b, int length)
+{
+	while (length > 0)
+	{
+		int c = write(master, b, length);
+		if (c < 0)
+			err(1, "pty write");
+		b += c;
+		length -= c;
+	}
+}
+
+// Wait for data from the server. Returns 0, or -1 if it has nothing to say.
+int wait_server(int timeout)
+{
+	fd_set fds;
+	struct timeval tv = { timeout, 0 };
+
+	FD_ZERO(&fds);
+	FD_SET(master, &fds);
+	return select(master + 1, &fds, NULL, NULL, &tv) > 0 ? 0 : -1;
+}
+
+void receive_bytes(unsigned char *b, int length)
+{
+	while (length > 0)
+	{
+		int c;
+
+		if (wait_server(SERVER_TIMEOUT))
+			errx(1, "timed out waiting for the server");
+		if ((c = read(master, b, length)) <= 0)
+			err(1, "pty read");
+		b += c;
+		length -= c;
+	}
+}
+
+// Read both sides of an image into image[] and parse side 0's directory.
+void load_image(const char *name)
+{
+	FILE *f;
+
+	if ((f = fopen(name, "rb")) == NULL)
+		err(1, "%s", name);
+	image = calloc(NUMBER_OF_BLOCKS * 2, BLOCK_SIZE * 2);
+	image_words = fread(image, 2, NUMBER_OF_BLOCKS * 2 * BLOCK_SIZE, f);
+	fclose(f);
+	if (image_words < NUMBER_OF_BLOCKS * BLOCK_SIZE)
+		errx(1, "%s is too short", name);
+	image_words &= ~1L;
+	for (long i = 0; i < image_words; i++)
+		image[i] &= 07777;
+	os8_parse_dir((unsigned short (*)[OS8_DIR_WORDS]) (image + BLOCK_SIZE), NUMBER_OF_BLOCKS, &dir);
+}
+
+// Start the server on a copy of image[], passing it options as well.
+void start_server(const char *server, char **options, int option_count)
+{
+	char server_path[256];
+	FILE *f;
+
+	strcpy(scratch, "/tmp/sdskXXXXXX");
+	if (mkdtemp(scratch) == NULL || realpath(server, server_path) == NULL)
+		err(1, "setup");
+	snprintf(image_path, sizeof(image_path), "%s/image.dsk", scratch);
+	if (save_image(image_path))
+		err(1, "%s", image_path);
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(master) || unlockpt(master))
+		err(1, "pty");
+	struct termios tios;
+	tcgetattr(master, &tios);
+	cfmakeraw(&tios);
+	tcsetattr(master, TCSANOW, &tios);
+	snprintf(cfg_path, sizeof(cfg_path), "%s/disk.cfg", scratch);
+	if ((f = fopen(cfg_path, "w")) == NULL)
+		err(1, "%s", cfg_path);
+	fprintf(f, "9600\n0\n%s\n", ptsname(master));
+	fclose(f);
+	snprintf(log_path, sizeof(log_path), "%s/server.log", scratch);
+
+	int pipe_fds[2];
+	pipe(pipe_fds);
+	if ((server_pid = fork()) == 0)
+	{
+		char *args[option_count + 4];
+		int n = 0;
+
+		args[n++] = server_path;
+		args[n++] = "-1";
+		args[n++] = "image.dsk";
+		for (int i = 0; i < option_count; i++)
+			args[n++] = options[i];
+		args[n] = NULL;
+		chdir(scratch);
+		dup2(pipe_fds[0], 0);
+		int out = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		dup2(out, 1);
+		dup2(out, 2);
+		close(pipe_fds[1]);
+		execv(server_path, args);
+		err(1, "%s", server_path);
+	}
+	close(pipe_fds[0]);
+	to_server = pipe_fds[1];
+	usleep(300000);
+}
+
+// Stop the server the way a user would: ^C, and yes to the quit prompt.
+void stop_server()
+{
+	kill(server_pid, SIGINT);
+	usleep(200000);
+	write(to_server, "y\n", 2);
+	waitpid(server_pid, NULL, 0);
+}
+
+// Compare the image file with image[], pass on the server's own report
+// (which follows the quit prompt), and remove the scratch directory.
+// Returns the number of words that differ.
+long finish_server()
+{
+	long bad = check_image(image_path);
+	char line[512];
+	int report = 0;
+	FILE *f;
+
+	if (bad)
+		printf("The image file has %ld word%s that differ from what was written\n", bad, (bad == 1 ? "" : "s"));
+	if ((f = fopen(log_path, "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), f))
+		{
+			char *p = strstr(line, "Really quit? [y/N] ");
+			if (p)
+			{
+				report = 1;
+				memmove(line, p + 19, strlen(p + 19) + 1);
+			}
+			if (report && *line)
+				fputs(line, stdout);
+		}
+		fclose(f);
+	}
+
+	unlink(image_path);
+	unlink(cfg_path);
+	unlink(log_path);
+	rmdir(scratch);
+	return bad;
+}
@@ -0,0 +1,225 @@
+/*
+	heatmap.c: per-block access counts
+
+	Every block of every side (disk * 2 + side, as in prefetch.c) has a
+	count of the PDP-8's reads and writes of it and the time it was last
+	touched, so caches can be sized and images laid out from what the
+	PDP-8 really does. A request counts once for each block it covers.
+
+	The counts can be seen while the server runs through the control
+	socket (heat and heatmap, see control.c), and with -H file they are
+	written to that file when the server exits, and the hottest blocks
+	are listed on the way out. The map shows each block as one
+	character, darker for more accesses on a log scale relative to the
+	side's hottest block. Where a side has an OS/8 directory, blocks are
+	named by what lies there: boot, directory, system (the system head
+	before the first file), a file name or empty.
+*/
+
+#define HEAT_TOP 10 //hottest blocks listed by default
+#define HEAT_MAX_TOP 0100
+#define HEAT_ROW 0100 //blocks per line of the map
+
+struct heat_block
+{
+	unsigned long reads;
+	unsigned long writes;
+	time_t last; //0 if never touched
+};
+
+char *heat_path;
+struct heat_block heat[PREFETCH_SIDES][NUMBER_OF_BLOCKS];
+struct os8_volume heat_volume;
+
+static const char heat_scale[] = " .:-=+*#%@";
+static const char heat_drives[] = "ABCDEFGH";
+
+// The PDP-8 read or wrote count blocks at block of a side.
+void heat_note(int side, int block, int count, int write)
+{
+	time_t now = time(NULL);
+
+	for (int i = block; i < block + count && i < NUMBER_OF_BLOCKS; i++)
+	{
+		if (write)
+			heat[side][i].writes++;
+		else
+			heat[side][i].reads++;
+		heat[side][i].last = now;
+	}
+}
+
+// Read the OS/8 directory of a side into heat_volume. Returns 0 if there is one.
+static int heat_load(int side)
+{
+	static unsigned short dir[OS8_DIR_LAST][OS8_DIR_WORDS];
+	unsigned char raw[OS8_DIR_LAST * BLOCK_BYTES];
+	struct disk_state *disk = &disks[side / 2];
+
+	if (!disk->in_use || dial_mode ||
+	    read_from_file(disk, ((side & 1) * NUMBER_OF_BLOCKS + OS8_DIR_FIRST) * BLOCK_BYTES, raw, sizeof(raw)))
+		return -1;
+	for (int i = 0; i < OS8_DIR_LAST * OS8_DIR_WORDS; i++)
+		dir[i / OS8_DIR_WORDS][i % OS8_DIR_WORDS] = ((raw[2 * i + 1] & 017) << 8) | raw[2 * i];
+	if (os8_read_volume(dir, NUMBER_OF_BLOCKS, &heat_volume) == OS8_ERR_BAD)
+		return -1;
+	return 0;
+}
+
+// Name what lies at block of the side whose directory is in heat_volume.
+static const char *heat_area(int block, char *name)
+{
+	struct os8_volume *v = &heat_volume;
+
+	if (block == 0)
+		return v->first_block > OS8_DIR_LAST + 1 ? "boot" : "";
+	if (block <= OS8_DIR_LAST)
+		return "directory";
+	if (block < v->first_block)
+		return "system";
+	for (int e = 0; e < v->entry_count; e++)
+	{
+		if (block >= v->entries[e].start && block < v->entries[e].start + v->entries[e].length)
+		{
+			if (v->entries[e].name[0] == 0)
+				return "empty";
+			os8_entry_name(&v->entries[e], name);
+			return name;
+		}
+	}
+	return "";
+}
+
+static int heat_bits(unsigned long n)
+{
+	int bits = 0;
+
+	for (; n; n >>= 1)
+		bits++;
+	return bits;
+}
+
+// List the count hottest blocks of a side, or of all sides if side < 0.
+void heat_top(int side, int count, FILE *out)
+{
+	struct { int side, block; unsigned long total; } top[HEAT_MAX_TOP];
+	int found = 0;
+	char name[11], when[16];
+
+	if (count > HEAT_MAX_TOP)
+		count = HEAT_MAX_TOP;
+	for (int s = 0; s < PREFETCH_SIDES; s++)
+	{
+		if (side >= 0 && s != side)
+			continue;
+		for (int b = 0; b < NUMBER_OF_BLOCKS; b++)
+		{
+			unsigned long total = heat[s][b].reads + heat[s][b].writes;
+			int i;
+
+			if (total == 0 || (found == count && total <= top[count - 1].total))
+				continue;
+			if (found < count)
+				found++;
+			for (i = found - 1; i > 0 && top[i - 1].total < total; i--)
+				top[i] = top[i - 1];
+			top[i].side = s;
+			top[i].block = b;
+			top[i].total = total;
+		}
+	}
+	for (int i = 0; i < found; i++)
+	{
+		struct heat_block *h = &heat[top[i].side][top[i].block];
+
+		strftime(when, sizeof(when), "%H:%M:%S", localtime(&h->last));
+		fprintf(out, "  %c %05o %8lu read%s %8lu write%s  last %s  %s\n", heat_drives[top[i].side], top[i].block,
+		        h->reads, (h->reads == 1 ? " " : "s"), h->writes, (h->writes == 1 ? " " : "s"), when,
+		        (heat_load(top[i].side) ? "" : heat_area(top[i].block, name)));
+	}
+}
+
+// Draw the map of a side. Returns the number of blocks touched.
+int heat_map(int side, FILE *out)
+{
+	unsigned long most = 0, reads = 0, writes = 0;
+	int touched = 0, bits;
+
+	for (int b = 0; b < NUMBER_OF_BLOCKS; b++)
+	{
+		unsigned long total = heat[side][b].reads + heat[side][b].writes;
+
+		if (total > most)
+			most = total;
+		reads += heat[side][b].reads;
+		writes += heat[side][b].writes;
+		touched += total != 0;
+	}
+	bits = heat_bits(most);
+	fprintf(out, "%c: side %d on %s disk, %lu block read%s and %lu write%s, %d block%s touched, at most %lu time%s\n",
+	        heat_drives[side], side & 1, disk_num_strings[side / 2], reads, (reads == 1 ? "" : "s"),
+	        writes, (writes == 1 ? "" : "s"), touched, (touched == 1 ? "" : "s"), most, (most == 1 ? "" : "s"));
+	fprintf(out, "       ");
+	for (int b = 0; b < HEAT_ROW; b += 010)
+		fprintf(out, "%-8o", b);
+	fprintf(out, "\n");
+	for (int row = 0; row < NUMBER_OF_BLOCKS; row += HEAT_ROW)
+	{
+		fprintf(out, "%05o  ", row);
+		for (int b = row; b < row + HEAT_ROW && b < NUMBER_OF_BLOCKS; b++)
+		{
+			unsigned long total = heat[side][b].reads + heat[side][b].writes;
+			int level = total ? (heat_bits(total) * (sizeof(heat_scale) - 2) + bits - 1) / bits : 0;
+
+			putc(heat_scale[level], out);
+		}
+		fprintf(out, "\n");
+	}
+	fprintf(out, "Scale: '%s' from untouched to %lu\n", heat_scale, most);
+	return touched;
+}
+
+// Write the maps, the hottest blocks and every count to heat_path, and list the hottest blocks.
+void heat_report()
+{
+	char name[11], when[32];
+	FILE *f;
+
+	if (heat_path == NULL)
+		return;
+	if ((f = fopen(heat_path, "w")) == NULL)
+	{
+		fprintf(stderr, MAKE_RED "Warning: can't write the block heatmap to %s\n" RESET_COLOR, heat_path);
+		return;
+	}
+	for (int side = 0; side < PREFETCH_SIDES; side++)
+	{
+		if (disks[side / 2].in_use)
+		{
+			heat_map(side, f);
+			fprintf(f, "\n");
+		}
+	}
+	fprintf(f, "Hottest blocks:\n");
+	heat_top(-1, HEAT_TOP, f);
+	fprintf(f, "\nDrive Block    Reads   Writes Last access          Area\n");
+	for (int side = 0; side < PREFETCH_SIDES; side++)
+	{
+		int os8 = heat_load(side) == 0;
+
+		for (int b = 0; b < NUMBER_OF_BLOCKS; b++)
+		{
+			struct heat_block *h = &heat[side][b];
+
+			if (h->last == 0)
+				continue;
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&h->last));
+			fprintf(f, "%c     %05o %8lu %8lu %s    %s\n", heat_drives[side], b, h->reads, h->writes, when,
+			        (os8 ? heat_area(b, name) : ""));
+		}
+	}
+	if (fclose(f) != 0)
+		fprintf(stderr, MAKE_RED "Warning: can't write the block heatmap to %s\n" RESET_COLOR, heat_path);
+	printf("Hottest blocks (all counts in %s):\n", heat_path);
+	heat_top(-1, HEAT_TOP, stdout);
+}
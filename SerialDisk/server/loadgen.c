@@ -0,0 +1,314 @@
+/*
+	loadgen.c: drive the server over a pseudo-terminal
+
+	Runs the server on the slave side of a pty (see harness.c), in a
+	scratch directory holding its own disk.cfg and a copy of the image,
+	and plays the PDP-8 end of the OS/8 handler protocol against it.
+	Requests walk through the files in the OS/8 directory the way
+	programs load and save them (random runs of blocks if there is no
+	directory), some of them writes. Every read is checked against a copy
+	of the image kept here, and when the server has exited the image file
+	is compared with it, so a run is a correctness test as well as a
+	benchmark. With -k the server is given a packed (three bytes per two
+	words) copy. -u gives the percentage of writes that put back what is
+	already there, as OS/8 does with directory segments and PIP with
+	files it copies over themselves. With -l the requests go as lists
+	of up to that many extents (see process_list in server.c), each list
+	all reads or all writes.
+
+	A pty has no line speed, so the times are the server's own: header
+	to first data byte is what the image I/O costs a read. Note that the
+	server waits 0.1 second for stray bytes after every transfer, which
+	puts a floor under each request.
+
+	Usage: loadgen [-n requests] [-w percent writes] [-u percent unchanged]
+	               [-p max pages] [-l extents] [-s seed] [-k] [-x server] image [server options]
+*/
+
+#define _GNU_SOURCE
+#include <termios.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#define PAGE_SIZE 0200
+#define BLOCK_SIZE (PAGE_SIZE * 2)
+#define NUMBER_OF_BLOCKS 06260
+#define MAX_WORDS (PAGE_SIZE * 037)
+#define MAX_EXTENTS 040 //as in server.c
+#define MAX_LIST_PAGES 0400
+
+#include "os8dir.c"
+#include "harness.c"
+
+static const char usage[] = "Usage: %s [-n requests] [-w percent] [-u percent] [-p pages] [-l extents] [-s seed] [-k] [-x server] image [server options]\n";
+
+void send_word(int w)
+{
+	unsigned char b[2] = { w & 0377, (w >> 6) & 077 };
+	send_bytes(b, 2);
+}
+
+int receive_word()
+{
+	unsigned char b[2];
+	receive_bytes(b, 2);
+	return ((b[0] & 077) << 6) | (b[1] & 077);
+}
+
+/*
+ * One handler call on side 0 of the first disk. A write of new data
+ * (write 2) changes every word, a write 1 sends the words back as they
+ * are. Returns the time from sending the header to the first data byte,
+ * or -1 on an error status.
+ */
+double request(int write, int pages, int block)
+{
+	static unsigned char data[MAX_WORDS * 2];
+	int words = pages * PAGE_SIZE;
+	double start = now(), first;
+	unsigned short *w = image + (long) block * BLOCK_SIZE;
+
+	send_bytes((unsigned char *) "A", 1);
+	send_word((write ? 04000 : 0) | (pages << 6));
+	send_word(01000); //buffer address
+	send_word(block);
+	receive_word(); //CDF
+	receive_word(); //word count
+	if (receive_word() & 02000)
+		return -1;
+	if (write)
+	{
+		first = now();
+		for (int i = 0; i < words; i++)
+		{
+			if (write > 1)
+				w[i] = random() & 07777;
+			data[2 * i] = w[i] & 077;
+			data[2 * i + 1] = w[i] >> 6;
+		}
+		send_bytes(data, words * 2);
+	}
+	else
+	{
+		receive_bytes(data, 1);
+		first = now();
+		receive_bytes(data + 1, words * 2 - 1);
+		for (int i = 0; i < words; i++)
+		{
+			if ((((data[2 * i] & 077) << 6) | (data[2 * i + 1] & 077)) != w[i])
+				errx(1, "bad data at block %04o word %04o", block + i / BLOCK_SIZE, i % BLOCK_SIZE);
+		}
+	}
+	if (receive_word() & 02000)
+		return -1;
+	return first - start;
+}
+
+struct extent
+{
+	int write, pages, block;
+};
+
+/*
+ * A list of calls on side 0 of the first disk, all reads or all writes,
+ * answered with one acknowledgment, the data of all of them in one
+ * stream, and one status. Returns as request does.
+ */
+double request_list(struct extent *list, int count)
+{
+	static unsigned char data[MAX_LIST_PAGES * PAGE_SIZE * 2];
+	int write = list[0].write, bytes = 0;
+	double start = now(), first;
+
+	send_bytes((unsigned char *) "I", 1);
+	send_word(count);
+	for (int e = 0; e < count; e++)
+	{
+		send_word((write ? 04000 : 0) | (list[e].pages << 6));
+		send_word(01000); //buffer address
+		send_word(list[e].block);
+	}
+	if (receive_word() & 02000)
+		return -1;
+	if (write)
+	{
+		first = now();
+		for (int e = 0; e < count; e++)
+		{
+			unsigned short *w = image + (long) list[e].block * BLOCK_SIZE;
+
+			for (int i = 0; i < list[e].pages * PAGE_SIZE; i++, bytes += 2)
+			{
+				if (list[e].write > 1)
+					w[i] = random() & 07777;
+				data[bytes] = w[i] & 077;
+				data[bytes + 1] = w[i] >> 6;
+			}
+		}
+		send_bytes(data, bytes);
+	}
+	else
+	{
+		for (int e = 0; e < count; e++)
+			bytes += list[e].pages * PAGE_SIZE * 2;
+		receive_bytes(data, 1);
+		first = now();
+		receive_bytes(data + 1, bytes - 1);
+		bytes = 0;
+		for (int e = 0; e < count; e++)
+		{
+			unsigned short *w = image + (long) list[e].block * BLOCK_SIZE;
+
+			for (int i = 0; i < list[e].pages * PAGE_SIZE; i++, bytes += 2)
+			{
+				if ((((data[bytes] & 077) << 6) | (data[bytes + 1] & 077)) != w[i])
+					errx(1, "bad data at block %04o word %04o", list[e].block + i / BLOCK_SIZE, i % BLOCK_SIZE);
+			}
+		}
+	}
+	if (receive_word() & 02000)
+		return -1;
+	return first - start;
+}
+
+int compare(const void *a, const void *b)
+{
+	double x = *(double *) a, y = *(double *) b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+	int requests = 200, write_percent = 10, same_percent = 0, max_pages = 16, max_extents = 0, c;
+	unsigned seed = 1;
+	char *server = "./server";
+
+	while ((c = getopt(argc, argv, "+n:w:u:p:l:s:kx:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n': requests = atoi(optarg); break;
+			case 'w': write_percent = atoi(optarg); break;
+			case 'u': same_percent = atoi(optarg); break;
+			case 'p': max_pages = atoi(optarg); break;
+			case 'l': max_extents = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			case 'k': packed = 1; break;
+			case 'x': server = optarg; break;
+			default:
+				fprintf(stderr, usage, argv[0]);
+				exit(1);
+		}
+	}
+	if (optind >= argc || max_pages < 2 || max_pages > 036 || max_extents < 0 || max_extents > MAX_EXTENTS)
+	{
+		fprintf(stderr, usage, argv[0]);
+		exit(1);
+	}
+	srandom(seed);
+	load_image(argv[optind]);
+	start_server(server, argv + optind + 1, argc - optind - 1);
+
+	double *first = malloc(requests * sizeof(double));
+	struct extent list[MAX_EXTENTS];
+	int reads = 0, writes = 0, files = 0, timed = 0, lists = 0, count = 0, pages_listed = 0;
+	long words = 0;
+	double start = now();
+
+	for (int done = 0; done < requests; )
+	{
+		int block, length;
+
+		if (dir.valid && dir.file_count)
+		{
+			struct os8_file *file = &dir.files[random() % dir.file_count];
+			block = file->start;
+			length = file->length;
+		}
+		else
+		{
+			length = 1 + random() % 16;
+			block = 7 + random() % (NUMBER_OF_BLOCKS - 7 - length);
+		}
+		int write = (random() % 100) < write_percent;
+		if (write && (random() % 100) >= same_percent)
+			write = 2;
+		files++;
+		while (length > 0 && done < requests)
+		{
+			int pages = length * 2 < max_pages ? length * 2 : max_pages & ~1;
+
+			if (max_extents)
+			{
+				// Send what is listed first if this one can't join it.
+				if (count && (!write != !list[0].write || pages_listed + pages > MAX_LIST_PAGES))
+				{
+					double t = request_list(list, count);
+
+					if (t < 0)
+						errx(1, "server refused a list at block %04o", list[0].block);
+					if (!list[0].write)
+						first[timed++] = t;
+					lists++;
+					count = pages_listed = 0;
+				}
+				list[count++] = (struct extent) { write, pages, block };
+				pages_listed += pages;
+			}
+			else
+			{
+				double t = request(write, pages, block);
+
+				if (t < 0)
+					errx(1, "server refused block %04o", block);
+				if (!write)
+					first[timed++] = t;
+			}
+			if (write)
+				writes++;
+			else
+				reads++;
+			words += pages * PAGE_SIZE;
+			block += pages / 2;
+			length -= pages / 2;
+			done++;
+			if (count && (count == max_extents || done == requests))
+			{
+				double t = request_list(list, count);
+
+				if (t < 0)
+					errx(1, "server refused a list at block %04o", list[0].block);
+				if (!list[0].write)
+					first[timed++] = t;
+				lists++;
+				count = pages_listed = 0;
+			}
+		}
+	}
+	double elapsed = now() - start;
+
+	stop_server();
+
+	qsort(first, timed, sizeof(double), compare);
+	double sum = 0;
+	for (int i = 0; i < timed; i++)
+		sum += first[i];
+	printf("%d requests (%d reads, %d writes) through %d file%s in %.2f s: %.1f requests/s, %.1f KW/s\n",
+	       requests, reads, writes, files, (files == 1 ? "" : "s"), elapsed, requests / elapsed, words / elapsed / 1024);
+	if (lists)
+		printf("Sent as %d list%s, %.1f extents each\n", lists, (lists == 1 ? "" : "s"), (double) requests / lists);
+	if (timed)
+		printf("Header to first data byte: mean %.0f us, median %.0f us, 99%% %.0f us, max %.0f us\n",
+		       sum / timed * 1e6, first[timed / 2] * 1e6, first[timed * 99 / 100] * 1e6, first[timed - 1] * 1e6);
+
+	return finish_server() != 0;
+}
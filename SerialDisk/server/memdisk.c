@@ -0,0 +1,149 @@
+/*
+	memdisk.c: drives held only in memory (-M)
+
+	With -M n[,file] disk n is kept in memory: a scratch drive for the
+	temporary files of PAL8, FORTRAN and the like, which then never reach
+	the SD card. It starts as a copy of its image (-n image), or, with
+	no image or one that doesn't exist yet, as a blank RK05 pack: both
+	sides with an empty OS/8 directory (all zeros in DIAL mode). The
+	image itself is never written.
+
+	The copy is a memfd, so it is read and written through the same
+	storage engine, packed or not, with the same addressing as any
+	other drive, at the speed of memory. If a file is given the pack is
+	saved to it at exit, and on the control socket's save command; it is
+	written beside the file and renamed over it, so a crash part way
+	leaves the old one whole.
+*/
+
+#include <sys/mman.h>
+
+#define MEMDISK_CHUNK (64 * 1024) //bytes copied at a time
+
+char *memdisk_save_path[DISK_COUNT]; //where -M n,file saves, or NULL
+
+// Copy all of one file to another, from the start. Returns bytes copied, or -1.
+static long memdisk_copy(int from, int to)
+{
+	static unsigned char chunk[MEMDISK_CHUNK];
+	long done = 0;
+	int c;
+
+	while ((c = pread_all(from, done, chunk, sizeof(chunk))) > 0)
+	{
+		for (int w = 0, n; w < c; w += n)
+		{
+			if ((n = pwrite(to, chunk + w, c - w, done + w)) <= 0)
+				return -1;
+		}
+		done += c;
+	}
+	return c < 0 ? -1 : done;
+}
+
+// A blank pack: each side gets an empty OS/8 directory with the rest of it free.
+static int memdisk_format(int file)
+{
+	static struct os8_volume v;
+	unsigned short dir[OS8_DIR_LAST][OS8_DIR_WORDS];
+	unsigned char bytes[OS8_DIR_LAST * OS8_DIR_WORDS * BYTES_PER_WORD];
+	int segments;
+
+	if (ftruncate(file, 2L * FILE_LENGTH) < 0)
+		return -1;
+	if (dial_mode)
+		return 0;
+	v.first_block = OS8_DIR_LAST + 1;
+	v.info_words = 1; //the date
+	v.device_blocks = NUMBER_OF_BLOCKS;
+	v.entry_count = 1;
+	v.entries[0] = (struct os8_entry) { .start = v.first_block, .length = NUMBER_OF_BLOCKS - v.first_block };
+	if ((segments = os8_write_volume(&v, dir)) < 0)
+		return -1;
+	for (int i = 0; i < segments * OS8_DIR_WORDS; i++)
+	{
+		bytes[2 * i] = dir[0][i] & 0377;
+		bytes[2 * i + 1] = dir[0][i] >> 8;
+	}
+	for (int side = 0; side < 2; side++)
+	{
+		long offset = ((long) side * NUMBER_OF_BLOCKS + OS8_DIR_FIRST) * BLOCK_SIZE * BYTES_PER_WORD;
+
+		if (pwrite(file, bytes, segments * OS8_DIR_WORDS * BYTES_PER_WORD, offset) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Make the memory copy of disk i, from image if there is one. Returns
+ * the memfd to serve it from. Exits if it can't.
+ */
+int memdisk_open(int i, const char *image)
+{
+	int file = memfd_create(disk_num_strings[i], MFD_CLOEXEC), from = -1;
+
+	if (file < 0)
+	{
+		perror("memfd_create");
+		exit(1);
+	}
+	if (image != NULL && (from = open(image, O_RDONLY)) < 0 && errno != ENOENT)
+	{
+		fprintf(stderr, "On file %s ", image);
+		perror("open failed");
+		exit(1);
+	}
+	if (from >= 0 ? memdisk_copy(from, file) < 0 : memdisk_format(file) < 0)
+	{
+		fprintf(stderr, "Can't make the memory copy of the %s disk: %s\n", disk_num_strings[i], strerror(errno));
+		exit(1);
+	}
+	if (from >= 0)
+		close(from);
+	else if (image != NULL)
+		printf("%s doesn't exist yet, the %s disk starts blank\n", image, disk_num_strings[i]);
+	return file;
+}
+
+// Write disk i to its save file. Returns 0, or -1 with errno set.
+int memdisk_save(int i)
+{
+	char temp[PATH_MAX];
+	int file;
+
+	if (memdisk_save_path[i] == NULL)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	storage_wait_writes(disks[i].file, 0, INT_MAX);
+	snprintf(temp, sizeof(temp), "%s.new", memdisk_save_path[i]);
+	if ((file = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		return -1;
+	if (memdisk_copy(disks[i].file, file) < 0 || fsync(file) < 0)
+	{
+		int e = errno;
+
+		close(file);
+		unlink(temp);
+		errno = e;
+		return -1;
+	}
+	close(file);
+	if (rename(temp, memdisk_save_path[i]) < 0)
+		return -1;
+	printf(MAKE_GREEN "Saved the %s disk to %s\n" RESET_COLOR, disk_num_strings[i], memdisk_save_path[i]);
+	return 0;
+}
+
+// At exit, before the images are closed.
+void memdisk_close()
+{
+	for (int i = DISK_NUM_MIN; i < DISK_COUNT; i++)
+	{
+		if (disks[i].in_memory && memdisk_save_path[i] != NULL && memdisk_save(i) < 0)
+			fprintf(stderr, MAKE_RED "Warning: can't save the %s disk to %s: %s\n" RESET_COLOR, disk_num_strings[i],
+				memdisk_save_path[i], strerror(errno));
+	}
+}
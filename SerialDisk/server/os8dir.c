@@ -0,0 +1,359 @@
+/*
+	os8dir.c: OS/8 directory parsing and editing
+
+	The directory of an OS/8 device lives in blocks 1-6, one segment per
+	block. Each segment starts with a five word header:
+
+	-(number of entries)
+	first block of the files described by this segment
+	next segment (0 if this is the last)
+	tentative file flag
+	-(number of additional information words)
+
+	followed by the entries. A permanent file is four words of sixbit
+	name and extension, the additional information words, and -(length).
+	An empty area is a zero word and -(length). Files are contiguous and
+	are laid out in directory order, so each entry's starting block is
+	the sum of the lengths before it. A tentative file (one open for
+	output) is a permanent entry with a zero length. The tentative file
+	flag is not cleared when the file is closed, so it is not trusted.
+
+	For editing, the segments are read into one list of entries
+	(struct os8_volume), changed, and laid out into segments again.
+*/
+
+#define OS8_DIR_FIRST 1 //first directory segment
+#define OS8_DIR_LAST 6 //last possible directory segment
+#define OS8_DIR_WORDS 0400 //words per segment
+#define OS8_MAX_FILES 0600 //more than can fit in six segments
+#define OS8_MAX_ENTRIES 01400
+#define OS8_MAX_INFO 010 //additional information words
+
+#define OS8_ERR_BAD -1 //not a sane directory
+#define OS8_ERR_TENTATIVE -2 //a file is open for output
+#define OS8_ERR_FULL -3 //no room in the directory
+#define OS8_ERR_SPACE -4 //no empty area big enough
+#define OS8_ERR_NAME -5 //not a valid file name
+
+struct os8_file
+{
+	char name[11]; //NAME.EX
+	int start;
+	int length;
+};
+
+struct os8_dir
+{
+	int valid;
+	int file_count;
+	struct os8_file files[OS8_MAX_FILES];
+};
+
+struct os8_entry
+{
+	unsigned short name[4]; //name[0] == 0 for an empty area
+	unsigned short info[OS8_MAX_INFO];
+	int start;
+	int length; //0 for a tentative file
+};
+
+struct os8_volume
+{
+	int first_block; //of the file area
+	int info_words;
+	int device_blocks;
+	int entry_count;
+	int tentative;
+	struct os8_entry entries[OS8_MAX_ENTRIES];
+};
+
+// Turn a sixbit word into two characters, dropping padding.
+static char *os8_sixbit(int word, char *out)
+{
+	for (int shift = 6; shift >= 0; shift -= 6)
+	{
+		int c = (word >> shift) & 077;
+		if (c != 0)
+			*out++ = c < 040 ? c + 0100 : c;
+	}
+	return out;
+}
+
+// Format an entry's name as NAME.EX into out (11 bytes).
+void os8_entry_name(struct os8_entry *e, char *out)
+{
+	char *name = os8_sixbit(e->name[0], out);
+
+	name = os8_sixbit(e->name[1], name);
+	name = os8_sixbit(e->name[2], name);
+	*name++ = '.';
+	name = os8_sixbit(e->name[3], name);
+	if (name[-1] == '.')
+		name--;
+	*name = 0;
+}
+
+// Turn NAME.EX into four sixbit words. Returns 0, or OS8_ERR_NAME.
+int os8_name_words(const char *name, unsigned short words[4])
+{
+	char chars[8] = {0};
+	int n = 0;
+
+	for (; *name && *name != '.'; name++)
+	{
+		if (n == 6)
+			return OS8_ERR_NAME;
+		chars[n++] = *name;
+	}
+	if (*name == '.')
+	{
+		name++;
+		for (n = 6; *name; name++)
+		{
+			if (n == 8)
+				return OS8_ERR_NAME;
+			chars[n++] = *name;
+		}
+	}
+	if (chars[0] == 0)
+		return OS8_ERR_NAME;
+	for (int i = 0; i < 8; i++)
+	{
+		int c = chars[i];
+
+		if (c >= 'a' && c <= 'z')
+			c -= 040;
+		if (c != 0 && !(c >= 'A' && c <= 'Z') && !(c >= '0' && c <= '9'))
+			return OS8_ERR_NAME;
+		chars[i] = c & 077;
+	}
+	for (int i = 0; i < 4; i++)
+		words[i] = (chars[2 * i] << 6) | chars[2 * i + 1];
+	return 0;
+}
+
+/*
+ * Read the directory from the words of blocks 1-6 (dir[0] is block 1)
+ * into v. device_blocks bounds the file area. Returns 0, OS8_ERR_BAD, or
+ * (with v filled in) OS8_ERR_TENTATIVE if a file is open for output.
+ */
+int os8_read_volume(unsigned short dir[OS8_DIR_LAST][OS8_DIR_WORDS], int device_blocks, struct os8_volume *v)
+{
+	int visited = 0;
+	int block = -1;
+
+	v->entry_count = 0;
+	v->tentative = 0;
+	v->device_blocks = device_blocks;
+	for (int segment = OS8_DIR_FIRST; segment != 0; )
+	{
+		if (segment > OS8_DIR_LAST || (visited & (1 << segment)))
+			return OS8_ERR_BAD;
+		visited |= 1 << segment;
+
+		unsigned short *w = dir[segment - OS8_DIR_FIRST];
+		int entries = -w[0] & 07777;
+		int info = -w[4] & 07777;
+		int pos = 5;
+
+		if (block < 0)
+		{
+			v->first_block = block = w[1] & 07777;
+			v->info_words = info;
+		}
+		if (entries > OS8_DIR_WORDS / 2 || info > OS8_MAX_INFO || info != v->info_words || (w[1] & 07777) != block)
+			return OS8_ERR_BAD;
+		for (int e = 0; e < entries; e++)
+		{
+			struct os8_entry *entry = &v->entries[v->entry_count];
+
+			if (v->entry_count == OS8_MAX_ENTRIES)
+				return OS8_ERR_BAD;
+			memset(entry, 0, sizeof(*entry));
+			if (w[pos] != 0) //permanent (or tentative) file
+			{
+				if (pos + 4 + info >= OS8_DIR_WORDS)
+					return OS8_ERR_BAD;
+				memcpy(entry->name, &w[pos], sizeof(entry->name));
+				memcpy(entry->info, &w[pos + 4], info * sizeof(*w));
+				entry->length = -w[pos + 4 + info] & 07777;
+				if (entry->length == 0)
+					v->tentative = 1;
+				pos += 5 + info;
+			}
+			else //empty area
+			{
+				if (pos + 1 >= OS8_DIR_WORDS)
+					return OS8_ERR_BAD;
+				entry->length = -w[pos + 1] & 07777;
+				pos += 2;
+			}
+			entry->start = block;
+			block += entry->length;
+			v->entry_count++;
+			if (block > device_blocks)
+				return OS8_ERR_BAD;
+		}
+		segment = w[2] & 07777;
+	}
+	return v->tentative ? OS8_ERR_TENTATIVE : 0;
+}
+
+/*
+ * Lay v out into segments again, filling each one but for room for a
+ * file entry, which OS/8 wants when it makes a new file. Returns the
+ * number of segments used, or OS8_ERR_FULL.
+ */
+int os8_write_volume(struct os8_volume *v, unsigned short dir[OS8_DIR_LAST][OS8_DIR_WORDS])
+{
+	int entry_words = 5 + v->info_words;
+	int segment = 0, e = 0;
+
+	memset(dir, 0, OS8_DIR_LAST * OS8_DIR_WORDS * sizeof(**dir));
+	do
+	{
+		unsigned short *w;
+		int pos = 5, count = 0;
+
+		if (segment == OS8_DIR_LAST)
+			return OS8_ERR_FULL;
+		w = dir[segment];
+		w[1] = e < v->entry_count ? v->entries[e].start : v->device_blocks;
+		w[4] = -v->info_words & 07777;
+		for (; e < v->entry_count; e++, count++)
+		{
+			struct os8_entry *entry = &v->entries[e];
+			int words = entry->name[0] ? entry_words : 2;
+
+			if (pos + words > OS8_DIR_WORDS - entry_words)
+				break;
+			if (entry->name[0])
+			{
+				memcpy(&w[pos], entry->name, sizeof(entry->name));
+				memcpy(&w[pos + 4], entry->info, v->info_words * sizeof(*w));
+			}
+			w[pos + words - 1] = -entry->length & 07777;
+			pos += words;
+		}
+		w[0] = -count & 07777;
+		if (e < v->entry_count)
+			w[2] = segment + OS8_DIR_FIRST + 1;
+		segment++;
+	} while (e < v->entry_count);
+	return segment;
+}
+
+// Find the entry for NAME.EX. Returns its index or -1.
+int os8_find(struct os8_volume *v, const char *name)
+{
+	unsigned short words[4];
+
+	if (os8_name_words(name, words))
+		return -1;
+	for (int e = 0; e < v->entry_count; e++)
+	{
+		if (v->entries[e].name[0] && !memcmp(v->entries[e].name, words, sizeof(words)))
+			return e;
+	}
+	return -1;
+}
+
+// Turn entry e into an empty area, joining it to any empty neighbours.
+void os8_delete(struct os8_volume *v, int e)
+{
+	memset(v->entries[e].name, 0, sizeof(v->entries[e].name));
+	memset(v->entries[e].info, 0, sizeof(v->entries[e].info));
+	if (e + 1 < v->entry_count && v->entries[e + 1].name[0] == 0)
+	{
+		v->entries[e].length += v->entries[e + 1].length;
+		memmove(&v->entries[e + 1], &v->entries[e + 2], (v->entry_count - e - 2) * sizeof(*v->entries));
+		v->entry_count--;
+	}
+	if (e > 0 && v->entries[e - 1].name[0] == 0)
+	{
+		v->entries[e - 1].length += v->entries[e].length;
+		memmove(&v->entries[e], &v->entries[e + 1], (v->entry_count - e - 1) * sizeof(*v->entries));
+		v->entry_count--;
+	}
+}
+
+/*
+ * Make a file of length blocks in the first empty area that holds it.
+ * date goes in the first additional information word. Returns the new
+ * entry's index, OS8_ERR_SPACE or OS8_ERR_FULL.
+ */
+int os8_allocate(struct os8_volume *v, unsigned short name[4], int length, int date)
+{
+	for (int e = 0; e < v->entry_count; e++)
+	{
+		struct os8_entry *entry = &v->entries[e];
+
+		if (entry->name[0] != 0 || entry->length < length)
+			continue;
+		if (entry->length > length) //split off the rest
+		{
+			if (v->entry_count == OS8_MAX_ENTRIES)
+				return OS8_ERR_FULL;
+			memmove(entry + 1, entry, (v->entry_count - e) * sizeof(*entry));
+			v->entry_count++;
+			entry[1].start = entry->start + length;
+			entry[1].length = entry->length - length;
+		}
+		memcpy(entry->name, name, sizeof(entry->name));
+		if (v->info_words)
+			entry->info[0] = date;
+		entry->length = length;
+		return e;
+	}
+	return OS8_ERR_SPACE;
+}
+
+// Today's date in OS/8 form: month, day, and the year's low three bits since 1970.
+int os8_date(time_t t)
+{
+	struct tm *tm = localtime(&t);
+
+	return ((tm->tm_mon + 1) << 8) | (tm->tm_mday << 3) | ((tm->tm_year - 70) & 7);
+}
+
+/*
+ * Parse the directory from the words of blocks 1-6 (dir[0] is block 1).
+ * device_blocks bounds the file area. Returns 0 and fills in d if the
+ * directory looks sane, otherwise -1 with d->valid clear. Tentative
+ * files are left out.
+ */
+int os8_parse_dir(unsigned short dir[OS8_DIR_LAST][OS8_DIR_WORDS], int device_blocks, struct os8_dir *d)
+{
+	static struct os8_volume v;
+
+	d->valid = 0;
+	d->file_count = 0;
+	if (os8_read_volume(dir, device_blocks, &v) == OS8_ERR_BAD)
+		return -1;
+	for (int e = 0; e < v.entry_count; e++)
+	{
+		if (v.entries[e].name[0] == 0 || v.entries[e].length == 0)
+			continue;
+		if (d->file_count == OS8_MAX_FILES)
+			return -1;
+		os8_entry_name(&v.entries[e], d->files[d->file_count].name);
+		d->files[d->file_count].start = v.entries[e].start;
+		d->files[d->file_count].length = v.entries[e].length;
+		d->file_count++;
+	}
+	d->valid = 1;
+	return 0;
+}
+
+// Find the file whose first block lies in [block, block + count), or NULL.
+struct os8_file *os8_file_starting_in(struct os8_dir *d, int block, int count)
+{
+	if (!d->valid)
+		return NULL;
+	for (int i = 0; i < d->file_count; i++)
+	{
+		if (d->files[i].start >= block && d->files[i].start < block + count)
+			return &d->files[i];
+	}
+	return NULL;
+}
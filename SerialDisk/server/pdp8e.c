@@ -0,0 +1,873 @@
+/*
+	pdp8e.c: run the real handlers against the server on an emulated PDP-8/E
+
+	A PDP-8/E with memory extension and a KL8E serial line (device codes
+	40 and 41, as the handlers use) whose other end is the server, run
+	over a pty by harness.c on a copy of the image.
+
+	Given an OS/8 handler (handler/sdsksy.bin, sdskns.bin or one of its
+	variants) the handler is loaded where OS/8 would run it, and a
+	calling sequence in page zero calls it the way programs load and
+	save files, as loadgen does, with the buffer in field 1. With -g the
+	.bin is a program to start at that address instead, such as
+	tests/handler_test.bin, and its calls to the handler it carries in
+	07600-07777 are what is measured; it is stopped after -n calls or
+	when it halts.
+
+	Either way each call is followed from the JMS to the return. A read
+	that returns normally must have put the image's words in the buffer,
+	and a write's words are noted as what the image should now hold, so
+	when the server has exited the image file is checked as well.
+
+	Characters reach the KL8E as soon as the server sends them, and the
+	handler's wait for the receive flag waits for the server, not in
+	emulated instructions. Characters the server sent that the handler
+	had not read when the next call started (or at the end) are counted
+	as dropped. Instructions are counted while the PC is in the handler,
+	and timed as a real PDP-8/E would take (1.2 us fetch, 1.4 us defer
+	or execute, 1.4 us more for an IOT), which gives the rate the
+	handler could move words at if the line were not the limit.
+
+	With -b the line is simulated instead, on a virtual clock kept by
+	the emulated instructions: each character takes ten bit times each
+	way, a character that arrives before the handler has read the last
+	one overruns it (and the call usually stalls), and the handler's
+	wait loops are skipped ahead rather than emulated. The server's own
+	time (as measured) is added from the handler's last character to
+	the server's first reply, so the virtual time is what the workload
+	would take on a real PDP-8/E at that speed. -b takes a list of
+	rates; the same workload is run against a fresh server at each and
+	a table of the predicted times follows. -c scales the instruction
+	times, to model a slower receiver (1.25 for the 1.5 us cycle of a
+	PDP-8/I or 8/L).
+
+	Usage: pdp8e [-n calls] [-w percent writes] [-p max pages] [-s seed]
+	             [-u device] [-g start] [-b baud,...] [-c factor] [-k]
+	             [-x server] file.bin image [server options]
+*/
+
+#define _GNU_SOURCE
+#include <termios.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#define PAGE_SIZE 0200
+#define BLOCK_SIZE (PAGE_SIZE * 2)
+#define NUMBER_OF_BLOCKS 06260
+
+#include "os8dir.c"
+#include "harness.c"
+
+#define FIELDS 8
+#define MEM(field, addr) mem[((field) << 12) | ((addr) & 07777)]
+
+#define LINE_RECEIVE 040
+#define LINE_SEND 041
+#define CONSOLE_RECEIVE 003
+#define CONSOLE_SEND 004
+
+// Bits of the entry word in an OS/8 handler's header block.
+#define ENTRY_SYSTEM 03000 //system device, or co-resident with it
+#define ENTRY_TWO_PAGES 04000
+
+#define CALLER 020 //calling sequence in page zero
+#define BUFFER_FIELD 1
+#define FUNCTION_DEVICE 02 //device dependent; programs may pass it, so some calls do
+
+// PDP-8/E major state times, in ns.
+#define T_FETCH 1200
+#define T_DEFER 1400
+#define T_EXECUTE 1400
+#define T_IOT 1400
+
+#define BITS_PER_CHAR 10 //start, eight data bits, stop
+#define MAX_RATES 16
+
+static const char usage[] = "Usage: %s [-n calls] [-w percent] [-p pages] [-s seed] [-u device] [-g start] [-b baud,...] [-c factor] [-k] [-x server] file.bin image [server options]\n";
+
+// The workload.
+int limit = 200, write_percent = 10, max_pages = 16, start = -1;
+unsigned seed = 1;
+char *server = "./server", *device = NULL;
+
+unsigned short mem[FIELDS * 010000];
+
+// Processor state.
+int ac, link_bit, mq, pc, sr;
+int inst_field, inst_buffer, data_field, save_field;
+int ion, ion_delay, inhibit, halted;
+
+struct kl8e
+{
+	int line; //the server's end, rather than the console
+	int rx_flag, rx_buf, rx_read, tx_flag, ie;
+} line_kl = { 1, 0, 0, 0, 0, 1 }, console_kl = { 0, 0, 0, 0, 0, 1 };
+
+// Characters from the server not yet in the KL8E (with when each
+// arrives, on the virtual clock), and to it not yet sent.
+unsigned char rx_fifo[4096], tx_buf[4096];
+long long rx_time[4096];
+int rx_head, rx_tail, tx_count;
+
+// The simulated line (-b): the virtual clock, the character time, when
+// the character being sent is done and when the line from the server is
+// next free.
+long line_baud;
+double cycle_factor = 1.0;
+long long clock_ns, char_ns, tx_done, rx_line_free;
+int tx_busy, stalled, wait_pass;
+
+// The handler: where it runs, and the call being followed.
+int handler_lo, handler_hi;
+struct call
+{
+	int active;
+	int field, ret; //caller's field, address of the arguments
+	int function, buffer, block;
+	int wakeup; //-1 until the handler sends it
+} call;
+
+// Counts for the report.
+long instructions, handler_instructions, handler_ns;
+long calls, reads, writes, failed, words, bad_words, dropped, unchecked, overruns;
+
+int in_handler(int field, int addr)
+{
+	return field == 0 && addr >= handler_lo && addr < handler_hi;
+}
+
+void flush_line()
+{
+	send_bytes(tx_buf, tx_count);
+	tx_count = 0;
+}
+
+/*
+ * Take in what the server has sent, waiting for it if wait. On the
+ * virtual clock the characters start down the line when the server sent
+ * them: once it had the PDP-8's last character, and however long it took
+ * to answer after that.
+ */
+void read_server(int wait)
+{
+	double waited = now();
+	long long sent;
+	int c;
+
+	flush_line();
+	if (wait_server(wait ? SERVER_TIMEOUT : 0))
+	{
+		if (!wait)
+			return;
+		if (!line_baud)
+			errx(1, "timed out waiting for the server at %05o", (inst_field << 12) | ((pc - 1) & 07777));
+		stalled = halted = 1; //a lost character left the handler waiting
+		return;
+	}
+	if ((c = read(master, rx_fifo, sizeof(rx_fifo))) <= 0)
+		err(1, "pty read");
+	rx_head = 0;
+	rx_tail = c;
+	sent = (clock_ns > tx_done ? clock_ns : tx_done) + (long long) ((now() - waited) * 1e9);
+	for (int i = 0; i < c; i++)
+	{
+		rx_line_free = (rx_line_free > sent ? rx_line_free : sent) + char_ns;
+		rx_time[i] = line_baud ? rx_line_free : 0;
+	}
+}
+
+/*
+ * Load the KL8E with the characters that have arrived. Over the pty only
+ * one is taken at a time, when the flag is clear, and if wait the server
+ * is waited for; on the simulated line each one arrives in its time, and
+ * overruns one the handler has not read.
+ */
+void poll_line(int wait)
+{
+	if (rx_head == rx_tail && (line_baud || !line_kl.rx_flag))
+		read_server(wait && !line_kl.rx_flag);
+	while (rx_head < rx_tail && rx_time[rx_head] <= clock_ns && (line_baud || !line_kl.rx_flag))
+	{
+		if (line_kl.rx_flag && !line_kl.rx_read)
+		{
+			overruns++;
+			dropped++;
+		}
+		line_kl.rx_buf = rx_fifo[rx_head++];
+		line_kl.rx_flag = 1;
+		line_kl.rx_read = 0;
+	}
+}
+
+// Set the transmit flag if the character being sent is done.
+void poll_send()
+{
+	if (tx_busy && clock_ns >= tx_done)
+	{
+		tx_busy = 0;
+		line_kl.tx_flag = 1;
+	}
+}
+
+/*
+ * A skip IOT that failed, followed by JMP .-1, is a wait loop. On the
+ * virtual clock go round it until the last pass before time, rather than
+ * emulating each one. Waiting is not counted as the handler's work.
+ */
+void skip_wait(long long time)
+{
+	int ir = MEM(inst_field, pc);
+	long long pass = (2 * T_FETCH + T_IOT) * cycle_factor, passes;
+
+	if (!line_baud || time <= clock_ns || (ir & 07400) != 05000)
+		return;
+	if (((ir & 0177) | (ir & 0200 ? pc & 07600 : 0)) != ((pc - 1) & 07777))
+		return;
+	wait_pass = 2; //this IOT and the JMP
+	passes = (time - clock_ns) / pass;
+	clock_ns += passes * pass;
+	instructions += 2 * passes;
+}
+
+// Count (and lose) whatever the server sent that the handler has not read.
+void drop_unread()
+{
+	if (line_kl.rx_flag && !line_kl.rx_read)
+		dropped++;
+	line_kl.rx_flag = 0;
+	while (wait_server(0) == 0)
+	{
+		int c = read(master, rx_fifo, sizeof(rx_fifo));
+		if (c <= 0)
+			break;
+		dropped += c;
+	}
+	dropped += rx_tail - rx_head;
+	rx_head = rx_tail = 0;
+}
+
+void begin_call(int field, int ret)
+{
+	drop_unread();
+	call.active = 1;
+	call.field = field;
+	call.ret = ret;
+	call.function = MEM(field, ret);
+	call.buffer = MEM(field, ret + 1);
+	call.block = MEM(field, ret + 2);
+	call.wakeup = -1;
+}
+
+// The handler has returned to the caller (or gone elsewhere): check the
+// words a read brought in, and note the ones a write sent out.
+void end_call()
+{
+	int pages = (call.function >> 6) & 037 ? (call.function >> 6) & 037 : 040;
+	int field = (call.function >> 3) & 07, drive = (call.wakeup & 0137) - 'A';
+	int count = pages * PAGE_SIZE;
+
+	flush_line();
+	call.active = 0;
+	calls++;
+	if (inst_field != call.field || pc != ((call.ret + 4) & 07777))
+	{
+		failed++;
+		return;
+	}
+	words += count;
+	if (call.function & 04000)
+		writes++;
+	else
+		reads++;
+	if (drive < 0 || drive > 1 || (call.block + (pages + 1) / 2) > NUMBER_OF_BLOCKS)
+	{
+		unchecked++;
+		return;
+	}
+
+	unsigned short *w = image + ((long) drive * NUMBER_OF_BLOCKS + call.block) * BLOCK_SIZE;
+	for (int i = 0; i < count; i++)
+	{
+		int word = MEM(field, call.buffer + i);
+
+		if (!(call.function & 04000))
+			bad_words += word != w[i];
+		else
+			w[i] = word;
+	}
+	if ((call.function & 04000) && (pages & 1))
+		memset(w + count, 0, PAGE_SIZE * sizeof(*w)); //the server pads a half block
+}
+
+void line_send(int c)
+{
+	if (call.active && call.wakeup < 0)
+		call.wakeup = c;
+	tx_buf[tx_count++] = c;
+	if (tx_count == sizeof(tx_buf))
+		flush_line();
+}
+
+int interrupt_request()
+{
+	poll_send();
+	return (line_kl.ie && (line_kl.rx_flag || line_kl.tx_flag)) || (console_kl.ie && (console_kl.rx_flag || console_kl.tx_flag));
+}
+
+// KL8E receive and transmit IOTs.
+void kl8e_iot(struct kl8e *kl, int send, int function)
+{
+	if (!send)
+	{
+		if (kl->line && line_baud)
+			poll_line(0);
+		switch (function)
+		{
+			case 0: kl->rx_flag = 0; break; //KCF
+			case 1: //KSF
+				if (kl->line)
+					poll_line(1);
+				if (kl->rx_flag)
+					pc = (pc + 1) & 07777;
+				else if (kl->line && rx_head < rx_tail)
+					skip_wait(rx_time[rx_head]);
+				break;
+			case 2: kl->rx_flag = 0; ac = 0; break; //KCC
+			case 4: ac |= kl->rx_buf; kl->rx_read = 1; break; //KRS
+			case 5: kl->ie = ac & 1; break; //KIE
+			case 6: ac = kl->rx_buf; kl->rx_flag = 0; kl->rx_read = 1; break; //KRB
+		}
+		return;
+	}
+	if (kl->line)
+		poll_send();
+	switch (function)
+	{
+		case 0: kl->tx_flag = 1; break; //TFL
+		case 1: //TSF
+			if (kl->tx_flag)
+				pc = (pc + 1) & 07777;
+			else if (kl->line && tx_busy)
+				skip_wait(tx_done);
+			break;
+		case 2: kl->tx_flag = 0; break; //TCF
+		case 5: if (kl->tx_flag || kl->rx_flag) pc = (pc + 1) & 07777; break; //TSK
+		case 4: //TPC
+		case 6: //TLS
+			if (!kl->line)
+			{
+				putchar(ac & 0177);
+				kl->tx_flag = 1;
+				break;
+			}
+			line_send(ac & 0377);
+			if (!line_baud)
+			{
+				kl->tx_flag = 1; //the pty is never busy
+				break;
+			}
+			if (function == 6)
+				kl->tx_flag = 0;
+			tx_done = (tx_done > clock_ns ? tx_done : clock_ns) + char_ns;
+			tx_busy = 1;
+			break;
+	}
+}
+
+void iot(int ir)
+{
+	int device = (ir >> 3) & 077, function = ir & 07;
+
+	if (device == 0)
+	{
+		switch (function)
+		{
+			case 0: if (ion) pc = (pc + 1) & 07777; ion = 0; break; //SKON
+			case 1: ion = ion_delay = 1; break; //ION
+			case 2: ion = 0; break; //IOF
+			case 3: if (interrupt_request()) pc = (pc + 1) & 07777; break; //SRQ
+			case 4: ac = (link_bit << 11) | (interrupt_request() << 9) | (ion << 7) | save_field; break; //GTF
+			case 5: //RTF
+				link_bit = (ac >> 11) & 1;
+				inst_buffer = (ac >> 3) & 07;
+				data_field = ac & 07;
+				ion = ion_delay = inhibit = 1;
+				break;
+			case 7: //CAF
+				ac = link_bit = ion = 0;
+				line_kl.rx_flag = line_kl.tx_flag = console_kl.rx_flag = console_kl.tx_flag = 0;
+				line_kl.ie = console_kl.ie = 1;
+				break;
+		}
+	}
+	else if ((device & 070) == 020) //KM8E memory extension
+	{
+		int field = device & 07;
+
+		if (function & 1)
+			data_field = field;
+		if (function & 2)
+		{
+			inst_buffer = field;
+			inhibit = 1;
+		}
+		if (function == 4)
+		{
+			switch (field)
+			{
+				case 1: ac |= data_field << 3; break; //RDF
+				case 2: ac |= inst_field << 3; break; //RIF
+				case 3: ac |= save_field; break; //RIB
+				case 4: //RMF
+					inst_buffer = (save_field >> 3) & 07;
+					data_field = save_field & 07;
+					inhibit = 1;
+					break;
+			}
+		}
+	}
+	else if (device == LINE_RECEIVE || device == LINE_SEND)
+		kl8e_iot(&line_kl, device == LINE_SEND, function);
+	else if (device == CONSOLE_RECEIVE || device == CONSOLE_SEND)
+		kl8e_iot(&console_kl, device == CONSOLE_SEND, function);
+}
+
+void operate(int ir)
+{
+	if (!(ir & 0400)) //group 1
+	{
+		if (ir & 0200) ac = 0; //CLA
+		if (ir & 0100) link_bit = 0; //CLL
+		if (ir & 0040) ac ^= 07777; //CMA
+		if (ir & 0020) link_bit ^= 1; //CML
+		if (ir & 0001) //IAC
+		{
+			ac = (ac + 1) & 07777;
+			if (ac == 0)
+				link_bit ^= 1;
+		}
+		switch (ir & 016)
+		{
+			case 002: ac = ((ac & 077) << 6) | (ac >> 6); break; //BSW
+			case 006: ac = (ac << 1) | link_bit; link_bit = ac >> 12; ac &= 07777; //RTL
+			/* fall through */
+			case 004: ac = (ac << 1) | link_bit; link_bit = ac >> 12; ac &= 07777; break; //RAL
+			case 012: ac |= link_bit << 12; link_bit = ac & 1; ac >>= 1; //RTR
+			/* fall through */
+			case 010: ac |= link_bit << 12; link_bit = ac & 1; ac >>= 1; break; //RAR
+		}
+	}
+	else if (!(ir & 1)) //group 2
+	{
+		int skip = 0;
+
+		if (ir & 0100) skip |= (ac & 04000) != 0; //SMA
+		if (ir & 0040) skip |= ac == 0; //SZA
+		if (ir & 0020) skip |= link_bit; //SNL
+		if (ir & 0010) skip = !skip; //SPA SNA SZL
+		if (skip)
+			pc = (pc + 1) & 07777;
+		if (ir & 0200) ac = 0; //CLA
+		if (ir & 0004) ac |= sr; //OSR
+		if (ir & 0002) halted = 1; //HLT
+	}
+	else //group 3, without the EAE
+	{
+		int old_mq = mq;
+
+		if (ir & 0200) ac = 0; //CLA
+		if (ir & 0020) //MQL
+		{
+			mq = ac;
+			ac = 0;
+		}
+		if (ir & 0100) ac |= old_mq; //MQA
+	}
+}
+
+void step()
+{
+	int ir, addr, field, ns = T_FETCH;
+	int handler = in_handler(inst_field, pc);
+
+	if (ion && !ion_delay && !inhibit && interrupt_request())
+	{
+		MEM(0, 0) = pc;
+		save_field = (inst_field << 3) | data_field;
+		ion = inst_field = inst_buffer = data_field = 0;
+		pc = 1;
+		handler = in_handler(0, pc);
+	}
+	ion_delay = 0;
+	if (call.active && !handler)
+		end_call();
+
+	ir = MEM(inst_field, pc);
+	pc = (pc + 1) & 07777;
+	if (ir < 06000) //memory reference
+	{
+		addr = (ir & 0177) | (ir & 0200 ? (pc - 1) & 07600 : 0);
+		field = inst_field;
+		if (ir & 0400)
+		{
+			ns += T_DEFER;
+			if ((addr & 07770) == 010) //auto-index
+				MEM(inst_field, addr) = (MEM(inst_field, addr) + 1) & 07777;
+			addr = MEM(inst_field, addr);
+			if (ir < 04000)
+				field = data_field;
+		}
+		switch (ir >> 9)
+		{
+			case 0: ac &= MEM(field, addr); break; //AND
+			case 1: //TAD
+				ac += MEM(field, addr);
+				link_bit ^= ac >> 12;
+				ac &= 07777;
+				break;
+			case 2: //ISZ
+				if ((MEM(field, addr) = (MEM(field, addr) + 1) & 07777) == 0)
+					pc = (pc + 1) & 07777;
+				break;
+			case 3: MEM(field, addr) = ac; ac = 0; break; //DCA
+			case 4: //JMS
+				if (!call.active && in_handler(inst_buffer, addr))
+					begin_call(inst_field, pc);
+				inst_field = inst_buffer;
+				inhibit = 0;
+				MEM(inst_field, addr) = pc;
+				pc = (addr + 1) & 07777;
+				break;
+			case 5: //JMP
+				inst_field = inst_buffer;
+				inhibit = 0;
+				pc = addr;
+				ns -= T_EXECUTE;
+				break;
+		}
+		ns += T_EXECUTE;
+	}
+	else if (ir < 07000)
+	{
+		iot(ir);
+		ns += T_IOT;
+	}
+	else
+		operate(ir);
+
+	ns *= cycle_factor;
+	clock_ns += ns;
+	instructions++;
+	if (handler && !wait_pass)
+	{
+		handler_instructions++;
+		handler_ns += ns;
+	}
+	if (wait_pass)
+		wait_pass--;
+}
+
+/*
+ * Load a DEC .bin paper tape image into mem. The last word before the
+ * trailer is the checksum, so each word is only stored when another
+ * follows it.
+ */
+void load_bin(const char *name)
+{
+	FILE *f = fopen(name, "rb");
+	int c, field = 0, origin = 0, pending = -1, pending_addr = 0, leader = 1;
+
+	if (f == NULL)
+		err(1, "%s", name);
+	while ((c = getc(f)) != EOF)
+	{
+		if (c == 0377) //rubout: skip to the next one
+		{
+			while ((c = getc(f)) != EOF && c != 0377)
+				;
+			continue;
+		}
+		if (c == 0200) //leader or trailer
+		{
+			if (!leader)
+				break;
+			continue;
+		}
+		leader = 0;
+		if ((c & 0300) == 0300) //field setting
+		{
+			field = (c >> 3) & 07;
+			continue;
+		}
+		int c2 = getc(f);
+		if (c2 == EOF)
+			break;
+		if (pending >= 0)
+			mem[pending_addr] = pending;
+		pending = -1;
+		if (c & 0100)
+			origin = ((c & 077) << 6) | (c2 & 077);
+		else
+		{
+			pending = ((c & 077) << 6) | (c2 & 077);
+			pending_addr = (field << 12) | origin;
+			origin = (origin + 1) & 07777;
+		}
+	}
+	fclose(f);
+	if (leader)
+		errx(1, "%s is not a .bin file", name);
+}
+
+// Turn two sixbit words into a device name.
+void device_name(int w1, int w2, char *out)
+{
+	int chars[4] = { w1 >> 6, w1 & 077, w2 >> 6, w2 & 077 };
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (chars[i])
+			*out++ = chars[i] < 040 ? chars[i] + 0100 : chars[i];
+	}
+	*out = 0;
+}
+
+/*
+ * Put the handler just loaded where OS/8 would run it, and return the
+ * address of the named entry (by default the first that is not SYS).
+ * The header block at 0000 has -(count), then eight words for each
+ * entry: group and device names, type, entry word and two more.
+ */
+int setup_handler(const char *device)
+{
+	int count = -mem[0] & 07777, entry = -1, system = 0, two_pages = 0;
+	char name[5];
+
+	if (count < 1 || count > 15)
+		errx(1, "no handler header block at 0000");
+	for (int i = 0; i < count; i++)
+	{
+		unsigned short *h = &mem[1 + 8 * i];
+
+		device_name(h[2], h[3], name);
+		system |= (h[5] & ENTRY_SYSTEM) != 0;
+		two_pages |= (h[5] & ENTRY_TWO_PAGES) != 0;
+		if (entry < 0 && (device ? !strcasecmp(name, device) : strcmp(name, "SYS") != 0))
+			entry = h[5] & 0177;
+	}
+	if (entry < 0)
+		errx(1, "the handler has no %s entry", device ? device : "non-system");
+	if (system)
+	{
+		// A system handler is loaded at 0200 and runs in 07600-07777.
+		memcpy(&mem[07600], &mem[0200], PAGE_SIZE * sizeof(*mem));
+		handler_lo = 07600;
+	}
+	else
+		handler_lo = 0200;
+	handler_hi = handler_lo + (two_pages ? 2 : 1) * PAGE_SIZE;
+	return handler_lo + entry;
+}
+
+// Run until the program halts, or has made limit calls (if limit >= 0).
+void run(long limit)
+{
+	halted = 0;
+	while (!halted && (limit < 0 || calls < limit))
+		step();
+	if (call.active)
+		end_call();
+}
+
+// Start afresh: memory, processor, line and counts.
+void reset()
+{
+	memset(mem, 0, sizeof(mem));
+	ac = link_bit = mq = pc = sr = 0;
+	inst_field = inst_buffer = data_field = save_field = 0;
+	ion = ion_delay = inhibit = halted = 0;
+	line_kl = (struct kl8e) { 1, 0, 0, 0, 0, 1 };
+	console_kl = (struct kl8e) { 0, 0, 0, 0, 0, 1 };
+	rx_head = rx_tail = tx_count = 0;
+	clock_ns = tx_done = rx_line_free = 0;
+	char_ns = line_baud ? BITS_PER_CHAR * 1000000000LL / line_baud : 0;
+	tx_busy = stalled = wait_pass = 0;
+	memset(&call, 0, sizeof(call));
+	instructions = handler_instructions = handler_ns = 0;
+	calls = reads = writes = failed = words = bad_words = dropped = unchecked = overruns = 0;
+	free(image);
+}
+
+// Run the workload once against a fresh server. Returns 0 if all went well.
+int exercise(const char *bin, const char *image_name, char **options, int option_count)
+{
+	int entry = 0;
+
+	reset();
+	srandom(seed);
+	load_bin(bin);
+	if (start < 0)
+		entry = setup_handler(device);
+	else
+	{
+		handler_lo = 07600;
+		handler_hi = 010000;
+	}
+	load_image(image_name);
+	start_server(server, options, option_count);
+
+	double wall = now();
+
+	if (start >= 0)
+	{
+		pc = start & 07777;
+		inst_field = inst_buffer = start >> 12;
+		run(limit);
+		if (halted && !stalled)
+			printf("Halted at %05o, AC %04o\n", (inst_field << 12) | ((pc - 1) & 07777), ac);
+	}
+	else
+	{
+		// JMS I 27; function; buffer; block; HLT (error return); HLT
+		static const unsigned short caller[] = { 04427, 0, 0, 0, 07402, 07402, 0, 0 };
+		int side = device && (device[strlen(device) - 2] & 0137) == 'B';
+
+		memcpy(&mem[CALLER], caller, sizeof(caller));
+		mem[CALLER + 7] = entry;
+		if (side)
+			os8_parse_dir((unsigned short (*)[OS8_DIR_WORDS]) (image + (NUMBER_OF_BLOCKS + 1) * BLOCK_SIZE), NUMBER_OF_BLOCKS, &dir);
+		while (calls < limit && !stalled)
+		{
+			int block, length;
+
+			if (dir.valid && dir.file_count)
+			{
+				struct os8_file *file = &dir.files[random() % dir.file_count];
+				block = file->start;
+				length = file->length;
+			}
+			else
+			{
+				length = 1 + random() % 16;
+				block = 7 + random() % (NUMBER_OF_BLOCKS - 7 - length);
+			}
+			int write = (random() % 100) < write_percent;
+			while (length > 0 && calls < limit && !stalled)
+			{
+				int pages = length * 2 < max_pages ? length * 2 : max_pages & ~1;
+
+				for (int i = 0; write && i < pages * PAGE_SIZE; i++)
+					MEM(BUFFER_FIELD, i) = random() & 07777;
+				mem[CALLER + 1] = (write ? 04000 : 0) | ((pages & 037) << 6) | (BUFFER_FIELD << 3) |
+						  (calls % 8 == 7 ? FUNCTION_DEVICE : 0);
+				mem[CALLER + 2] = 0;
+				mem[CALLER + 3] = block;
+				pc = CALLER;
+				ac = link_bit = 0;
+				inst_field = inst_buffer = data_field = 0;
+				run(-1);
+				if (pc != CALLER + 6 && !stalled)
+					errx(1, "%s refused block %04o (AC %04o)", bin, block, ac);
+				block += pages / 2;
+				length -= pages / 2;
+			}
+		}
+	}
+	wall = now() - wall;
+	drop_unread();
+	stop_server();
+
+	printf("%ld calls (%ld reads, %ld writes, %ld failed) in %.2f s: %.1f KW/s\n",
+	       calls, reads, writes, failed, wall, words / wall / 1024);
+	if (line_baud)
+		printf("At %ld baud: %.2f s on the virtual clock, %.1f KW/s, %ld overrun%s%s\n", line_baud,
+		       clock_ns / 1e9, words / (clock_ns / 1e9) / 1024, overruns, (overruns == 1 ? "" : "s"),
+		       (stalled ? ", stalled waiting for a lost character" : ""));
+	if (words)
+		printf("Handler: %ld instructions, %.1f per word, %.2f us per word on a PDP-8/E (%.1f KW/s at most)\n",
+		       handler_instructions, (double) handler_instructions / words, handler_ns / 1e3 / words,
+		       words / (handler_ns / 1e9) / 1024);
+	printf("%ld character%s from the server dropped\n", dropped, (dropped == 1 ? "" : "s"));
+	if (unchecked)
+		printf("%ld call%s not checked (other drives)\n", unchecked, (unchecked == 1 ? "" : "s"));
+	if (bad_words)
+		printf("%ld word%s read differ from the image\n", bad_words, (bad_words == 1 ? "" : "s"));
+
+	return (finish_server() != 0) | (bad_words != 0) | (dropped != 0) | stalled | (start >= 0 ? 0 : failed != 0);
+}
+
+int main(int argc, char *argv[])
+{
+	long rates[MAX_RATES] = { 0 };
+	double seconds[MAX_RATES], kw[MAX_RATES];
+	long lost[MAX_RATES];
+	int rate_count = 1, status = 0, c;
+	char *rate;
+
+	while ((c = getopt(argc, argv, "+n:w:p:s:u:g:b:c:kx:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n': limit = atoi(optarg); break;
+			case 'w': write_percent = atoi(optarg); break;
+			case 'p': max_pages = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			case 'u': device = optarg; break;
+			case 'g': start = strtol(optarg, NULL, 8) & 077777; break;
+			case 'b':
+				rate_count = 0;
+				for (rate = strtok(optarg, ","); rate && rate_count < MAX_RATES; rate = strtok(NULL, ","))
+					rates[rate_count++] = atol(rate);
+				break;
+			case 'c': cycle_factor = atof(optarg); break;
+			case 'k': packed = 1; break;
+			case 'x': server = optarg; break;
+			default:
+				fprintf(stderr, usage, argv[0]);
+				exit(1);
+		}
+	}
+	for (int i = 0; i < rate_count; i++)
+	{
+		if (rates[i] < 0 || (rate_count > 1 && rates[i] == 0))
+			rate_count = 0;
+	}
+	if (optind + 1 >= argc || max_pages < 2 || max_pages > 040 || rate_count == 0 || cycle_factor <= 0)
+	{
+		fprintf(stderr, usage, argv[0]);
+		exit(1);
+	}
+
+	for (int i = 0; i < rate_count; i++)
+	{
+		line_baud = rates[i];
+		if (rate_count > 1)
+			printf("== %ld baud\n", line_baud);
+		status |= exercise(argv[optind], argv[optind + 1], argv + optind + 2, argc - optind - 2);
+		seconds[i] = clock_ns / 1e9;
+		kw[i] = words / seconds[i] / 1024;
+		lost[i] = stalled ? -1 : overruns;
+	}
+	if (rate_count > 1)
+	{
+		printf("\nPredicted for %ld calls:\n    baud      time      KW/s  overruns\n", calls);
+		for (int i = 0; i < rate_count; i++)
+		{
+			printf("%8ld %8.2f s %9.1f ", rates[i], seconds[i], kw[i]);
+			if (lost[i] < 0)
+				printf(" stalled\n");
+			else
+				printf("%9ld\n", lost[i]);
+		}
+	}
+	return status;
+}
@@ -0,0 +1,337 @@
+/*
+	prefetch.c: OS/8 file aware read-ahead
+
+	OS/8 files are contiguous, so when the PDP-8 reads the first block of
+	a file it will very likely read the rest of it next. We keep a parse
+	of the directory of each side, and when a read touches the first
+	block of a file, the rest of the file (up to the budget) is read and
+	converted ahead of time. Later reads that are wholly cached are served
+	from memory. Writes drop the blocks they cover, and writes to the
+	directory cause it to be parsed again.
+
+	Blocks of packed images stay packed in memory (three bytes per two
+	words rather than four for the disk format and four more for the
+	wire) and are decoded straight into the wire format when they are
+	served. The data itself is kept in the block store (blockstore.c), so
+	identical blocks are held once however many images they are on.
+
+	Sides are numbered disk * 2 + side.
+*/
+
+#define PREFETCH_BUDGET 01000 //default number of blocks kept, 0 to disable
+#define PREFETCH_SIDES (DISK_COUNT * 2)
+#define PREFETCH_MAX_TRIGGERS 0200 //files we keep statistics for
+#define BLOCK_BYTES (BLOCK_SIZE * BYTES_PER_WORD)
+#define PACKED_BLOCK_BYTES (BLOCK_SIZE / 2 * 3)
+
+struct prefetch_block
+{
+	struct prefetch_block *prev, *next; //least recently used first
+	int side;
+	int block;
+	int trigger;
+	int used;
+	struct store_block *data; //packed, or the disk format and then the six bit encoding
+};
+
+struct prefetch_trigger
+{
+	int side;
+	char name[11];
+	long count; //times the file triggered a prefetch
+	long blocks; //blocks read ahead
+	long hits; //blocks later served from memory
+};
+
+long prefetch_budget = PREFETCH_BUDGET;
+long prefetch_cached;
+long prefetch_bytes, prefetch_peak_bytes;
+long prefetch_hits, prefetch_misses; //blocks of read requests
+long prefetch_request_hits, prefetch_requests;
+
+struct prefetch_block *prefetch_map[PREFETCH_SIDES][NUMBER_OF_BLOCKS];
+struct prefetch_block prefetch_lru; //list head
+struct os8_dir prefetch_dirs[PREFETCH_SIDES];
+struct prefetch_trigger prefetch_triggers[PREFETCH_MAX_TRIGGERS];
+int prefetch_trigger_count;
+
+// Read-ahead in flight between prefetch_start and prefetch_after_read.
+unsigned char prefetch_ahead[NUMBER_OF_BLOCKS / 8 * BLOCK_BYTES];
+unsigned char prefetch_staged[2 * BLOCK_BYTES]; //a block as it will be stored
+struct
+{
+	int pending;
+	int side, first, count, read;
+	struct os8_file *file;
+} prefetch_next;
+
+static void prefetch_unlink(struct prefetch_block *b)
+{
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+}
+
+static void prefetch_append(struct prefetch_block *b)
+{
+	b->prev = prefetch_lru.prev;
+	b->next = &prefetch_lru;
+	prefetch_lru.prev->next = b;
+	prefetch_lru.prev = b;
+}
+
+// What the cache takes: the blocks, and the data in the block store.
+static void prefetch_count_bytes()
+{
+	prefetch_bytes = prefetch_cached * sizeof(struct prefetch_block) + store_bytes;
+	if (prefetch_bytes > prefetch_peak_bytes)
+		prefetch_peak_bytes = prefetch_bytes;
+}
+
+static void prefetch_drop(struct prefetch_block *b)
+{
+	prefetch_unlink(b);
+	prefetch_map[b->side][b->block] = NULL;
+	prefetch_cached--;
+	store_put(b->data);
+	free(b);
+	prefetch_count_bytes();
+}
+
+// Read the directory of a side and parse it.
+void prefetch_load_dir(int side)
+{
+	static unsigned short dir[OS8_DIR_LAST][OS8_DIR_WORDS];
+	unsigned char raw[OS8_DIR_LAST * BLOCK_BYTES];
+	struct disk_state *disk = &disks[side / 2];
+	struct os8_dir *d = &prefetch_dirs[side];
+
+	d->valid = 0;
+	if (!disk->in_use || dial_mode || prefetch_budget == 0)
+		return;
+	if (read_from_file(disk, ((side & 1) * NUMBER_OF_BLOCKS + OS8_DIR_FIRST) * BLOCK_BYTES, raw, sizeof(raw)))
+		return;
+	for (int i = 0; i < OS8_DIR_LAST * OS8_DIR_WORDS; i++)
+		dir[i / OS8_DIR_WORDS][i % OS8_DIR_WORDS] = ((raw[2 * i + 1] & 017) << 8) | raw[2 * i];
+	if (os8_parse_dir(dir, NUMBER_OF_BLOCKS, d) == 0)
+		printf("OS/8 directory of side %d on %s disk: %d file%s\n", side & 1, disk_num_strings[side / 2],
+		       d->file_count, (d->file_count == 1 ? "" : "s"));
+}
+
+void prefetch_init()
+{
+	prefetch_lru.prev = prefetch_lru.next = &prefetch_lru;
+	if (prefetch_budget)
+		store_survey();
+	for (int side = 0; side < PREFETCH_SIDES; side++)
+		prefetch_load_dir(side);
+}
+
+/*
+ * Serve a read of word_count words at block from memory if all of it is
+ * cached. Fills raw and, unless dense, pdp. Returns 1 on a hit.
+ */
+int prefetch_read(int side, int block, int word_count, int dense, unsigned char *raw, unsigned char *pdp)
+{
+	int blocks = (word_count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (prefetch_budget == 0)
+		return 0;
+	prefetch_requests++;
+	for (int i = 0; i < blocks; i++)
+	{
+		if (prefetch_map[side][block + i] == NULL)
+		{
+			prefetch_misses += blocks;
+			return 0;
+		}
+	}
+	for (int i = 0; i < blocks; i++)
+	{
+		struct prefetch_block *b = prefetch_map[side][block + i];
+		int words = word_count - i * BLOCK_SIZE;
+
+		if (words > BLOCK_SIZE)
+			words = BLOCK_SIZE;
+		if (disks[side / 2].packed)
+		{
+			mac_to_djg(b->data->bytes, raw + i * BLOCK_BYTES, words);
+			if (!dense)
+				mac_to_pdp(b->data->bytes, pdp + i * BLOCK_BYTES, words);
+		}
+		else
+		{
+			memcpy(raw + i * BLOCK_BYTES, b->data->bytes, words * BYTES_PER_WORD);
+			if (!dense)
+				memcpy(pdp + i * BLOCK_BYTES, b->data->bytes + BLOCK_BYTES, words * BYTES_PER_WORD);
+		}
+		if (b->trigger >= 0 && !b->used)
+			prefetch_triggers[b->trigger].hits++;
+		b->used = 1;
+		prefetch_unlink(b);
+		prefetch_append(b);
+	}
+	prefetch_hits += blocks;
+	prefetch_request_hits++;
+	return 1;
+}
+
+static int prefetch_trigger_for(int side, struct os8_file *f)
+{
+	for (int i = 0; i < prefetch_trigger_count; i++)
+	{
+		if (prefetch_triggers[i].side == side && !strcmp(prefetch_triggers[i].name, f->name))
+			return i;
+	}
+	if (prefetch_trigger_count == PREFETCH_MAX_TRIGGERS)
+		return -1;
+	prefetch_triggers[prefetch_trigger_count].side = side;
+	strcpy(prefetch_triggers[prefetch_trigger_count].name, f->name);
+	return prefetch_trigger_count++;
+}
+
+/*
+ * Before a read of block_count blocks at block: if it starts a file,
+ * start reading the rest of it. The storage engine can then fetch both
+ * at once, and the read-ahead lands while the data goes down the line.
+ */
+void prefetch_start(int side, int block, int block_count)
+{
+	struct os8_file *f = os8_file_starting_in(&prefetch_dirs[side], block, block_count);
+	int first, count;
+
+	prefetch_next.pending = 0;
+	if (prefetch_budget == 0 || f == NULL)
+		return;
+	// Skip what is being read, and anything already in memory.
+	first = block + block_count;
+	if (first < f->start)
+		first = f->start;
+	while (first < f->start + f->length && prefetch_map[side][first] != NULL)
+		first++;
+	count = f->start + f->length - first;
+	if (count > prefetch_budget / 2)
+		count = prefetch_budget / 2; //leave room for the rest of the cache
+	if (count > sizeof(prefetch_ahead) / BLOCK_BYTES)
+		count = sizeof(prefetch_ahead) / BLOCK_BYTES;
+	if (count <= 0)
+		return;
+	prefetch_next.side = side;
+	prefetch_next.first = first;
+	prefetch_next.count = count;
+	prefetch_next.file = f;
+	if (disks[side / 2].packed)
+		prefetch_next.read = storage_read_start(disks[side / 2].file, ((side & 1) * NUMBER_OF_BLOCKS + first) * PACKED_BLOCK_BYTES,
+							prefetch_ahead, count * PACKED_BLOCK_BYTES);
+	else
+		prefetch_next.read = storage_read_start(disks[side / 2].file, ((side & 1) * NUMBER_OF_BLOCKS + first) * BLOCK_BYTES,
+							prefetch_ahead, count * BLOCK_BYTES);
+	prefetch_next.pending = 1;
+}
+
+// After the read has been sent, put what prefetch_start read in the cache.
+void prefetch_after_read()
+{
+	int side = prefetch_next.side, first = prefetch_next.first, count = prefetch_next.count, trigger;
+
+	if (!prefetch_next.pending)
+		return;
+	prefetch_next.pending = 0;
+	if (storage_read_finish(prefetch_next.read))
+		return;
+
+	trigger = prefetch_trigger_for(side, prefetch_next.file);
+	if (trigger >= 0)
+	{
+		prefetch_triggers[trigger].count++;
+		prefetch_triggers[trigger].blocks += count;
+	}
+	if (!control_watching())
+		printf("Prefetching %d block%s of %s\n", count, (count == 1 ? "" : "s"), prefetch_next.file->name);
+
+	for (int i = 0; i < count; i++)
+	{
+		struct prefetch_block *b = prefetch_map[side][first + i];
+		struct store_block *data;
+
+		if (disks[side / 2].packed)
+			data = store_get(prefetch_ahead + i * PACKED_BLOCK_BYTES, PACKED_BLOCK_BYTES);
+		else
+		{
+			memcpy(prefetch_staged, prefetch_ahead + i * BLOCK_BYTES, BLOCK_BYTES);
+			djg_to_pdp(prefetch_staged, prefetch_staged + BLOCK_BYTES, BLOCK_SIZE);
+			data = store_get(prefetch_staged, 2 * BLOCK_BYTES);
+		}
+		if (data == NULL)
+			return;
+		if (b == NULL)
+		{
+			if (prefetch_cached >= prefetch_budget)
+				prefetch_drop(prefetch_lru.next);
+			if ((b = malloc(sizeof(*b))) == NULL)
+			{
+				store_put(data);
+				return;
+			}
+			b->side = side;
+			b->block = first + i;
+			prefetch_map[side][first + i] = b;
+			prefetch_cached++;
+		}
+		else
+		{
+			prefetch_unlink(b);
+			store_put(b->data);
+		}
+		prefetch_append(b);
+		b->trigger = trigger;
+		b->used = 0;
+		b->data = data;
+		prefetch_count_bytes();
+	}
+}
+
+// Copy a cached block, in the disk format, to raw. Returns 0 if it isn't cached.
+int prefetch_peek(int side, int block, unsigned char *raw)
+{
+	struct prefetch_block *b;
+
+	if (prefetch_budget == 0 || (b = prefetch_map[side][block]) == NULL)
+		return 0;
+	if (disks[side / 2].packed)
+		mac_to_djg(b->data->bytes, raw, BLOCK_SIZE);
+	else
+		memcpy(raw, b->data->bytes, BLOCK_BYTES);
+	return 1;
+}
+
+// After a write, forget what it covered and notice directory changes.
+void prefetch_after_write(int side, int block, int block_count)
+{
+	if (prefetch_budget == 0)
+		return;
+	for (int i = block; i < block + block_count && i < NUMBER_OF_BLOCKS; i++)
+	{
+		if (prefetch_map[side][i] != NULL)
+			prefetch_drop(prefetch_map[side][i]);
+	}
+	if (block <= OS8_DIR_LAST && block + block_count > OS8_DIR_FIRST)
+		prefetch_load_dir(side);
+}
+
+void prefetch_report()
+{
+	if (prefetch_budget == 0 || prefetch_requests == 0)
+		return;
+	printf("Prefetch: %ld of %ld read requests (%ld%%) and %ld of %ld blocks (%ld%%) served from memory, at most %ld KB cached\n",
+	       prefetch_request_hits, prefetch_requests, prefetch_request_hits * 100 / prefetch_requests,
+	       prefetch_hits, prefetch_hits + prefetch_misses,
+	       prefetch_hits * 100 / (prefetch_hits + prefetch_misses ? prefetch_hits + prefetch_misses : 1),
+	       (prefetch_peak_bytes + 1023) / 1024);
+	for (int i = 0; i < prefetch_trigger_count; i++)
+	{
+		struct prefetch_trigger *t = &prefetch_triggers[i];
+		printf("  %-10s side %d on %s disk: %ld prefetch%s, %ld blocks read ahead, %ld used (%ld%%)\n",
+		       t->name, t->side & 1, disk_num_strings[t->side / 2], t->count, (t->count == 1 ? "" : "es"),
+		       t->blocks, t->hits, t->hits * 100 / (t->blocks ? t->blocks : 1));
+	}
+}
@@ -0,0 +1,317 @@
+/*
+	realtime.c: low jitter mode (-R), and the response time histogram
+
+	With -R priority[,cpu] the threads that talk to the PDP-8 (the main
+	one, and with -T the serial receive and transmit threads of comm.c)
+	run at that SCHED_FIFO priority, pinned to the cpu if one is given,
+	so a busy host can't take them off the processor in the middle of a
+	transfer. All memory is locked, the images included: each is mapped
+	and locked, which keeps its pages in the page cache the reads and
+	writes go through.
+
+	Whatever might block goes to two ordinary threads kept off that cpu.
+	One copies the console output (stdout, which becomes a pipe) to
+	where it used to go, so a slow terminal or ssh session can't stall a
+	transfer. The other runs jobs handed to it with rt_defer: writing the
+	access log and, with the plain storage engine, the fdatasyncs of -S 1
+	(io_uring already does those in the background).
+
+	Setting the priority and locking memory need root or CAP_SYS_NICE and
+	CAP_IPC_LOCK; without them the server warns and carries on.
+
+	Whether or not -R is given, the time from a request being in (the
+	wakeup character, and for a drive its headers) to the first byte of
+	the answer going out is kept in a histogram and printed at exit. It
+	is taken where the bytes are written to the port: on the transmit
+	thread when there is one, so the time a reply waits in the ring
+	counts.
+*/
+
+#include <pthread.h>
+#include <sched.h>
+
+#define RT_JOBS 16 //jobs that may wait for the writer thread
+#define RT_BUCKETS 24 //response times under 1 us, 2 us ... 2^23 us
+
+int rt_priority; //0 unless -R
+int rt_cpu = -1;
+int rt_active; //the threads are running
+
+struct rt_job
+{
+	void (*run)(void *);
+	void *arg;
+};
+
+struct rt_job rt_jobs[RT_JOBS];
+int rt_job_head, rt_job_count, rt_job_running;
+long rt_job_inline; //run here because the queue was full
+pthread_mutex_t rt_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t rt_work = PTHREAD_COND_INITIALIZER, rt_done = PTHREAD_COND_INITIALIZER;
+pthread_t rt_writer_thread, rt_console_thread;
+int rt_console[2] = { -1, -1 }; //the pipe stdout goes into
+int rt_stdout = -1; //where it used to go
+long rt_locked_bytes;
+void *rt_maps[DISK_COUNT]; //the images, mapped to lock them
+long rt_map_bytes[DISK_COUNT];
+
+// Response times. rt_mark is called on the main thread, rt_sent where the port is written.
+struct timespec rt_request;
+long rt_request_byte; //the answer's first byte, counting every byte written
+atomic_int rt_waiting; //for the first byte of an answer
+long rt_latency[RT_BUCKETS];
+long rt_responses, rt_latency_max;
+double rt_latency_sum;
+
+// A request is in; the answer starts with the next byte written.
+void rt_mark()
+{
+	clock_gettime(CLOCK_MONOTONIC, &rt_request);
+	rt_request_byte = comm_bytes_out;
+	atomic_store(&rt_waiting, 1);
+}
+
+// Bytes up to sent (counted as comm_bytes_out counts them) have gone to the port.
+void rt_sent(long sent)
+{
+	struct timespec now;
+	long us;
+	int b = 0;
+
+	if (!atomic_load(&rt_waiting) || sent <= rt_request_byte)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	atomic_store(&rt_waiting, 0);
+	us = (now.tv_sec - rt_request.tv_sec) * 1000000 + (now.tv_nsec - rt_request.tv_nsec) / 1000;
+	while (b < RT_BUCKETS - 1 && us >= (1L << b))
+		b++;
+	rt_latency[b]++;
+	rt_responses++;
+	rt_latency_sum += us;
+	if (us > rt_latency_max)
+		rt_latency_max = us;
+}
+
+static void *rt_writer(void *unused)
+{
+	pthread_mutex_lock(&rt_lock);
+	for (;;)
+	{
+		while (rt_job_count == 0)
+			pthread_cond_wait(&rt_work, &rt_lock);
+		struct rt_job job = rt_jobs[rt_job_head];
+		rt_job_head = (rt_job_head + 1) % RT_JOBS;
+		rt_job_count--;
+		rt_job_running = 1;
+		pthread_mutex_unlock(&rt_lock);
+		job.run(job.arg);
+		pthread_mutex_lock(&rt_lock);
+		rt_job_running = 0;
+		pthread_cond_broadcast(&rt_done);
+	}
+	return NULL;
+}
+
+static void *rt_copy_console(void *unused)
+{
+	char text[4096];
+	int c;
+
+	while ((c = read(rt_console[0], text, sizeof(text))) != 0)
+	{
+		if (c < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (int done = 0, w; done < c; done += w)
+		{
+			if ((w = write(rt_stdout, text + done, c - done)) <= 0)
+				return NULL;
+		}
+	}
+	return NULL;
+}
+
+// Run job(arg) on the writer thread, or here if there is none (or it is far behind).
+void rt_defer(void (*job)(void *), void *arg)
+{
+	if (!rt_active)
+	{
+		job(arg);
+		return;
+	}
+	pthread_mutex_lock(&rt_lock);
+	if (rt_job_count == RT_JOBS)
+	{
+		rt_job_inline++;
+		pthread_mutex_unlock(&rt_lock);
+		job(arg);
+		return;
+	}
+	rt_jobs[(rt_job_head + rt_job_count++) % RT_JOBS] = (struct rt_job) { job, arg };
+	pthread_cond_signal(&rt_work);
+	pthread_mutex_unlock(&rt_lock);
+}
+
+// Wait until every job handed to the writer thread is done.
+void rt_drain()
+{
+	if (!rt_active)
+		return;
+	pthread_mutex_lock(&rt_lock);
+	while (rt_job_count || rt_job_running)
+		pthread_cond_wait(&rt_done, &rt_lock);
+	pthread_mutex_unlock(&rt_lock);
+}
+
+// At exit: the jobs finish, and the console output still in the pipe goes out.
+static void rt_close()
+{
+	rt_drain();
+	fflush(stdout);
+	dup2(rt_stdout, STDOUT_FILENO); //the last write end of the pipe
+	pthread_join(rt_console_thread, NULL);
+	for (int i = DISK_NUM_MIN; i < DISK_COUNT; i++)
+	{
+		if (rt_maps[i] != NULL)
+			munmap(rt_maps[i], rt_map_bytes[i]);
+	}
+}
+
+// Start a helper thread: ordinary priority, no signals, kept off the real-time cpu.
+static int rt_start(pthread_t *thread, void *(*run)(void *))
+{
+	pthread_attr_t attr;
+	struct sched_param none = { 0 };
+	sigset_t all, old;
+	cpu_set_t cpus;
+	int r;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &none);
+	if (rt_cpu >= 0 && sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) > 1)
+	{
+		CPU_CLR(rt_cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(thread, &attr, run, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+	return r;
+}
+
+// Called once the images are open and the buffers and caches set up.
+void rt_init()
+{
+	struct sched_param param = { rt_priority };
+	int r;
+
+	if (rt_priority == 0)
+		return;
+
+	// The helpers first, so they don't inherit what follows.
+	fflush(stdout);
+	if (pipe(rt_console) < 0 || (rt_stdout = dup(STDOUT_FILENO)) < 0)
+	{
+		perror("Console pipe");
+		exit(1);
+	}
+	fcntl(rt_console[1], F_SETPIPE_SZ, 1024 * 1024); //room for a burst of messages
+	if ((r = rt_start(&rt_writer_thread, rt_writer)) != 0 || (r = rt_start(&rt_console_thread, rt_copy_console)) != 0)
+	{
+		fprintf(stderr, "Can't start a thread: %s\n", strerror(r));
+		exit(1);
+	}
+	dup2(rt_console[1], STDOUT_FILENO);
+	close(rt_console[1]);
+	rt_active = 1;
+	atexit(rt_close);
+
+	for (int i = DISK_NUM_MIN; i < DISK_COUNT; i++)
+	{
+		struct stat st;
+		void *map;
+
+		if (disks[i].in_use && fstat(disks[i].file, &st) == 0 && st.st_size > 0 &&
+		    (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, disks[i].file, 0)) != MAP_FAILED)
+		{
+			rt_maps[i] = map;
+			rt_map_bytes[i] = st.st_size;
+			rt_locked_bytes += st.st_size;
+		}
+	}
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+	{
+		fprintf(stderr, MAKE_RED "Warning: can't lock memory: %s\n" RESET_COLOR, strerror(errno));
+		rt_locked_bytes = 0;
+	}
+	pthread_t serial[3] = { pthread_self(), comm_rx_thread, comm_tx_thread };
+	int count = (comm_threaded ? 3 : 1);
+
+	if (rt_cpu >= 0)
+	{
+		cpu_set_t cpu;
+
+		CPU_ZERO(&cpu);
+		CPU_SET(rt_cpu, &cpu);
+		for (int i = 0; i < count && rt_cpu >= 0; i++)
+		{
+			if ((r = pthread_setaffinity_np(serial[i], sizeof(cpu), &cpu)) != 0)
+			{
+				fprintf(stderr, MAKE_RED "Warning: can't run on cpu %d: %s\n" RESET_COLOR, rt_cpu, strerror(r));
+				rt_cpu = -1;
+			}
+		}
+	}
+	for (int i = 0; i < count && rt_priority; i++)
+	{
+		if ((r = pthread_setschedparam(serial[i], SCHED_FIFO, &param)) != 0)
+		{
+			fprintf(stderr, MAKE_RED "Warning: can't run at SCHED_FIFO priority %d: %s\n" RESET_COLOR, rt_priority,
+				strerror(r));
+			rt_priority = 0;
+		}
+	}
+	if (rt_priority)
+		printf("Real-time: SCHED_FIFO priority %d", rt_priority);
+	else
+		printf("Real-time: ordinary priority");
+	if (rt_cpu >= 0)
+		printf(" on cpu %d", rt_cpu);
+	if (rt_locked_bytes)
+		printf(", memory locked with %ld KB of images", rt_locked_bytes / 1024);
+	printf("\n");
+}
+
+void rt_report()
+{
+	long count = 0;
+	long percentiles[3] = { 500, 990, 999 }; //per mille
+	int p = 0;
+
+	if (rt_responses == 0)
+		return;
+	printf("Response time (request in to first byte out): %ld request%s, mean %.0f us, max %ld us;",
+	       rt_responses, (rt_responses == 1 ? "" : "s"), rt_latency_sum / rt_responses, rt_latency_max);
+	for (int b = 0; b < RT_BUCKETS && p < 3; b++)
+	{
+		count += rt_latency[b];
+		for (; p < 3 && count * 1000 >= percentiles[p] * rt_responses; p++)
+			printf("%s %ld.%ld%% < %ld us", (p ? "," : ""), percentiles[p] / 10, percentiles[p] % 10, 1L << b);
+	}
+	printf("\n");
+	for (int b = 0; b < RT_BUCKETS; b++)
+	{
+		if (rt_latency[b])
+			printf("  < %8ld us %8ld %5.1f%%\n", 1L << b, rt_latency[b], rt_latency[b] * 100.0 / rt_responses);
+	}
+	if (rt_job_inline)
+		printf("Real-time: %ld job%s run inline, the writer thread being behind\n", rt_job_inline,
+		       (rt_job_inline == 1 ? "" : "s"));
+}
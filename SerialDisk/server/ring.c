@@ -0,0 +1,181 @@
+/*
+	ring.c: single producer, single consumer byte rings
+
+	The serial pipeline (comm.c) passes bytes between threads through
+	these. Only the producer moves tail and only the consumer moves
+	head, so neither takes a lock. Both count up forever; the offset
+	into data is the count modulo size, which is a power of two. A side
+	that must wait (nothing to read, no room to write) sleeps on a futex
+	that every move of head or tail bumps.
+
+	The producer can put bytes in without publishing them, and publish
+	several puts at once, so a reader sees them together.
+*/
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <linux/futex.h>
+
+struct ring
+{
+	unsigned char *data;
+	size_t size; //a power of two
+	_Atomic size_t head; //read up to here
+	_Atomic size_t tail; //published up to here
+	size_t pending; //put up to here, not yet published (the producer's own)
+	_Atomic uint32_t moved; //bumped whenever head or tail moves
+	_Atomic int sleepers;
+	_Atomic int closed; //the producer has gone
+};
+
+int ring_init(struct ring *r, size_t size)
+{
+	memset(r, 0, sizeof(*r));
+	r->size = size;
+	return (r->data = malloc(size)) == NULL ? -1 : 0;
+}
+
+static void ring_wake(struct ring *r)
+{
+	atomic_fetch_add(&r->moved, 1);
+	if (atomic_load(&r->sleepers))
+		syscall(SYS_futex, &r->moved, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Sleep until the ring has moved since seen, for at most ms (forever if ms < 0).
+static void ring_sleep(struct ring *r, uint32_t seen, int ms)
+{
+	struct timespec t = { ms / 1000, ms % 1000 * 1000000L };
+
+	atomic_fetch_add(&r->sleepers, 1);
+	syscall(SYS_futex, &r->moved, FUTEX_WAIT_PRIVATE, seen, (ms < 0 ? NULL : &t), NULL, 0);
+	atomic_fetch_sub(&r->sleepers, 1);
+}
+
+static long ring_ms_since(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Let the consumer see everything put so far.
+void ring_publish(struct ring *r)
+{
+	if (atomic_load(&r->tail) == r->pending)
+		return;
+	atomic_store(&r->tail, r->pending);
+	ring_wake(r);
+}
+
+// Add bytes, waiting for room if need be (having published, so the consumer can make it).
+void ring_put(struct ring *r, const void *bytes, size_t length)
+{
+	const unsigned char *p = bytes;
+
+	while (length > 0)
+	{
+		uint32_t seen = atomic_load(&r->moved);
+		size_t room = r->size - (r->pending - atomic_load(&r->head));
+
+		if (room == 0)
+		{
+			ring_publish(r);
+			ring_sleep(r, seen, -1);
+			continue;
+		}
+		size_t at = r->pending & (r->size - 1);
+		size_t n = length < room ? length : room;
+
+		if (n > r->size - at)
+			n = r->size - at;
+		memcpy(r->data + at, p, n);
+		r->pending += n;
+		p += n;
+		length -= n;
+	}
+}
+
+// The producer has finished; the consumer gets what is left, then nothing.
+void ring_close(struct ring *r)
+{
+	ring_publish(r);
+	atomic_store(&r->closed, 1);
+	ring_wake(r);
+}
+
+/*
+ * Wait up to ms (forever if ms < 0) for bytes to read. Sets *p to the first
+ * and returns how many follow it without wrapping; 0 on a timeout, or if the
+ * ring is closed and empty. ring_consume says how many were used.
+ */
+size_t ring_peek(struct ring *r, unsigned char **p, int ms)
+{
+	struct timespec start;
+	size_t head = atomic_load(&r->head);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;)
+	{
+		uint32_t seen = atomic_load(&r->moved);
+		size_t avail = atomic_load(&r->tail) - head;
+
+		if (avail > 0)
+		{
+			size_t at = head & (r->size - 1);
+
+			*p = r->data + at;
+			return avail < r->size - at ? avail : r->size - at;
+		}
+		if (atomic_load(&r->closed))
+			return 0;
+		if (ms >= 0)
+		{
+			long left = ms - ring_ms_since(&start);
+
+			if (left <= 0)
+				return 0;
+			ring_sleep(r, seen, left);
+		}
+		else
+			ring_sleep(r, seen, -1);
+	}
+}
+
+void ring_consume(struct ring *r, size_t n)
+{
+	atomic_fetch_add(&r->head, n);
+	ring_wake(r);
+}
+
+// Copy out up to length bytes, waiting up to ms for the first.
+size_t ring_get(struct ring *r, void *bytes, size_t length, int ms)
+{
+	unsigned char *p;
+	size_t got = 0, n;
+
+	while (got < length && (n = ring_peek(r, &p, (got ? 0 : ms))) > 0)
+	{
+		if (n > length - got)
+			n = length - got;
+		memcpy((unsigned char *) bytes + got, p, n);
+		ring_consume(r, n);
+		got += n;
+	}
+	return got;
+}
+
+// Wait until the consumer has used everything published.
+void ring_drain(struct ring *r)
+{
+	for (;;)
+	{
+		uint32_t seen = atomic_load(&r->moved);
+
+		if (atomic_load(&r->head) == atomic_load(&r->tail))
+			return;
+		ring_sleep(r, seen, -1);
+	}
+}
@@ -0,0 +1,210 @@
+/*
+	sdskctl.c: change the OS/8 files of a running server
+
+	Talks to the server's control socket (see control.c), so a file can
+	be added, replaced or deleted while the PDP-8 keeps running, without
+	rebuilding the image.
+
+	Host files are in the same form os8xplode writes and mkdsk reads:
+	three bytes for each two words. A text file (any extension but .SV,
+	.LO, .HI, .RL and .BN, unless -b is given, or any file with -a) is
+	plain ASCII: each character gets bit 0200, line feeds become carriage
+	return, line feed, and a ^Z marks the end.
+
+	If the PDP-8 is in the middle of using the directory the server says
+	it is busy, and the command is tried again for a few seconds.
+
+	heat lists the blocks of a side the PDP-8 has used most, and map
+	draws them all (see heatmap.c). save writes a drive kept in memory
+	(-M) to its file.
+
+	Usage: sdskctl [-s socket] dir A
+	       sdskctl [-s socket] [-a | -b] put A file [NAME.EX]
+	       sdskctl [-s socket] rm A NAME.EX
+	       sdskctl [-s socket] heat A [count]
+	       sdskctl [-s socket] map A
+	       sdskctl [-s socket] save A
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_SOCKET "sdsk.sock"
+#define BUSY_TRIES 50
+#define BUSY_WAIT_US 100000
+
+static const char usage[] = "Usage: %s [-s socket] dir A\n"
+                            "       %s [-s socket] [-a | -b] put A file [NAME.EX]\n"
+                            "       %s [-s socket] rm A NAME.EX\n"
+                            "       %s [-s socket] heat A [count]\n"
+                            "       %s [-s socket] map A\n"
+                            "       %s [-s socket] save A\n";
+
+static const char *binary_extensions[] = { "SV", "LO", "HI", "RL", "BN", NULL };
+
+// Send line and data, print the reply. Returns 0 for ok, 1 for busy, 2 for an error.
+int command(const char *path, const char *line, unsigned char *data, long length)
+{
+	struct sockaddr_un addr = { AF_UNIX };
+	char reply[256];
+	int s, status = 2;
+	FILE *f;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(2, "%s: name too long", path);
+	strcpy(addr.sun_path, path);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		err(2, "%s", path);
+	if (write(s, line, strlen(line)) != strlen(line))
+		err(2, "%s", path);
+	for (long done = 0, c; done < length; done += c)
+	{
+		if ((c = write(s, data + done, length - done)) <= 0)
+			break; //the server has answered already
+	}
+	shutdown(s, SHUT_WR);
+	if ((f = fdopen(s, "r")) == NULL)
+		err(2, "fdopen");
+	while (fgets(reply, sizeof(reply), f))
+	{
+		if (!strncmp(reply, "ok", 2))
+			status = 0;
+		else if (!strncmp(reply, "busy", 4))
+			status = 1;
+		if (status != 1)
+			fputs(reply, (!strncmp(reply, "error", 5) ? stderr : stdout));
+	}
+	fclose(f);
+	return status;
+}
+
+// Read a host file as words in the server's byte order (low eight bits, high four).
+unsigned char *load(const char *name, int text, long *words)
+{
+	FILE *f = fopen(name, "rb");
+	unsigned char *bytes = NULL, *data;
+	long count = 0, size = 0;
+	int c;
+
+	if (f == NULL)
+		err(2, "%s", name);
+	for (;;)
+	{
+		if (count + 3 >= size && (bytes = realloc(bytes, size = size * 2 + 4096)) == NULL)
+			err(2, "%s", name);
+		if ((c = getc(f)) == EOF)
+			break;
+		if (text)
+		{
+			if (c == '\n' && (count == 0 || bytes[count - 1] != ('\r' | 0200)))
+				bytes[count++] = '\r' | 0200;
+			c = (c & 0177) | 0200;
+		}
+		bytes[count++] = c;
+	}
+	fclose(f);
+	if (text)
+		bytes[count++] = 032 | 0200;
+	while (count % 3)
+		bytes[count++] = 0;
+
+	*words = count / 3 * 2;
+	if ((data = malloc(*words * 2)) == NULL)
+		err(2, "%s", name);
+	for (long i = 0; i < count / 3; i++)
+	{
+		unsigned char *b = bytes + 3 * i;
+		int w1 = b[0] | ((b[2] & 0360) << 4), w2 = b[1] | ((b[2] & 017) << 8);
+
+		data[4 * i] = w1 & 0377;
+		data[4 * i + 1] = w1 >> 8;
+		data[4 * i + 2] = w2 & 0377;
+		data[4 * i + 3] = w2 >> 8;
+	}
+	free(bytes);
+	return data;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = DEFAULT_SOCKET, *name, *program = argv[0];
+	char line[128];
+	unsigned char *data = NULL;
+	long words = 0;
+	int text = -1, c, status;
+	struct timespec start, end;
+
+	signal(SIGPIPE, SIG_IGN);
+	while ((c = getopt(argc, argv, "s:ab")) != -1)
+	{
+		switch (c)
+		{
+			case 's': path = optarg; break;
+			case 'a': text = 1; break;
+			case 'b': text = 0; break;
+			default:
+				fprintf(stderr, usage, program, program, program, program, program, program);
+				exit(2);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 2 && !strcmp(argv[0], "dir"))
+		snprintf(line, sizeof(line), "dir %s\n", argv[1]);
+	else if ((argc == 3 || argc == 4) && !strcmp(argv[0], "put"))
+	{
+		// The OS/8 name defaults to the host file's, less any directory.
+		name = argc == 4 ? argv[3] : (strrchr(argv[2], '/') ? strrchr(argv[2], '/') + 1 : argv[2]);
+		if (text < 0)
+		{
+			const char *ext = strrchr(name, '.');
+
+			text = 1;
+			for (int i = 0; ext != NULL && binary_extensions[i]; i++)
+			{
+				if (!strcasecmp(ext + 1, binary_extensions[i]))
+					text = 0;
+			}
+		}
+		data = load(argv[2], text, &words);
+		snprintf(line, sizeof(line), "put %s %s %ld\n", argv[1], name, words);
+	}
+	else if (argc == 3 && !strcmp(argv[0], "rm"))
+		snprintf(line, sizeof(line), "delete %s %s\n", argv[1], argv[2]);
+	else if ((argc == 2 || argc == 3) && !strcmp(argv[0], "heat"))
+		snprintf(line, sizeof(line), "heat %s %s\n", argv[1], (argc == 3 ? argv[2] : ""));
+	else if (argc == 2 && !strcmp(argv[0], "map"))
+		snprintf(line, sizeof(line), "heatmap %s\n", argv[1]);
+	else if (argc == 2 && !strcmp(argv[0], "save"))
+		snprintf(line, sizeof(line), "save %s\n", argv[1]);
+	else
+	{
+		fprintf(stderr, usage, program, program, program, program, program, program);
+		exit(2);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int tries = 0; (status = command(path, line, data, words * 2)) == 1; tries++)
+	{
+		if (tries == BUSY_TRIES)
+		{
+			fprintf(stderr, "%s: the server stayed busy\n", path);
+			break;
+		}
+		usleep(BUSY_WAIT_US);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (status == 0 && data != NULL)
+		printf("%ld words (%s) in %.1f ms\n", words, (text ? "text" : "binary"),
+		       (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	free(data);
+	return status;
+}
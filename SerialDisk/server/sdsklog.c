@@ -0,0 +1,225 @@
+/*
+	sdsklog.c: make sense of the server's access log
+
+	Reads the binary logs the server writes with -L (see accesslog.c and
+	accessfmt.c), oldest first, and reports on the workload: the mix of
+	reads and writes, request sizes, how often a request carries on where
+	the last one on that side stopped, the gaps between requests, and
+	where the time went. A request is a wakeup character and everything
+	that answered it; each extent of a scatter/gather list is counted
+	as a transfer of its own.
+
+	With -d every record is printed as well, one line each.
+
+	Usage: sdsklog [-d] log...
+	e.g.   sdsklog disk.log.2 disk.log.1 disk.log
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+
+#include "accessfmt.c"
+
+#define PAGE_SIZE 0200
+#define NACK 02000
+#define SIDES 8
+#define MAX_PAGES 040
+#define GAP_BUCKETS 7
+
+static const char usage[] = "Usage: %s [-d] log [log...]\n";
+
+static const char *gap_names[GAP_BUCKETS] = { "< 1 ms", "< 10 ms", "< 100 ms", "< 1 s", "< 10 s", "< 1 min", ">= 1 min" };
+static const long gap_limits[GAP_BUCKETS - 1] = { 1000, 10000, 100000, 1000000, 10000000, 60000000 }; //us
+
+struct access_record *records;
+long record_count;
+long bits_per_sec;
+
+// Append the records of one log file.
+void load(const char *name)
+{
+	struct access_header header;
+	long size = access_load(name, &header, &records, &record_count);
+
+	if (bits_per_sec && header.bits_per_sec != bits_per_sec)
+		warnx("%s was logged at %u bits/s, not %ld", name, header.bits_per_sec, bits_per_sec);
+	bits_per_sec = header.bits_per_sec;
+	printf("%s: %ld records from %s at %u bits/s\n", name, size, header.port, header.bits_per_sec);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+	return (x > y) - (x < y);
+}
+
+static double percent(long part, long whole)
+{
+	return whole ? part * 100.0 / whole : 0;
+}
+
+// Line time for a transfer, from the line speed: 10 bits a character.
+static long line_us(struct access_record *r)
+{
+	long words = r->pages * PAGE_SIZE;
+	long bytes = (r->wakeup & 040) ? words / 2 * 3 : words * 2;
+
+	return bits_per_sec ? bytes * 10 * 1000000 / bits_per_sec : 0;
+}
+
+void dump()
+{
+	char when[32];
+
+	printf("Time                       Drive W  Block Pages Status Header   Disk   Data  Total (us)\n");
+	for (long i = 0; i < record_count; i++)
+	{
+		struct access_record *r = &records[i];
+		time_t t = r->time_ns / 1000000000;
+
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		printf("%s.%06ld  %c%c%c  %c %06o %5d  %04o %6u %6u %6u %6u%s%s\n", when, (long) (r->time_ns / 1000 % 1000000),
+		       'A' + r->region, ((r->wakeup & 040) ? 'd' : ' '), ((r->wakeup & 0200) ? 'c' : ' '),
+		       ((r->flags & ACCESS_WRITE) ? 'W' : 'R'), r->block, r->pages, r->status,
+		       r->header_us, r->disk_us, r->data_us, r->total_us,
+		       ((r->flags & ACCESS_EXTENT) ? " extent" : ""), ((r->flags & ACCESS_CACHED) ? " cached" : ""));
+	}
+	printf("\n");
+}
+
+void analyze()
+{
+	long requests = 0, reads = 0, writes = 0, read_pages = 0, write_pages = 0, nacks = 0, cached = 0;
+	long sizes[MAX_PAGES + 1][2] = { { 0 } }, gaps[GAP_BUCKETS] = { 0 };
+	long sequential = 0, same_side = 0, next_block[SIDES];
+	long header = 0, disk = 0, data = 0, total = 0, line = 0;
+	long *gap_us = malloc(record_count * sizeof(long)), gap_count = 0;
+	uint64_t last_time = 0;
+
+	for (int s = 0; s < SIDES; s++)
+		next_block[s] = -1;
+	for (long i = 0; i < record_count; i++)
+	{
+		struct access_record *r = &records[i];
+		int write = (r->flags & ACCESS_WRITE) != 0;
+
+		if (!(r->flags & ACCESS_EXTENT))
+		{
+			if (requests++ && r->time_ns >= last_time)
+			{
+				long gap = (r->time_ns - last_time) / 1000;
+				int bucket = 0;
+
+				while (bucket < GAP_BUCKETS - 1 && gap >= gap_limits[bucket])
+					bucket++;
+				gaps[bucket]++;
+				gap_us[gap_count++] = gap;
+			}
+			last_time = r->time_ns;
+		}
+		if (r->status & NACK)
+		{
+			nacks++;
+			continue;
+		}
+		if (write)
+		{
+			writes++;
+			write_pages += r->pages;
+		}
+		else
+		{
+			reads++;
+			read_pages += r->pages;
+		}
+		cached += (r->flags & ACCESS_CACHED) != 0;
+		sizes[r->pages <= MAX_PAGES ? r->pages : 0][write]++;
+		if (r->region < SIDES)
+		{
+			if (next_block[r->region] >= 0)
+			{
+				same_side++;
+				sequential += r->block == next_block[r->region];
+			}
+			next_block[r->region] = r->block + (r->pages + 1) / 2;
+		}
+		header += r->header_us;
+		disk += r->disk_us;
+		data += r->data_us;
+		total += r->header_us + r->total_us;
+		line += line_us(r);
+	}
+
+	long transfers = reads + writes;
+	double span = record_count > 1 ? (records[record_count - 1].time_ns - records[0].time_ns) / 1e9 : 0;
+
+	printf("%ld requests, %ld transfers (%ld failed) over %.1f s\n", requests, transfers + nacks, nacks, span);
+	printf("Reads:  %6ld (%5.1f%%), %7ld pages (%5.1f%%), %ld from the read-ahead cache\n", reads, percent(reads, transfers),
+	       read_pages, percent(read_pages, read_pages + write_pages), cached);
+	printf("Writes: %6ld (%5.1f%%), %7ld pages (%5.1f%%)\n", writes, percent(writes, transfers),
+	       write_pages, percent(write_pages, read_pages + write_pages));
+	if (transfers == 0)
+		return;
+
+	printf("\nPages    Reads   Writes\n");
+	for (int p = 1; p <= MAX_PAGES; p++)
+	{
+		if (sizes[p][0] || sizes[p][1])
+			printf("%5d %8ld %8ld\n", p, sizes[p][0], sizes[p][1]);
+	}
+	printf("Mean %.1f pages a transfer\n", (double) (read_pages + write_pages) / transfers);
+
+	printf("\nSequential: %ld of %ld transfers (%.1f%%) start where the last one on that side ended\n",
+	       sequential, same_side, percent(sequential, same_side));
+
+	if (gap_count)
+	{
+		qsort(gap_us, gap_count, sizeof(long), compare_long);
+		printf("\nGap between requests: median %.1f ms, 90%% %.1f ms, 99%% %.1f ms\n", gap_us[gap_count / 2] / 1e3,
+		       gap_us[gap_count * 9 / 10] / 1e3, gap_us[gap_count * 99 / 100] / 1e3);
+		for (int b = 0; b < GAP_BUCKETS; b++)
+			printf("  %-8s %8ld %5.1f%%\n", gap_names[b], gaps[b], percent(gaps[b], gap_count));
+	}
+
+	printf("\nTime in requests: %.2f s, %.1f ms a transfer\n", total / 1e6, total / 1e3 / transfers);
+	printf("  headers   %8.2f s %5.1f%%\n", header / 1e6, percent(header, total));
+	printf("  data      %8.2f s %5.1f%% (the line alone would take %.2f s)\n", data / 1e6, percent(data, total), line / 1e6);
+	printf("  disk      %8.2f s %5.1f%%\n", disk / 1e6, percent(disk, total));
+	printf("  the rest  %8.2f s %5.1f%% (acknowledgments, read-ahead, bookkeeping)\n",
+	       (total - header - data - disk) / 1e6, percent(total - header - data - disk, total));
+	printf("Wire (headers and data) %.1f%%, server %.1f%%\n", percent(header + data, total),
+	       percent(total - header - data, total));
+	free(gap_us);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, list = 0;
+
+	while ((c = getopt(argc, argv, "d")) != -1)
+	{
+		switch (c)
+		{
+			case 'd': list = 1; break;
+			default:
+				fprintf(stderr, usage, argv[0]);
+				exit(1);
+		}
+	}
+	if (optind == argc)
+	{
+		fprintf(stderr, usage, argv[0]);
+		exit(1);
+	}
+	for (int i = optind; i < argc; i++)
+		load(argv[i]);
+	printf("\n");
+	if (list)
+		dump();
+	analyze();
+	return 0;
+}
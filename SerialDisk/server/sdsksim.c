@@ -0,0 +1,513 @@
+/*
+	sdsksim.c: what would a block cache of each size have hit?
+
+	Replays the requests in the server's access logs (-L, see accesslog.c
+	and accessfmt.c), oldest first, against simulated caches of whole
+	blocks, the unit process_read and process_write move and the
+	read-ahead cache keeps. Only reads can hit; by default a write drops
+	the blocks it covers, as the server does, and with -u it leaves them
+	cached with the new data instead.
+
+	First the miss-ratio curve for LRU, from one pass that finds each
+	read's stack distance (how many other blocks were used since this one
+	was last used: a cache of more blocks than that would have had it).
+	Then LRU, FIFO, CLOCK and OPT (Belady's, which knows the future and
+	so bounds what any policy could do) at each size, and LRU with
+	read-ahead: after a read that missed, the next window blocks of the
+	side are fetched as well.
+
+	Sizes are in blocks, doubling by default up to everything the logs
+	touched. The server keeps 2 KB for each, and its -P budget is in
+	blocks too. With -c the results go to a CSV file as well, one row
+	per policy, window and size.
+
+	Usage: sdsksim [-s blocks,...] [-w window,...] [-u] [-c file.csv] log...
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "accessfmt.c"
+
+#define NUMBER_OF_BLOCKS 06260 //blocks in an RK05 side
+#define SIDES 8
+#define KEYS (SIDES * NUMBER_OF_BLOCKS) //a block of a side
+#define KB_PER_BLOCK 2 //the server keeps the disk and wire formats
+#define MAX_SIZES 32
+#define MAX_WINDOWS 16
+#define NEVER 0x7fffffffL //next use of a block that isn't used again
+
+enum { LRU, FIFO, CLOCK, OPT, POLICIES };
+
+static const char *policy_names[POLICIES] = { "LRU", "FIFO", "CLOCK", "OPT" };
+static const char usage[] = "Usage: %s [-s blocks,...] [-w window,...] [-u] [-c file.csv] log...\n";
+
+struct ref
+{
+	int key; //side * NUMBER_OF_BLOCKS + block
+	int write;
+	int transfer; //index of the transfer it came from
+};
+
+struct transfer
+{
+	int side, block, count, write;
+	long first_ref;
+};
+
+struct result
+{
+	long hits;
+	long prefetched; //blocks read ahead
+	long prefetch_used; //of those, later read
+};
+
+struct ref *refs;
+long ref_count, reads;
+struct transfer *transfers;
+long transfer_count;
+int update; //-u: writes keep the blocks, with the new data
+
+// The cache being simulated. Blocks are chained least recently used (or first in) first.
+int size, policy;
+int resident[KEYS], prefetched[KEYS];
+int prev[KEYS + 1], next[KEYS + 1]; //KEYS is the list head
+int used; //blocks cached
+int clock_block[KEYS], clock_slot[KEYS], clock_free[KEYS], clock_hand, clock_free_count; //block in a slot, slot of a block
+char clock_ref[KEYS];
+long *next_use; //for OPT, per ref
+long opt_next[KEYS]; //for OPT, per block: the next use it is cached for
+struct heap_entry { long next; int key; } *heap;
+long heap_count;
+
+// Turn the logs into a list of block references.
+void build(struct access_record *records, long count)
+{
+	refs = malloc(count * 040 * sizeof(*refs));
+	transfers = malloc(count * sizeof(*transfers));
+	if (refs == NULL || transfers == NULL)
+		err(1, "malloc");
+	for (long i = 0; i < count; i++)
+	{
+		struct access_record *r = &records[i];
+		struct transfer *t = &transfers[transfer_count];
+
+		if ((r->status & 02000) || r->region >= SIDES || r->pages == 0)
+			continue;
+		t->side = r->region;
+		t->block = r->block;
+		t->count = (r->pages + 1) / 2;
+		t->write = (r->flags & ACCESS_WRITE) != 0;
+		t->first_ref = ref_count;
+		for (int b = t->block; b < t->block + t->count && b < NUMBER_OF_BLOCKS; b++)
+		{
+			refs[ref_count].key = t->side * NUMBER_OF_BLOCKS + b;
+			refs[ref_count].write = t->write;
+			refs[ref_count].transfer = transfer_count;
+			reads += !t->write;
+			ref_count++;
+		}
+		transfer_count++;
+	}
+}
+
+/*
+ * One pass over the references for the LRU stack distance of each read.
+ * A Fenwick tree over time marks the latest use of each block still
+ * cached, so the distance is the number of marks since this block's.
+ * distances[d] counts reads at distance d; cold misses aren't counted.
+ */
+void stack_distances(long *distances)
+{
+	long *tree = calloc(ref_count + 1, sizeof(long));
+	long last[KEYS];
+
+	if (tree == NULL)
+		err(1, "malloc");
+	for (int k = 0; k < KEYS; k++)
+		last[k] = -1;
+	for (long t = 0; t < ref_count; t++)
+	{
+		int k = refs[t].key;
+		long d = -1;
+
+		if (last[k] >= 0)
+		{
+			// Marks in (last[k], t): sum up to t - 1 less sum up to last[k].
+			d = 0;
+			for (long i = t; i > 0; i -= i & -i)
+				d += tree[i];
+			for (long i = last[k] + 1; i > 0; i -= i & -i)
+				d -= tree[i];
+			for (long i = last[k] + 1; i <= ref_count; i += i & -i)
+				tree[i]--;
+			last[k] = -1;
+		}
+		if (refs[t].write && !update)
+			continue; //dropped
+		for (long i = t + 1; i <= ref_count; i += i & -i)
+			tree[i]++;
+		last[k] = t;
+		if (!refs[t].write && d >= 0)
+			distances[d]++;
+	}
+	free(tree);
+}
+
+static void heap_push(long next_time, int key)
+{
+	long i = heap_count++;
+
+	while (i > 0 && heap[(i - 1) / 2].next < next_time)
+	{
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i].next = next_time;
+	heap[i].key = key;
+}
+
+static struct heap_entry heap_pop()
+{
+	struct heap_entry top = heap[0], last = heap[--heap_count];
+	long i = 0;
+
+	for (;;)
+	{
+		long child = 2 * i + 1;
+
+		if (child >= heap_count)
+			break;
+		if (child + 1 < heap_count && heap[child + 1].next > heap[child].next)
+			child++;
+		if (heap[child].next <= last.next)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	return top;
+}
+
+// The cached block OPT wants back latest, as a heap entry (the heap holds stale ones too).
+static struct heap_entry opt_farthest()
+{
+	while (heap_count)
+	{
+		if (resident[heap[0].key] && opt_next[heap[0].key] == heap[0].next)
+			return heap[0];
+		heap_pop();
+	}
+	return (struct heap_entry) { -1, -1 };
+}
+
+static void unlink_block(int k)
+{
+	next[prev[k]] = next[k];
+	prev[next[k]] = prev[k];
+}
+
+static void append_block(int k)
+{
+	prev[k] = prev[KEYS];
+	next[k] = KEYS;
+	next[prev[KEYS]] = k;
+	prev[KEYS] = k;
+}
+
+static void drop(int k)
+{
+	if (!resident[k])
+		return;
+	resident[k] = prefetched[k] = 0;
+	used--;
+	if (policy == CLOCK)
+		clock_free[clock_free_count++] = clock_slot[k];
+	else if (policy != OPT)
+		unlink_block(k);
+}
+
+// Cache block k, whose next use (for OPT) is at when. Returns 0 if OPT would rather not.
+static int insert(int k, long when)
+{
+	if (policy == OPT)
+	{
+		if (used == size)
+		{
+			struct heap_entry far = opt_farthest();
+
+			if (far.key < 0 || far.next <= when)
+				return 0;
+			drop(heap_pop().key);
+		}
+		opt_next[k] = when;
+		heap_push(when, k);
+	}
+	else if (policy == CLOCK)
+	{
+		int slot;
+
+		if (used == size)
+		{
+			while (clock_ref[clock_block[clock_hand]])
+			{
+				clock_ref[clock_block[clock_hand]] = 0;
+				clock_hand = (clock_hand + 1) % size;
+			}
+			drop(clock_block[clock_hand]);
+			clock_hand = (clock_hand + 1) % size;
+		}
+		slot = clock_free[--clock_free_count];
+		clock_block[slot] = k;
+		clock_slot[k] = slot;
+		clock_ref[k] = 0;
+	}
+	else
+	{
+		if (used == size)
+			drop(next[KEYS]);
+		append_block(k);
+	}
+	resident[k] = 1;
+	used++;
+	return 1;
+}
+
+// A hit on block k, next used at when.
+static void touch(int k, long when)
+{
+	if (policy == LRU)
+	{
+		unlink_block(k);
+		append_block(k);
+	}
+	else if (policy == CLOCK)
+		clock_ref[k] = 1;
+	else if (policy == OPT)
+	{
+		opt_next[k] = when;
+		heap_push(when, k);
+	}
+}
+
+// Replay the references against one cache.
+struct result simulate(int cache_policy, int cache_size, int window)
+{
+	struct result result = { 0 };
+
+	policy = cache_policy;
+	size = cache_size;
+	used = 0;
+	memset(resident, 0, sizeof(resident));
+	memset(prefetched, 0, sizeof(prefetched));
+	prev[KEYS] = next[KEYS] = KEYS;
+	heap_count = 0;
+	clock_hand = 0;
+	clock_free_count = 0;
+	for (int s = size - 1; s >= 0; s--)
+		clock_free[clock_free_count++] = s;
+
+	for (long t = 0; t < transfer_count; t++)
+	{
+		struct transfer *tr = &transfers[t];
+		int missed = 0;
+
+		for (long i = tr->first_ref; i < tr->first_ref + tr->count && i < ref_count && refs[i].transfer == t; i++)
+		{
+			int k = refs[i].key;
+
+			if (tr->write && !update)
+				drop(k);
+			else if (resident[k])
+			{
+				if (!tr->write)
+				{
+					result.hits++;
+					if (prefetched[k])
+						result.prefetch_used++;
+				}
+				prefetched[k] = 0;
+				touch(k, next_use ? next_use[i] : 0);
+			}
+			else
+			{
+				missed |= !tr->write;
+				insert(k, next_use ? next_use[i] : 0);
+			}
+		}
+		if (missed && window)
+		{
+			// Read ahead the rest of the window, as far as the end of the side.
+			for (int b = tr->block + tr->count; b < tr->block + tr->count + window && b < NUMBER_OF_BLOCKS; b++)
+			{
+				int k = tr->side * NUMBER_OF_BLOCKS + b;
+
+				if (!resident[k] && insert(k, 0))
+				{
+					prefetched[k] = 1;
+					result.prefetched++;
+				}
+			}
+		}
+	}
+	return result;
+}
+
+// For OPT: when each reference's block is next read (or NEVER, or dropped by a write first).
+void find_next_uses()
+{
+	long last[KEYS];
+
+	if ((next_use = malloc(ref_count * sizeof(long))) == NULL || (heap = malloc(ref_count * 2 * sizeof(*heap))) == NULL)
+		err(1, "malloc");
+	for (int k = 0; k < KEYS; k++)
+		last[k] = NEVER;
+	for (long t = ref_count - 1; t >= 0; t--)
+	{
+		int k = refs[t].key;
+
+		next_use[t] = last[k];
+		last[k] = refs[t].write && !update ? NEVER : t;
+	}
+}
+
+static int parse_list(char *arg, int *list, int max)
+{
+	int n = 0;
+
+	for (char *item = strtok(arg, ","); item && n < max; item = strtok(NULL, ","))
+		list[n++] = atoi(item);
+	return n;
+}
+
+static void csv_row(FILE *csv, const char *name, int window, int blocks, long hits, struct result *r)
+{
+	if (csv == NULL)
+		return;
+	fprintf(csv, "%s,%d,%d,%d,%ld,%ld,%.6f,%ld,%ld\n", name, window, blocks, blocks * KB_PER_BLOCK, reads, hits,
+	        reads ? 1 - (double) hits / reads : 0, (r ? r->prefetched : 0), (r ? r->prefetch_used : 0));
+}
+
+int main(int argc, char *argv[])
+{
+	int sizes[MAX_SIZES], windows[MAX_WINDOWS] = { 0, 4, 8, 16, 32 };
+	int size_count = 0, window_count = 5, c, footprint = 0;
+	struct access_record *records = NULL;
+	struct access_header header;
+	long record_count = 0, *distances, cold = 0;
+	char *csv_name = NULL, seen[KEYS] = { 0 };
+	FILE *csv = NULL;
+
+	while ((c = getopt(argc, argv, "s:w:uc:")) != -1)
+	{
+		switch (c)
+		{
+			case 's': size_count = parse_list(optarg, sizes, MAX_SIZES); break;
+			case 'w': window_count = parse_list(optarg, windows, MAX_WINDOWS); break;
+			case 'u': update = 1; break;
+			case 'c': csv_name = optarg; break;
+			default:
+				fprintf(stderr, usage, argv[0]);
+				exit(1);
+		}
+	}
+	if (optind == argc)
+	{
+		fprintf(stderr, usage, argv[0]);
+		exit(1);
+	}
+	for (int i = optind; i < argc; i++)
+		access_load(argv[i], &header, &records, &record_count);
+	build(records, record_count);
+	if (reads == 0)
+		errx(1, "no reads in the logs");
+	for (long t = 0; t < ref_count; t++)
+	{
+		footprint += !seen[refs[t].key];
+		seen[refs[t].key] = 1;
+	}
+	if (size_count == 0)
+	{
+		for (int s = 8; size_count < MAX_SIZES; s *= 2)
+		{
+			sizes[size_count++] = s < KEYS ? s : KEYS;
+			if (s >= footprint || s >= KEYS)
+				break;
+		}
+	}
+	for (int i = 0; i < size_count; i++)
+	{
+		if (sizes[i] < 1 || sizes[i] > KEYS)
+			errx(1, "cache sizes are 1 to %d blocks", KEYS);
+	}
+	if (csv_name && (csv = fopen(csv_name, "w")) == NULL)
+		err(1, "%s", csv_name);
+	if (csv)
+		fprintf(csv, "policy,window,blocks,kbytes,reads,hits,miss_ratio,prefetched,prefetch_used\n");
+
+	printf("%ld transfers, %ld block reads, %ld block writes, %d blocks touched; writes %s\n\n",
+	       transfer_count, reads, ref_count - reads, footprint, (update ? "update cached blocks" : "drop cached blocks"));
+
+	// The miss-ratio curve, from the stack distances.
+	if ((distances = calloc(KEYS, sizeof(long))) == NULL)
+		err(1, "malloc");
+	stack_distances(distances);
+	for (int d = 0; d < KEYS; d++)
+		cold += distances[d];
+	cold = reads - cold;
+	printf("LRU miss ratio by size (stack distance), %ld cold misses (%.1f%%)\n", cold, 100.0 * cold / reads);
+	printf("  Blocks       KB   Hits  Miss ratio\n");
+	for (int i = 0; i < size_count; i++)
+	{
+		long hits = 0;
+
+		for (int d = 0; d < sizes[i]; d++)
+			hits += distances[d];
+		printf("%8d %8d %6.1f%% %10.4f\n", sizes[i], sizes[i] * KB_PER_BLOCK, 100.0 * hits / reads, 1 - (double) hits / reads);
+		csv_row(csv, "LRU-stack", 0, sizes[i], hits, NULL);
+	}
+
+	printf("\nMiss ratio by policy, no read-ahead\n  Blocks");
+	for (int p = 0; p < POLICIES; p++)
+		printf(" %9s", policy_names[p]);
+	printf("\n");
+	find_next_uses();
+	for (int i = 0; i < size_count; i++)
+	{
+		printf("%8d", sizes[i]);
+		for (int p = 0; p < POLICIES; p++)
+		{
+			struct result r = simulate(p, sizes[i], 0);
+
+			printf(" %9.4f", 1 - (double) r.hits / reads);
+			csv_row(csv, policy_names[p], 0, sizes[i], r.hits, &r);
+		}
+		printf("\n");
+	}
+
+	printf("\nLRU miss ratio by read-ahead window (blocks after a read that missed), with %% of read-ahead used\n  Blocks");
+	for (int w = 0; w < window_count; w++)
+		printf("   window %-5d", windows[w]);
+	printf("\n");
+	for (int i = 0; i < size_count; i++)
+	{
+		printf("%8d", sizes[i]);
+		for (int w = 0; w < window_count; w++)
+		{
+			struct result r = simulate(LRU, sizes[i], windows[w]);
+
+			if (windows[w])
+				printf(" %7.4f (%3.0f%%)", 1 - (double) r.hits / reads, (r.prefetched ? 100.0 * r.prefetch_used / r.prefetched : 0));
+			else
+				printf(" %7.4f       ", 1 - (double) r.hits / reads);
+			csv_row(csv, "LRU", windows[w], sizes[i], r.hits, &r);
+		}
+		printf("\n");
+	}
+	if (csv && fclose(csv) != 0)
+		err(1, "%s", csv_name);
+	return 0;
+}
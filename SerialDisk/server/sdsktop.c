@@ -0,0 +1,305 @@
+/*
+	sdsktop.c: a live view of a running server
+
+	Asks the server's control socket (see control.c) for its counters
+	every interval and shows, full screen: the bytes each way against
+	what the line can carry, requests per second, the response time
+	percentiles (from the wakeup to the first byte of the answer, see
+	realtime.c), the read-ahead cache hit rate, NACKs and retransmitted
+	pages, what each drive and side is doing and the last requests.
+	Rates are for the last interval; totals since the server started.
+
+	While sdsktop is watching, the server leaves out the lines it
+	prints for each request.
+
+	Usage: sdsktop [-s socket] [-i seconds]
+
+	q quits.
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <curses.h>
+
+#define DEFAULT_SOCKET "sdsk.sock"
+#define SIDES 8
+#define BUCKETS 24 //as RT_BUCKETS in realtime.c
+#define RECENT 64 //as ACCESS_RECENT in accesslog.c
+#define BAR 20 //characters in a bar
+#define NACK 02000
+
+static const char usage[] = "Usage: %s [-s socket] [-i seconds]\n";
+
+struct side
+{
+	char drive;
+	char disk[8];
+	int side;
+	long requests[2], pages[2]; //reads, writes
+};
+
+struct recent
+{
+	unsigned long long ms; //CLOCK_REALTIME
+	char drive, op;
+	int block, pages, status;
+	long us;
+	int cached;
+};
+
+struct stats
+{
+	double time;
+	long bits_per_sec;
+	long bytes_in, bytes_out;
+	long nacks, retransmits;
+	long hits, misses;
+	struct side sides[SIDES];
+	int side_count;
+	long latency[BUCKETS];
+	struct recent recent[RECENT];
+	int recent_count;
+};
+
+// Ask the server for its counters. Returns 0, or -1 with errno set.
+int fetch(const char *path, struct stats *s)
+{
+	struct sockaddr_un addr = { AF_UNIX };
+	char line[256];
+	int sock, ok = 0;
+	FILE *f;
+
+	memset(s, 0, sizeof(*s));
+	strcpy(addr.sun_path, path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || write(sock, "stats\n", 6) != 6 ||
+	    (f = fdopen(sock, "r")) == NULL)
+	{
+		close(sock);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f))
+	{
+		struct side *d = &s->sides[s->side_count];
+		struct recent *r = &s->recent[s->recent_count];
+		char cached[8] = "";
+
+		if (!strncmp(line, "ok", 2))
+			ok = 1;
+		else if (!strncmp(line, "latency", 7))
+		{
+			char *p = line + 7;
+
+			for (int b = 0; b < BUCKETS; b++)
+				s->latency[b] = strtol(p, &p, 10);
+		}
+		else if (sscanf(line, "time %lf", &s->time) == 1 || sscanf(line, "line %ld", &s->bits_per_sec) == 1 ||
+			 sscanf(line, "bytes %ld %ld", &s->bytes_in, &s->bytes_out) == 2 ||
+			 sscanf(line, "errors %ld %ld", &s->nacks, &s->retransmits) == 2 ||
+			 sscanf(line, "cache %ld %ld", &s->hits, &s->misses) == 2)
+			;
+		else if (s->side_count < SIDES &&
+			 sscanf(line, "side %c %7s %d %ld %ld %ld %ld", &d->drive, d->disk, &d->side, &d->requests[0],
+				&d->requests[1], &d->pages[0], &d->pages[1]) == 7)
+			s->side_count++;
+		else if (s->recent_count < RECENT &&
+			 sscanf(line, "recent %llu %c %c %o %d %o %ld %7s", &r->ms, &r->drive, &r->op, &r->block, &r->pages,
+				&r->status, &r->us, cached) >= 7)
+		{
+			r->cached = (cached[0] != 0);
+			s->recent_count++;
+		}
+	}
+	fclose(f);
+	if (!ok)
+		errno = EPROTO;
+	return ok ? 0 : -1;
+}
+
+static void bar(double fraction)
+{
+	int n = (fraction > 1 ? 1 : fraction) * BAR + 0.5;
+
+	addch('[');
+	for (int i = 0; i < BAR; i++)
+		addch(i < n ? '#' : ' ');
+	addch(']');
+}
+
+// The response time percentiles of a histogram, as its buckets' limits.
+static void percentiles(const long *latency)
+{
+	static const long per_mille[3] = { 500, 990, 999 };
+	long total = 0, count = 0;
+	int p = 0;
+
+	for (int b = 0; b < BUCKETS; b++)
+		total += latency[b];
+	if (total == 0)
+	{
+		printw("%-40s", "none");
+		return;
+	}
+	for (int b = 0; b < BUCKETS && p < 3; b++)
+	{
+		count += latency[b];
+		for (; p < 3 && count * 1000 >= per_mille[p] * total; p++)
+			printw("%s%ld.%ld%% < %ld us", (p ? ", " : ""), per_mille[p] / 10, per_mille[p] % 10, 1L << b);
+	}
+	printw("  (%ld)", total);
+}
+
+static double ratio(long part, long whole)
+{
+	return whole ? (double) part / whole : 0;
+}
+
+void draw(const char *path, struct stats *now, struct stats *then, double interval)
+{
+	double dt = (then->time ? now->time - then->time : 0), line = now->bits_per_sec / 10.0; //bytes/s, 8N1
+	long window[BUCKETS], hits = now->hits - then->hits, misses = now->misses - then->misses, reads = 0, writes = 0,
+	     busiest = 1;
+	time_t clock = time(NULL);
+	char stamp[16];
+	int row = 0;
+
+	if (dt <= 0)
+		dt = interval;
+	for (int b = 0; b < BUCKETS; b++)
+		window[b] = now->latency[b] - then->latency[b];
+	for (int i = 0; i < now->side_count; i++)
+	{
+		struct side *d = &now->sides[i], *was = (i < then->side_count ? &then->sides[i] : NULL);
+		long pages = d->pages[0] + d->pages[1] - (was ? was->pages[0] + was->pages[1] : 0);
+
+		reads += d->requests[0] - (was ? was->requests[0] : 0);
+		writes += d->requests[1] - (was ? was->requests[1] : 0);
+		if (pages > busiest)
+			busiest = pages;
+	}
+
+	erase();
+	strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&clock));
+	attron(A_BOLD);
+	mvprintw(row++, 0, "sdsktop  %s  %s  every %.1f s  (q quits)", path, stamp, interval);
+	attroff(A_BOLD);
+	row++;
+	mvprintw(row++, 0, "Line      %ld bit/s, %.0f bytes/s each way", now->bits_per_sec, line);
+	mvprintw(row, 0, "  in  %8.0f bytes/s ", (now->bytes_in - then->bytes_in) / dt);
+	bar(ratio(now->bytes_in - then->bytes_in, line * dt));
+	printw(" %3.0f%%", ratio(now->bytes_in - then->bytes_in, line * dt) * 100);
+	mvprintw(++row, 0, "  out %8.0f bytes/s ", (now->bytes_out - then->bytes_out) / dt);
+	bar(ratio(now->bytes_out - then->bytes_out, line * dt));
+	printw(" %3.0f%%", ratio(now->bytes_out - then->bytes_out, line * dt) * 100);
+	row += 2;
+	mvprintw(row++, 0, "Requests  %.1f/s (%.1f reads, %.1f writes)", (reads + writes) / dt, reads / dt, writes / dt);
+	mvprintw(row++, 0, "Response  now: ");
+	percentiles(window);
+	mvprintw(row++, 0, "          all: ");
+	percentiles(now->latency);
+	mvprintw(row++, 0, "Cache     now: %3.0f%% of %ld blocks   all: %3.0f%% of %ld blocks", ratio(hits, hits + misses) * 100,
+		 hits + misses, ratio(now->hits, now->hits + now->misses) * 100, now->hits + now->misses);
+	mvprintw(row, 0, "Errors    ");
+	if (now->nacks > then->nacks || now->retransmits > then->retransmits)
+		attron(A_BOLD);
+	printw("%ld NACK%s (+%ld), %ld page%s retransmitted (+%ld)", now->nacks, (now->nacks == 1 ? "" : "s"),
+	       now->nacks - then->nacks, now->retransmits, (now->retransmits == 1 ? "" : "s"),
+	       now->retransmits - then->retransmits);
+	attroff(A_BOLD);
+	row += 2;
+
+	attron(A_UNDERLINE);
+	mvprintw(row++, 0, "Drive                   reads/s  writes/s   pages/s      reads     writes  activity");
+	attroff(A_UNDERLINE);
+	for (int i = 0; i < now->side_count; i++)
+	{
+		struct side *d = &now->sides[i], *was = (i < then->side_count ? &then->sides[i] : NULL);
+		long r = d->requests[0] - (was ? was->requests[0] : 0), w = d->requests[1] - (was ? was->requests[1] : 0);
+		long pages = d->pages[0] + d->pages[1] - (was ? was->pages[0] + was->pages[1] : 0);
+
+		mvprintw(row++, 0, "%c  %-6s disk, side %d %8.1f %9.1f %9.1f %10ld %10ld  ", d->drive, d->disk, d->side, r / dt,
+			 w / dt, pages / dt, d->requests[0], d->requests[1]);
+		bar((double) pages / busiest);
+	}
+	row++;
+
+	attron(A_UNDERLINE);
+	mvprintw(row++, 0, "Last requests  time          drive  op     block  pages  status      us");
+	attroff(A_UNDERLINE);
+	for (int i = now->recent_count - 1; i >= 0 && row < LINES; i--, row++)
+	{
+		struct recent *r = &now->recent[i];
+		time_t t = r->ms / 1000;
+
+		strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&t));
+		if (r->status & NACK)
+			attron(A_BOLD);
+		mvprintw(row, 0, "               %s.%03llu  %c      %-5s  %05o  %5d  %s%04o %8ld%s", stamp, r->ms % 1000, r->drive,
+			 (r->op == 'w' ? "write" : "read"), r->block, r->pages, (r->status & NACK ? "NACK " : "ok   "),
+			 r->status, r->us, (r->cached ? "  cached" : ""));
+		attroff(A_BOLD);
+	}
+	refresh();
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = DEFAULT_SOCKET;
+	struct sockaddr_un addr;
+	struct stats stats[2];
+	double interval = 1;
+	int c, current = 0;
+
+	while ((c = getopt(argc, argv, "s:i:")) != -1)
+	{
+		switch (c)
+		{
+			case 's': path = optarg; break;
+			case 'i': interval = atof(optarg); break;
+			default:
+				fprintf(stderr, usage, argv[0]);
+				exit(2);
+		}
+	}
+	if (optind != argc || interval < 0.1)
+	{
+		fprintf(stderr, usage, argv[0]);
+		exit(2);
+	}
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(2, "%s: name too long", path);
+	if (fetch(path, &stats[1]) < 0) //the first interval's start
+		err(2, "%s", path);
+
+	initscr();
+	cbreak();
+	noecho();
+	curs_set(0);
+	timeout(interval * 1000);
+	for (;;)
+	{
+		if (fetch(path, &stats[current]) < 0)
+		{
+			erase();
+			mvprintw(0, 0, "sdsktop  %s: %s, trying again (q quits)", path, strerror(errno));
+			refresh();
+		}
+		else
+		{
+			draw(path, &stats[current], &stats[!current], interval);
+			current = !current;
+		}
+		if ((c = getch()) == 'q' || c == 'Q')
+			break;
+	}
+	endwin();
+	return 0;
+}
@@ -73,6 +73,7 @@
 //	  remainder of the transmission.
 */
 
+#define _GNU_SOURCE //CPU_SET, F_SETPIPE_SZ
 #include <termios.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -82,6 +83,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <linux/io_uring.h>
 
 #define TERM_COLOR
 
@@ -106,6 +113,7 @@
 #define READ 0
 
 #define PAGE_SIZE 0200
+#undef BLOCK_SIZE //<linux/fs.h> has one too
 #define BLOCK_SIZE (PAGE_SIZE * 2)
 #define BYTES_PER_WORD 2
 
@@ -116,17 +124,34 @@
 
 #define DIAL_SUB_DISK_BLK_COUNT 0400
 
+// A list of extents (wakeups I-P) has at most this many, and pages in all.
+#define MAX_EXTENTS 040
+#define MAX_LIST_PAGES 0400
+
+// Lower case wakeup characters ask for the dense data encoding.
+#define WAKEUP_DENSE 040
+// Bit 0200 of a wakeup character asks for per-page checksums.
+#define WAKEUP_CHECKSUM 0200
+#define WAKEUP_DRIVE(c) (((c) & ~(WAKEUP_CHECKSUM | WAKEUP_DENSE)) >= 'A' && ((c) & ~(WAKEUP_CHECKSUM | WAKEUP_DENSE)) <= 'H')
+
+#define MAX_RETRANSMITS 8 //times a page is resent before giving up on the request
+#define CHECK_SLACK_MS 500 //allowance for the PDP-8 on top of the line time
+#define PAD_SLACK_MS 100
+
 //#define DEBUG
 //#define REALLY_DEBUG
 
 int terminate = 0;
 
 #include "config.c"
+#include "trace.c"
 #include "comm.c"
+#include "os8dir.c"
+#include "bootstream.h"
 
 // Note: We expect there to be (at least) a first disk, disk1
 // although this would not be strictly necessary for non-system devices
-static const char usage[] = "Usage: %s -1 disk1 [-2 disk2] [-3 disk3] [-4 disk4] [-r 1|2|3|4] [-w 1|2|3|4] [-b bootloader]\n";
+static const char usage[] = "Usage: %s -1 disk1 [-2 disk2] [-3 disk3] [-4 disk4] [-r 1|2|3|4] [-w 1|2|3|4] [-b bootloader] [-P blocks] [-S 0|1|2] [-U] [-C socket] [-H file] [-L file] [-R priority[,cpu]] [-T] [-J file] [-M 1|2|3|4[,file]] [-k 1|2|3|4] [-K 1|2|3|4]\n";
 
 static const char *disk_num_strings[4] = {
 	"first",	//disk1
@@ -136,34 +161,76 @@ static const char *disk_num_strings[4] = {
 };
 
 void command_loop();
-int initialize_xfr();
+int initialize_xfr(int extent);
+void process_list(struct timespec *wakeup_time, uint64_t traced);
+void build_boot_images();
+void refresh_boot_images();
 void process_send_boot_sector();
+void convert_read(int first, int words, int cached);
+int send_read();
 void process_read();
 void process_write();
+void commit_write(unsigned char *wire);
+void check_stray(const char *warning);
 void HELPBoot();
 void send_word(int word);
 int decode_word(char* buf, int pos);
 void cleanup_and_exit(int poweroff);
 void int_handler(int);
+void term_handler(int);
 void djg_to_pdp(char* buf_in, char* buf_out, int word_count);
 void pdp_to_djg(char* buf_in, char* buf_out, int word_count);
-int write_to_file(FILE* file, int offset, char* buf, int length);
-int read_from_file(FILE* file, int offset, char* buf, int length);
+void djg_to_dense(char* buf_in, char* buf_out, int word_count);
+void mac_to_djg(char* buf_in, char* buf_out, int word_count);
+void djg_to_mac(char* buf_in, char* buf_out, int word_count);
+void mac_to_pdp(char* buf_in, char* buf_out, int word_count);
+void dense_to_djg(char* buf_in, char* buf_out, int word_count);
+int wire_bytes(int word_count);
+int wire_ms(int bytes);
+void note_turnaround(struct timespec *wakeup_time, int header_words);
+int page_checksum(char* buf);
+int checked_read();
+int checked_write();
+int receive_checksum(int page_bytes);
+int retransmit(int page, int tries);
+int receive_timed(char* buf, int length, int ms);
+void drain_input();
 void receive_buf(char* buf, int length);
 int transmit_buf(char* buf, int length);
 
 struct disk_state {
-	FILE* fp;
+	int file;
+	short packed; //three bytes per two words, see storage.c
+	short format; //1 packed (-k), -1 not (-K), 0 to tell from the image
 	short in_use;
 	short read_protect;
 	short write_protect;
+	short in_memory; //-M, see memdisk.c
+	long checked_pages;
+	long retransmits;
 };
 
+int write_to_file(struct disk_state* disk, int offset, char* buf, int length);
+int read_from_file(struct disk_state* disk, int offset, char* buf, int length);
+int image_read_start(struct disk_state* disk, long offset, unsigned char *buf, int length);
+int storage_read_start(int file, long offset, unsigned char *buf, int length);
+int storage_read_finish(int r);
+int control_watching();
+
 int fd;
 unsigned char buf[256];
+unsigned char header_buf[MAX_EXTENTS * 8];
 unsigned char converted_buf[256];
 unsigned char disk_buf[8200];
 unsigned char converted_disk_buf[8200];
+// What NUL and @ send, built at startup and whenever block 0 is written,
+// by the PDP-8, the control socket or another program (see refresh_boot_images).
+// The boot response is boot_stream followed by three patched pieces of block 0.
+#define BOOT_BLOCK0_BYTES ((0134 + 0203 + 3) * BYTES_PER_WORD)
+unsigned char boot_response[sizeof(boot_stream) + BOOT_BLOCK0_BYTES];
+int boot_response_length; //0 if block 0 couldn't be read
+struct timespec boot_image_mtime; //of the system disk, when they were built
+unsigned char boot_sector[BLOCK_SIZE * BYTES_PER_WORD + 1];
 int direction;
 int start_block;
 int total_num_words;
@@ -173,9 +240,25 @@ int half_block = 0;
 int block_offset = 0;
 
 int dial_mode = 0;
+int wakeup;
+int list_xfr = 0;
+int dense_xfr = 0;
+int checksum_xfr = 0;
+int xfr_retransmits;
+long bits_per_sec;
 
 struct disk_state disks[DISK_COUNT] = {0};
 struct disk_state* selected_disk_state = NULL;
+int selected_region; //disk * 2 + side
+
+#include "realtime.c"
+#include "blockstore.c"
+#include "prefetch.c"
+#include "storage.c"
+#include "memdisk.c"
+#include "heatmap.c"
+#include "accesslog.c"
+#include "control.c"
 
 /*
  * Sent from PDP:  abcd -> XXcccddd XXaaabbb
@@ -191,6 +274,18 @@ struct disk_state* selected_disk_state = NULL;
  * -4 [file]: use file as fourth disk
  * -r [1|2|3|4]: read only (NB - for OS/8 system disk (disk 1) must be read/writeable)
  * -w [1|2|3|4]: write only
+ * -P [blocks]: read ahead OS/8 files, keeping at most this many blocks (0 disables)
+ * -S [0|1|2]: durability of writes: 0 page cache, 1 fdatasync in the background, 2 fdatasync before acknowledging
+ * -U: use pread/pwrite rather than io_uring for the disk images
+ * -C [path]: take commands (OS/8 file insert and delete, see control.c) on a UNIX socket
+ * -H [file]: write per-block read and write counts (see heatmap.c) to this file on exit
+ * -L [file]: log each request in binary (see accesslog.c) to this file, for sdsklog
+ * -R [priority[,cpu]]: talk to the PDP-8 at this SCHED_FIFO priority, on this cpu, with memory locked (see realtime.c)
+ * -T: serve the serial port from receive and transmit threads of its own (see comm.c)
+ * -J [file]: trace the phases of each request (see trace.c) to this file, in Chrome trace-event JSON
+ * -M [1|2|3|4[,file]]: keep this disk in memory only (see memdisk.c), saving it to file at exit if one is given
+ * -k [1|2|3|4]: the image is packed, three bytes per two words (see storage.c)
+ * -K [1|2|3|4]: the image is not packed
  */
 
 int main(int argc, char* argv[])
@@ -198,12 +293,14 @@ int main(int argc, char* argv[])
 	struct disk_state* curr_disk;
 
 	signal(SIGINT, int_handler);
+	signal(SIGTERM, term_handler);
+	signal(SIGHUP, term_handler);
 
 	int c;
 	int disk_num;
-	char* filename_disks[4];
+	char* filename_disks[4] = { NULL };
 	char* filename_btldr = NULL;
-	while ((c = getopt(argc, argv, "-1:2:3:4:b:r:w:d")) != -1)
+	while ((c = getopt(argc, argv, "-1:2:3:4:b:r:w:dP:S:UC:H:L:R:TJ:M:k:K:")) != -1)
 	{
 		switch (c)
 		{
@@ -228,6 +325,20 @@ int main(int argc, char* argv[])
 					}
 				}
 				break;
+			case 'k': //packed
+			case 'K': //not packed
+				for(int i = 0; optarg[i] != 0; i++)
+				{
+					disk_num = optarg[i] - '1';
+					if(disk_num >= DISK_NUM_MIN && disk_num < DISK_COUNT)
+						disks[disk_num].format = (c == 'k' ? 1 : -1);
+					else
+					{
+						printf(usage, argv[0]);
+						exit(1);
+					}
+				}
+				break;
 			case 'w': //write-protect
 				for(int i = 0; optarg[i] != 0; i++)
 				{
@@ -247,6 +358,67 @@ int main(int argc, char* argv[])
 			case 'd': //LAP6-DIAL-MS mode
 				dial_mode = 1;
 				break;
+			case 'P': //prefetch budget
+				prefetch_budget = strtol(optarg, NULL, 0);
+				if (prefetch_budget < 0)
+				{
+					printf(usage, argv[0]);
+					exit(1);
+				}
+				break;
+			case 'S': //durability
+				storage_durability = strtol(optarg, NULL, 0);
+				if (storage_durability < 0 || storage_durability > 2)
+				{
+					printf(usage, argv[0]);
+					exit(1);
+				}
+				break;
+			case 'U': //no io_uring
+				storage_uring = 0;
+				break;
+			case 'C': //control socket
+				control_path = optarg;
+				break;
+			case 'H': //block heatmap
+				heat_path = optarg;
+				break;
+			case 'L': //access log
+				access_path = optarg;
+				break;
+			case 'J': //phase trace
+				trace_path = optarg;
+				break;
+			case 'M': //memory disk
+				disk_num = optarg[0] - '1';
+				if(disk_num < DISK_NUM_MIN || disk_num >= DISK_COUNT || (optarg[1] != 0 && optarg[1] != ','))
+				{
+					printf(usage, argv[0]);
+					exit(1);
+				}
+				disks[disk_num].in_use = 1;
+				disks[disk_num].in_memory = 1;
+				if (optarg[1] == ',' && optarg[2] != 0)
+					memdisk_save_path[disk_num] = optarg + 2;
+				break;
+			case 'T': //serial threads
+				comm_threaded = 1;
+				break;
+			case 'R': //real-time
+			{
+				char *end;
+
+				rt_priority = strtol(optarg, &end, 0);
+				if (*end == ',')
+					rt_cpu = strtol(end + 1, &end, 0);
+				if (*end != 0 || rt_priority < sched_get_priority_min(SCHED_FIFO) ||
+				    rt_priority > sched_get_priority_max(SCHED_FIFO) || rt_cpu < -1 || rt_cpu >= CPU_SETSIZE)
+				{
+					printf(usage, argv[0]);
+					exit(1);
+				}
+				break;
+			}
 			case '?':
 				printf(usage, argv[0]);
 				exit(1);
@@ -260,6 +432,7 @@ int main(int argc, char* argv[])
 	printf("PDP-8 Disk Server for OS/8, v1.6\n");
 
 	printf("Running %s mode\n", dial_mode ? "DIAL" : "OS/8");
+	trace_init();
 
 	// We must have a system disk.
 	if(!disks[0].in_use)
@@ -277,18 +450,31 @@ int main(int argc, char* argv[])
 			continue;
 
 		curr_disk = &disks[i];
-		curr_disk->fp = fopen(filename_disks[i], "r+");
-		if (curr_disk->fp == NULL)
+		if (curr_disk->in_memory)
+			curr_disk->file = memdisk_open(i, filename_disks[i]);
+		else if ((curr_disk->file = open(filename_disks[i], O_RDWR)) < 0)
 		{
 			fprintf(stderr, "On file %s ", filename_disks[i]);
 			perror("open failed");
 			exit(1);
 		}
-		printf("Using %6s disk %s with read %s and write %s\n", disk_num_strings[i], filename_disks[i],
+		if (storage_attach(curr_disk, (filename_disks[i] ? filename_disks[i] : "(blank)")) < 0)
+		{
+			fprintf(stderr, "Give -k %d if the %s disk is packed, -K %d if not\n", i + 1, disk_num_strings[i], i + 1);
+			exit(1);
+		}
+		printf("Using %6s disk %s%s%s with read %s and write %s\n", disk_num_strings[i],
+		       (filename_disks[i] ? filename_disks[i] : "(blank)"), (curr_disk->packed ? " (packed)" : ""),
+		       (curr_disk->in_memory ? " in memory" : ""),
 		       (curr_disk->read_protect ? MAKE_RED "disabled" RESET_COLOR : MAKE_GREEN "enabled" RESET_COLOR),
 		       (curr_disk->write_protect ? MAKE_RED "disabled" RESET_COLOR : MAKE_GREEN "enabled" RESET_COLOR));
 	}
 
+	storage_init();
+	prefetch_init();
+	build_boot_images();
+	control_init();
+
 	FILE* btldr = NULL;
 	if (filename_btldr)
 	{
@@ -309,8 +495,11 @@ int main(int argc, char* argv[])
 	printf("Using serial port %s at %s with %s\n", 
 		serial_dev, baud_lookup[baud].baud_str, (two_stop ? "2 stop bits" : "1 stop bit"));
 
+	bits_per_sec = baud_lookup[baud].bits_per_sec;
 	baud = baud_lookup[baud].baud_val;
 	fd = init_comm(serial_dev,baud,two_stop);
+	access_init(serial_dev, bits_per_sec);
+	rt_init();
 
 	if (btldr)
 	{
@@ -340,15 +529,37 @@ int main(int argc, char* argv[])
 // A	- process command to first side of first disk
 // B	- process command to second side of first disk
 // C-H	- process command to first/second side of second/third/fourth disk
+// a-h	- as A-H, but the data phase uses the dense (3 bytes per 2 words) encoding
+//	- any of the above with bit 0200 set moves the data a page at a time with checksums
+// I-P	- as A-H, but for a list of extents (scatter/gather, OS/8 mode only), see process_list
+// i-p	- as I-P, dense
 // Q	- stop operations and shut down the server
 //	- anything else is a (non-fatal) error
 */
 void command_loop()
 {
+	int command;
+	struct timespec wakeup_time;
+	uint64_t traced;
+
 	for (;;)
 	{			
-		receive_buf(buf, 1); //wait for command
-		switch (buf[0])
+		// Wait for a command, serving the control socket while the line is idle
+		// (and once between requests, so a busy line doesn't shut it out).
+		control_poll();
+		while (receive_timed(buf, 1, 0) == 0)
+		{
+			control_poll();
+			access_idle();
+		}
+		clock_gettime(CLOCK_MONOTONIC, &wakeup_time);
+		traced = trace_now();
+		trace_instant("wakeup");
+		rt_mark();
+		command = wakeup = buf[0];
+		if (WAKEUP_DRIVE(command))
+			command &= ~WAKEUP_CHECKSUM; //initialize_xfr looks at it
+		switch (command)
 		{
 			case '\000': ;
 				HELPBoot();
@@ -364,6 +575,14 @@ void command_loop()
 			case 'F':
 			case 'G':
 			case 'H':
+			case 'a':
+			case 'b':
+			case 'c':
+			case 'd':
+			case 'e':
+			case 'f':
+			case 'g':
+			case 'h':
 				//got signal pointing to drive and side
 				//send any char as ack
 				//get function
@@ -385,14 +604,31 @@ void command_loop()
 					perror("Serial write failure");
 					exit(1);
 				}*/
-				if (initialize_xfr())
+				receive_buf(header_buf, dial_mode ? 8 : 6); //three words in os8 mode; four in dial mode
+				trace_span("headers", traced);
+				rt_mark();
+				note_turnaround(&wakeup_time, dial_mode ? 4 : 3);
+				access_begin(&wakeup_time);
+				comm_hold(); //the reply to a header goes out in one write
+
+				uint64_t validate = trace_now();
+				int failed = initialize_xfr(0);
+				trace_span("validate", validate);
+				if (failed)
 				{
 					fprintf(stderr, MAKE_RED "Failed to initialize, sending NACK %04o\n" RESET_COLOR, acknowledgment);
 					send_word(acknowledgment);
+					comm_push(fd);
+					access_end(selected_region, start_block, total_num_words / PAGE_SIZE, direction == WRITE, acknowledgment);
+					trace_request(traced, selected_region, start_block, total_num_words / PAGE_SIZE,
+						      direction == WRITE, acknowledgment);
 				}
 				else
 				{
-					send_word(acknowledgment);		
+					int pages = total_num_words / PAGE_SIZE; //before a write pads it
+
+					send_word(acknowledgment);
+					comm_push(fd);
 
 					if(num_bytes != 0) {
 						if (direction == WRITE) //********** WRITE ************//
@@ -400,11 +636,35 @@ void command_loop()
 						else //********** READ ************//
 							process_read();
 					}
+					access_end(selected_region, start_block, pages, direction == WRITE, acknowledgment);
+					trace_request(traced, selected_region, start_block, pages, direction == WRITE, acknowledgment);
 				}
 				break;
 			case 'Q': //quit server
 				printf(MAKE_YELLOW "Received quit signal, server quitting\n" RESET_COLOR);
 				cleanup_and_exit(1); // Exit with shutdown.
+			case 'I':
+			case 'J':
+			case 'K':
+			case 'L':
+			case 'M':
+			case 'N':
+			case 'O':
+			case 'P':
+			case 'i':
+			case 'j':
+			case 'k':
+			case 'l':
+			case 'm':
+			case 'n':
+			case 'o':
+			case 'p':
+				if (!dial_mode)
+				{
+					process_list(&wakeup_time, traced);
+					break;
+				}
+				//DIAL has no lists
 			default:
 				fprintf(stderr, MAKE_RED "Received unknown command - ignored - character %04o\n" 
 					RESET_COLOR, buf[0]);
@@ -415,11 +675,29 @@ void command_loop()
 
 void cleanup_and_exit(int poweroff) {
 	// Close files and exit.
+	comm_drain();
+	storage_flush();
+	memdisk_close();
+	control_close();
+	access_close();
+	heat_report(); //needs the images
 	for(int i = DISK_NUM_MIN; i < DISK_COUNT; i++)
 	{
 		if(disks[i].in_use)
-			fclose(disks[i].fp);
+			close(disks[i].file);
+	}
+	for(int i = DISK_NUM_MIN; i < DISK_COUNT; i++)
+	{
+		if(disks[i].checked_pages)
+			printf("%s disk: %ld checked page%s, %ld retransmitted\n", disk_num_strings[i],
+			       disks[i].checked_pages, (disks[i].checked_pages == 1 ? "" : "s"), disks[i].retransmits);
 	}
+	prefetch_report();
+	store_report();
+	storage_report();
+	comm_report();
+	rt_report();
+	trace_write();
 	if(poweroff) // optional shutdown
 		system("sudo shutdown -h now");
 	exit(0);
@@ -438,7 +716,15 @@ void int_handler(int sig)
 	getchar();
 }
 
-int initialize_xfr()
+// Stopped by the system or the terminal going away: exit as a confirmed ^C does,
+// putting back the port settings (comm.c).
+void term_handler(int sig)
+{
+	signal(sig, SIG_IGN);
+	cleanup_and_exit(0); // Exit without shutdown.
+}
+
+int initialize_xfr(int extent)
 {
 	//for OS/8:
 	//get function
@@ -459,6 +745,9 @@ int initialize_xfr()
 	//send buffer address
 	//... rest remains the same
 
+	//for a list of extents (see process_list), each one is checked as a request
+	//of its own, but nothing is sent.
+
 	//XXX get starting address of buffer
 	int current_word = 0;
 	int retval = 0;
@@ -469,15 +758,27 @@ int initialize_xfr()
 	int num_pages;
 	int buffer_addr;
 	int sub_device;
+	int drive_char;
+	unsigned char* header = header_buf + extent * (dial_mode ? 8 : 6);
+
+	// Lower case wakeups select the same drive as upper case, but
+	// ask for the dense encoding during the data phase. Bit 0200
+	// asks for the data a page at a time with checksums.
+	dense_xfr = wakeup & WAKEUP_DENSE;
+	checksum_xfr = wakeup & WAKEUP_CHECKSUM;
+	drive_char = wakeup & ~(WAKEUP_DENSE | WAKEUP_CHECKSUM);
+	if (list_xfr)
+		drive_char -= 'I' - 'A';
 
 	// Determine disk number by converting to an index then dividing by 2.
-	selected_disk = (buf[0] - 'A') / 2;
+	selected_disk = (drive_char - 'A') / 2;
 	selected_disk_state = &disks[selected_disk];
 
 	// B, D, ... ascii codes are even, while A, C, ... are odd.
 	// So we can just check the least significant bit to determine side.
-	selected_side = ~buf[0] & 1;
+	selected_side = ~drive_char & 1;
 	block_offset = NUMBER_OF_BLOCKS * selected_side;
+	selected_region = selected_disk * 2 + selected_side;
 
 	// This disk must be available.
 	if(!selected_disk_state->in_use)
@@ -487,9 +788,7 @@ int initialize_xfr()
 		retval = -1;
 	}
 
-	receive_buf(buf, dial_mode ? 8 : 6); //get three words in os8 mode; four in dial mode
-
-	current_word = decode_word(buf, 0); // function word for os8, unit num for dial
+	current_word = decode_word(header, 0); // function word for os8, unit num for dial
 
 	if (current_word & 07 && !dial_mode) // doesn't apply in DIAL mode
 	{
@@ -525,8 +824,8 @@ int initialize_xfr()
 			num_pages = 040;
 		cdf_instr = 06201 | (current_word & 070);
 		field = (current_word & 070) >> 3;
-		buffer_addr = decode_word(buf, 1);
-		start_block = decode_word(buf, 2);
+		buffer_addr = decode_word(header, 1);
+		start_block = decode_word(header, 2);
 	}
 	else /* if(dial_mode) */ // DIAL arguments
 	{
@@ -538,12 +837,12 @@ int initialize_xfr()
 		// DEC didn't originally do this in their handlers, so we aren't either.
 
 		sub_device = current_word & 07;
-		current_word = decode_word(buf, 1);
+		current_word = decode_word(header, 1);
 		buffer_addr = (current_word & 017) * BLOCK_SIZE;
 		field = (current_word >> 4) & 07;
 		cdf_instr = 06201 | (field << 3);
-		start_block = decode_word(buf, 2) + sub_device * DIAL_SUB_DISK_BLK_COUNT;
-		current_word = decode_word(buf, 3);
+		start_block = decode_word(header, 2) + sub_device * DIAL_SUB_DISK_BLK_COUNT;
+		current_word = decode_word(header, 3);
 		num_pages = current_word * 2; // this is 256 word blocks instead of 128 word pages/os8 records
 
 		// If page count is greater than 40, we only need to send the last 40 pages.
@@ -565,12 +864,17 @@ int initialize_xfr()
 	printf("Block:    %04o\n", start_block);
 #endif
 
-	printf("Request to %s %d page%s %s side %d on %s disk\n", (direction == WRITE ? "write" : "read"),
-	       num_pages, (num_pages == 1 ? "" : "s"), (direction == WRITE ? "to" : "from"),
-	       selected_side, disk_num_strings[selected_disk]);
+	// A dashboard (control.c) shows the requests instead.
+	if (!control_watching())
+	{
+		printf("Request to %s %d page%s %s side %d on %s disk%s%s\n", (direction == WRITE ? "write" : "read"),
+		       num_pages, (num_pages == 1 ? "" : "s"), (direction == WRITE ? "to" : "from"),
+		       selected_side, disk_num_strings[selected_disk], (dense_xfr ? " (dense)" : ""),
+		       (checksum_xfr ? " (checked)" : ""));
 
-	printf("Buffer address %05o, starting block %05o\n", 
-		(field << 12) | buffer_addr, start_block);
+		printf("Buffer address %05o, starting block %05o\n", 
+			(field << 12) | buffer_addr, start_block);
+	}
 
 	// Writing with write protect not allowed.
 	if(direction == WRITE && selected_disk_state->write_protect)
@@ -606,12 +910,15 @@ int initialize_xfr()
 	if(dial_mode)
 		send_word(buffer_addr);
 
-	send_word(cdf_instr); //send CDF instruction
-	send_word(-(num_pages * PAGE_SIZE) & 07777); //don't update num_pages before sending word count
+	if (!list_xfr)
+	{
+		send_word(cdf_instr); //send CDF instruction
+		send_word(-(num_pages * PAGE_SIZE) & 07777); //don't update num_pages before sending word count
+	}
 
 	total_num_words = num_pages * PAGE_SIZE;
 
-	num_bytes = total_num_words * BYTES_PER_WORD; //total number of bytes to receive/transmit
+	num_bytes = wire_bytes(total_num_words); //total number of bytes to receive/transmit
 
 	if (direction == WRITE)
 		half_block = num_pages & 1; //handle half block write with zero padding
@@ -621,48 +928,164 @@ int initialize_xfr()
 	return retval;
 }
 
+void build_boot_images()
+{
+	unsigned char *p = boot_response;
+	struct stat st;
+
+	boot_response_length = 0;
+	if (fstat(disks[0].file, &st) == 0)
+		boot_image_mtime = st.st_mtim;
+	if (read_from_file(&disks[0], 0, disk_buf, BLOCK_SIZE * BYTES_PER_WORD))
+	{
+		fprintf(stderr, MAKE_RED "Warning: failed to read block 0!\n" RESET_COLOR);
+		return;
+	}
+	djg_to_pdp(disk_buf, converted_disk_buf, BLOCK_SIZE);
+	memcpy(boot_sector, converted_disk_buf, BLOCK_SIZE * BYTES_PER_WORD);
+	boot_sector[BLOCK_SIZE * BYTES_PER_WORD] = 0200; //trailer
+
+	memcpy(p, boot_stream, sizeof(boot_stream));
+	p += sizeof(boot_stream);
+	// converted_disk_buf is sent as two
+	// blocks in BOOT3 format.
+	// Prepend the field 1 stuff with
+	// address, wc, and CDF 1.
+	// Address
+	converted_disk_buf[044*2+0] = 076;
+	converted_disk_buf[044*2+1] = 047;
+	// WC
+	converted_disk_buf[045*2+0] = 076;
+	converted_disk_buf[045*2+1] = 047;
+	// Field 1
+	converted_disk_buf[046*2+0] = 062;
+	converted_disk_buf[046*2+1] = 011;
+	//BUGBUG: THIS ISN'T WORKING YET!!
+	memcpy(p, converted_disk_buf+044*BYTES_PER_WORD, 0131*BYTES_PER_WORD+6);
+	p += 0131*BYTES_PER_WORD+6;
+	// Driver content; this overwrites the end of the piece above,
+	// which has already been copied.
+	converted_disk_buf[0175*2+0] = 076; // Address
+	converted_disk_buf[0175*2+1] = 000;
+	converted_disk_buf[0176*2+0] = 076; // WC
+	converted_disk_buf[0176*2+1] = 000;
+	converted_disk_buf[0177*2+0] = 062; // Field 1
+	converted_disk_buf[0177*2+1] = 001;
+	memcpy(p, converted_disk_buf+0175*BYTES_PER_WORD, 0200*BYTES_PER_WORD+6);
+	p += 0200*BYTES_PER_WORD+6;
+	// Start OS/8
+	converted_disk_buf[0*2+0] = 076; // Address
+	converted_disk_buf[0*2+1] = 005;
+	converted_disk_buf[1*2+0] = 076; // WC
+	converted_disk_buf[1*2+1] = 005;
+	converted_disk_buf[2*2+0] = 054; // Field 1
+	converted_disk_buf[2*2+1] = 002;
+	memcpy(p, converted_disk_buf, 6);
+	p += 6;
+	boot_response_length = p - boot_response;
+}
+
+// Rebuild the boot images if the system disk has been changed behind our back.
+void refresh_boot_images()
+{
+	struct stat st;
+
+	if (fstat(disks[0].file, &st) == 0 &&
+	    (st.st_mtim.tv_sec != boot_image_mtime.tv_sec || st.st_mtim.tv_nsec != boot_image_mtime.tv_nsec))
+		build_boot_images();
+}
+
 void process_send_boot_sector()
 {
 	printf("Booting...\n");
-	if (!read_from_file(disks[0].fp, 0, disk_buf, BLOCK_SIZE * BYTES_PER_WORD))
+	refresh_boot_images();
+	if (boot_response_length == 0)
+		fprintf(stderr, MAKE_RED "Warning: failed to read block 0!\n" RESET_COLOR);
+	else if (!transmit_buf(boot_sector, sizeof(boot_sector)))
 	{
-		djg_to_pdp(disk_buf, converted_disk_buf, BLOCK_SIZE);
-		if (!transmit_buf(converted_disk_buf, BLOCK_SIZE * BYTES_PER_WORD))
-		{
-			disk_buf[0] = 0200; //trailer
-			if (!transmit_buf(disk_buf, 1))
-				printf(MAKE_GREEN "Done sending block 0\n" RESET_COLOR);
-			else
-				fprintf(stderr, MAKE_RED "Warning: failed to send trailer!\n" RESET_COLOR);
-		}
-		else
-			fprintf(stderr, MAKE_RED "Warning: failed to send block 0!\n" RESET_COLOR);
+		heat_note(0, 0, 1, 0);
+		printf(MAKE_GREEN "Done sending block 0\n" RESET_COLOR);
 	}
 	else
-		fprintf(stderr, MAKE_RED "Warning: failed to read block 0!\n" RESET_COLOR);
+		fprintf(stderr, MAKE_RED "Warning: failed to send block 0!\n" RESET_COLOR);
 }
 
-void process_read()
+// Convert words of a read from the disk format for the line (cached ones are, unless dense).
+void convert_read(int first, int words, int cached)
 {
-	acknowledgment = ACK_DONE;
-	read_from_file(selected_disk_state->fp, (start_block + block_offset) * BLOCK_SIZE * BYTES_PER_WORD,
-		       disk_buf, num_bytes);
-	djg_to_pdp(disk_buf, converted_disk_buf, total_num_words);
-	transmit_buf(converted_disk_buf, num_bytes);
+	if (dense_xfr)
+		djg_to_dense(disk_buf + first * BYTES_PER_WORD, converted_disk_buf + wire_bytes(first), words);
+	else if (!cached)
+		djg_to_pdp(disk_buf + first * BYTES_PER_WORD, converted_disk_buf + wire_bytes(first), words);
+}
 
-	int c = 0;
-	if ((c = ser_read(fd, (char *) buf, sizeof(buf))) < 0)
+// Fetch the pages of a read and, unless it is checked, send them. Returns whether they were cached.
+int send_read()
+{
+	struct timespec phase;
+	uint64_t traced = trace_now();
+
+	clock_gettime(CLOCK_MONOTONIC, &phase);
+	int cached = prefetch_read(selected_region, start_block, total_num_words, dense_xfr, disk_buf, converted_disk_buf);
+	int request = -1;
+	if (!cached)
+		request = image_read_start(selected_disk_state, (start_block + block_offset) * BLOCK_SIZE * BYTES_PER_WORD,
+					   disk_buf, total_num_words * BYTES_PER_WORD);
+	prefetch_start(selected_region, start_block, (total_num_words + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	if (!cached)
+		storage_read_finish(request);
+	if (cached)
+		access_rec.flags |= ACCESS_CACHED;
+	access_phase(&access_rec.disk_us, &phase);
+	trace_span((cached ? "storage (cached)" : "storage"), traced);
+	if (checksum_xfr)
+		return cached;
+
+	// With the transmit thread each page goes out as soon as it is
+	// converted, while the next one is converted.
+	int chunk = (comm_threaded ? PAGE_SIZE : total_num_words);
+
+	clock_gettime(CLOCK_MONOTONIC, &phase);
+	for (int word = 0; word < total_num_words; word += chunk)
 	{
-		perror("Serial read failure");
-		exit(1);
+		traced = trace_now();
+		convert_read(word, chunk, cached);
+		trace_span("convert", traced);
+		transmit_buf(converted_disk_buf + wire_bytes(word), wire_bytes(chunk));
 	}
-	else if (c != 0)
+	access_phase(&access_rec.data_us, &phase);
+	return cached;
+}
+
+void process_read()
+{
+	struct timespec phase;
+	uint64_t traced;
+
+	acknowledgment = ACK_DONE;
+	int cached = send_read();
+
+	clock_gettime(CLOCK_MONOTONIC, &phase);
+	if (checksum_xfr)
 	{
-		fprintf(stderr, MAKE_RED "Warning: detected bytes during read!\n" RESET_COLOR);
-		acknowledgment = NACK | 8;
+		traced = trace_now();
+		convert_read(0, total_num_words, cached);
+		trace_span("convert", traced);
+		if (checked_read())
+			acknowledgment = NACK | 8;
 	}
+	else
+		check_stray("Warning: detected bytes during read!");
+	access_phase(&access_rec.data_us, &phase);
 
+	// The PDP-8 is busy with the data for a while, so finish the read ahead now.
+	traced = trace_now();
+	prefetch_after_read();
+	trace_span("read ahead", traced);
+
+	traced = trace_now();
 	send_word(acknowledgment);
+	trace_span("ack", traced);
 #ifdef REALLY_DEBUG
 	if (!(acknowledgment & NACK))
 		printf("Sent done acknowledgment\n");
@@ -670,18 +1093,108 @@ void process_read()
 		printf("Received words during read, sent NACK\n");
 #endif
 	if (!(acknowledgment & NACK))
-		printf(MAKE_GREEN "Successfully completed read\n" RESET_COLOR);
+	{
+		control_note(selected_region, start_block, (total_num_words + BLOCK_SIZE - 1) / BLOCK_SIZE, 0);
+		heat_note(selected_region, start_block, (total_num_words + BLOCK_SIZE - 1) / BLOCK_SIZE, 0);
+		if (!control_watching())
+			printf(MAKE_GREEN "Successfully completed read\n" RESET_COLOR);
+	}
 	else
 		fprintf(stderr, MAKE_RED "Warning: failed to complete read!\n" RESET_COLOR);
+	if (checksum_xfr && xfr_retransmits && !control_watching())
+		printf(MAKE_YELLOW "%d page%s retransmitted\n" RESET_COLOR, xfr_retransmits, (xfr_retransmits == 1 ? "" : "s"));
 }
 
 void process_write()
 {
+	sigset_t quit, old_mask;
+	struct timespec phase;
+	uint64_t traced = trace_now();
+
+	clock_gettime(CLOCK_MONOTONIC, &phase);
 	acknowledgment = ACK_DONE;
 
-	receive_buf(disk_buf, num_bytes); //get data to write
+	if (checksum_xfr)
+	{
+		if (checked_write()) //also converts the data
+			acknowledgment = NACK | 8;
+		trace_span("receive data", traced);
+	}
+	else
+	{
+		receive_buf(disk_buf, num_bytes); //get data to write
+		trace_span("receive data", traced);
+		check_stray("Warning: detected bytes after write!");
+	}
+	access_phase(&access_rec.data_us, &phase);
+
+	// The PDP-8 takes the data as written once it has the acknowledgment,
+	// so a ^C must not stop the server before the write is under way.
+	sigemptyset(&quit);
+	sigaddset(&quit, SIGINT);
+	sigprocmask(SIG_BLOCK, &quit, &old_mask);
+	traced = trace_now();
+	send_word(acknowledgment);
+	trace_span("ack", traced);
+#ifdef REALLY_DEBUG
+	if (!(acknowledgment & NACK))
+		printf("Sent done acknowledgment\n");
+	else
+		printf("Received too many words, sent NACK\n");
+#endif
+	if (!(acknowledgment & NACK))
+		commit_write(disk_buf);
+	else
+		fprintf(stderr, MAKE_RED "Warning: failed to complete write!\n" RESET_COLOR);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	if (checksum_xfr && xfr_retransmits && !control_watching())
+		printf(MAKE_YELLOW "%d page%s retransmitted\n" RESET_COLOR, xfr_retransmits, (xfr_retransmits == 1 ? "" : "s"));
+}
+
+// Store a write that has been acknowledged, converting it from the line's encoding in wire (unless it is checked).
+void commit_write(unsigned char *wire)
+{
+	struct timespec phase;
+	uint64_t traced;
+
+	clock_gettime(CLOCK_MONOTONIC, &phase);
+	traced = trace_now();
+	if (checksum_xfr)
+		; //already converted page by page
+	else if (dense_xfr)
+		dense_to_djg(wire, converted_disk_buf, total_num_words);
+	else
+		pdp_to_djg(wire, converted_disk_buf, total_num_words);
+	trace_span("convert", traced);
+	if (half_block)
+	{
+		// Pad the last block with a zero half block.
+		memset(converted_disk_buf + total_num_words * BYTES_PER_WORD, 0, PAGE_SIZE * BYTES_PER_WORD);
+		total_num_words += PAGE_SIZE;
+	}
+	traced = trace_now();
+	int written = write_changed(selected_region, start_block, converted_disk_buf, total_num_words / BLOCK_SIZE);
+	trace_span("storage", traced);
+	control_note(selected_region, start_block, total_num_words / BLOCK_SIZE, 1);
+	heat_note(selected_region, start_block, total_num_words / BLOCK_SIZE, 1);
+	access_phase(&access_rec.disk_us, &phase);
+	if (selected_disk_state == &disks[0] && start_block + block_offset == 0)
+		build_boot_images();
+	if (control_watching())
+		;
+	else if (written < total_num_words / BLOCK_SIZE)
+		printf(MAKE_GREEN "Successfully completed write (%d of %d blocks unchanged)\n" RESET_COLOR,
+		       total_num_words / BLOCK_SIZE - written, total_num_words / BLOCK_SIZE);
+	else
+		printf(MAKE_GREEN "Successfully completed write\n" RESET_COLOR);
+}
 
+// After the data, anything more from the PDP-8 means the transfer went wrong.
+void check_stray(const char *warning)
+{
+	uint64_t traced = trace_now();
 	int c;
+
 	if ((c = ser_read(fd, (char *) buf, sizeof(buf))) < 0)
 	{
 		perror("Serial read failure");
@@ -689,149 +1202,298 @@ void process_write()
 	}
 	else if (c != 0)
 	{
-		fprintf(stderr, MAKE_RED "Warning: detected bytes after write!\n" RESET_COLOR);
+		fprintf(stderr, MAKE_RED "%s\n" RESET_COLOR, warning);
 		acknowledgment = NACK | 8;
 	}
+	trace_span("check", traced);
+}
 
-	if (half_block)
+/*
+ * A list of extents (scatter/gather) pays for one handshake instead of one
+ * per extent. The wakeup, I-P for drives A-H (i-p for dense), is followed
+ * by the number of extents, then each extent's header as for a single
+ * request: function, buffer address and starting block. The extents must
+ * all read or all write, at most MAX_LIST_PAGES pages in all. Nothing is
+ * sent for each one: the answer is a single acknowledgment for the whole
+ * list, then the data of all the extents in one stream, in the order of the
+ * list (the PDP-8 knows where each goes), then a single status.
+ */
+struct list_extent
+{
+	struct disk_state *disk;
+	int region, offset, block, words, bytes, half;
+};
+
+static void list_select(struct list_extent *x)
+{
+	selected_disk_state = x->disk;
+	selected_region = x->region;
+	block_offset = x->offset;
+	start_block = x->block;
+	total_num_words = x->words;
+	num_bytes = x->bytes;
+	half_block = x->half;
+}
+
+static void list_end(struct list_extent *x, uint64_t traced, int write)
+{
+	access_end(x->region, x->block, x->words / PAGE_SIZE, write, acknowledgment);
+	trace_request(traced, x->region, x->block, x->words / PAGE_SIZE, write, acknowledgment);
+}
+
+void process_list(struct timespec *wakeup_time, uint64_t traced)
+{
+	static unsigned char list_buf[MAX_LIST_PAGES * PAGE_SIZE * BYTES_PER_WORD];
+	struct list_extent extents[MAX_EXTENTS];
+	int count, pages = 0, bytes = 0, write = 0, failed = 0;
+	sigset_t quit, old_mask;
+	struct timespec phase;
+
+	receive_buf(buf, 2);
+	count = decode_word(buf, 0);
+	for (int e = 0; e < count; e++) //one too long is read to its end to stay in step
+		receive_buf(header_buf + (e < MAX_EXTENTS ? e : 0) * 6, 6);
+	trace_span("headers", traced);
+	rt_mark();
+	note_turnaround(wakeup_time, 1 + count * 3);
+	access_begin(wakeup_time);
+	if (!control_watching())
+		printf("List of %d extent%s\n", count, (count == 1 ? "" : "s"));
+
+	uint64_t validate = trace_now();
+	if (count == 0 || count > MAX_EXTENTS)
 	{
-		for (int j = num_bytes; j < PAGE_SIZE * BYTES_PER_WORD; j++)
-			disk_buf[j] = 0;
-		total_num_words += PAGE_SIZE;
+		fprintf(stderr, MAKE_RED "Warning: a list of %d extents!\n" RESET_COLOR, count);
+		acknowledgment = NACK | 8;
+		failed = 1;
+	}
+	list_xfr = 1;
+	for (int e = 0; e < count && !failed; e++)
+	{
+		if (initialize_xfr(e))
+			failed = 1;
+		else if (e > 0 && direction != write)
+		{
+			fprintf(stderr, MAKE_RED "Warning: a list mixes reads and writes!\n" RESET_COLOR);
+			acknowledgment = NACK | 8;
+			failed = 1;
+		}
+		else if ((pages += total_num_words / PAGE_SIZE) > MAX_LIST_PAGES)
+		{
+			fprintf(stderr, MAKE_RED "Warning: more than %d pages in a list!\n" RESET_COLOR, MAX_LIST_PAGES);
+			acknowledgment = NACK | 8;
+			failed = 1;
+		}
+		write = direction;
+		extents[e] = (struct list_extent) { selected_disk_state, selected_region, block_offset, start_block,
+						    total_num_words, num_bytes, half_block };
+		bytes += num_bytes;
 	}
+	list_xfr = 0;
+	trace_span("validate", validate);
+	if (failed)
+	{
+		fprintf(stderr, MAKE_RED "Failed to initialize, sending NACK %04o\n" RESET_COLOR, acknowledgment);
+		send_word(acknowledgment);
+		if (count != 0 && count <= MAX_EXTENTS)
+			access_end(selected_region, start_block, total_num_words / PAGE_SIZE, direction == WRITE, acknowledgment);
+		return;
+	}
+	send_word(write == WRITE ? ACK_WRITE : ACK_READ);
+	acknowledgment = ACK_DONE;
 
-	send_word(acknowledgment);
-#ifdef REALLY_DEBUG
-	if (!(acknowledgment & NACK))
-		printf("Sent done acknowledgment\n");
-	else
-		printf("Received too many words, sent NACK\n");
-#endif
-	if (!(acknowledgment & NACK))
+	if (write == READ)
 	{
-		pdp_to_djg(disk_buf, converted_disk_buf, total_num_words);
-		write_to_file(selected_disk_state->fp, (start_block + block_offset) * BLOCK_SIZE * BYTES_PER_WORD,
-			      converted_disk_buf, total_num_words * BYTES_PER_WORD);
-		printf(MAKE_GREEN "Successfully completed write\n" RESET_COLOR);
+		for (int e = 0; e < count; e++)
+		{
+			uint64_t extent_traced = (e ? trace_now() : traced);
+
+			list_select(&extents[e]);
+			send_read();
+			if (e == count - 1)
+			{
+				clock_gettime(CLOCK_MONOTONIC, &phase);
+				check_stray("Warning: detected bytes during read!");
+				access_phase(&access_rec.data_us, &phase);
+			}
+			// The PDP-8 is busy with the data for a while, so finish the read ahead now.
+			uint64_t ahead = trace_now();
+			prefetch_after_read();
+			trace_span("read ahead", ahead);
+			if (e == count - 1)
+				send_word(acknowledgment);
+			list_end(&extents[e], extent_traced, 0);
+		}
+		for (int e = 0; e < count && !(acknowledgment & NACK); e++)
+		{
+			int blocks = (extents[e].words + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+			control_note(extents[e].region, extents[e].block, blocks, 0);
+			heat_note(extents[e].region, extents[e].block, blocks, 0);
+		}
 	}
 	else
-		fprintf(stderr, MAKE_RED "Warning: failed to complete write!\n" RESET_COLOR);
+	{
+		// The data of all the extents comes in one piece, then the status goes out.
+		uint64_t data = trace_now();
+
+		clock_gettime(CLOCK_MONOTONIC, &phase);
+		receive_buf(list_buf, bytes);
+		trace_span("receive data", data);
+		check_stray("Warning: detected bytes after write!");
+		access_phase(&access_rec.data_us, &phase);
+
+		// As in process_write, a ^C must not stop the server before the writes are under way.
+		sigemptyset(&quit);
+		sigaddset(&quit, SIGINT);
+		sigprocmask(SIG_BLOCK, &quit, &old_mask);
+		send_word(acknowledgment);
+		for (int e = 0, offset = 0; e < count; offset += extents[e++].bytes)
+		{
+			uint64_t extent_traced = (e ? trace_now() : traced);
+
+			list_select(&extents[e]);
+			if (!(acknowledgment & NACK))
+				commit_write(list_buf + offset);
+			list_end(&extents[e], extent_traced, 1);
+		}
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	}
+	if (acknowledgment & NACK)
+		fprintf(stderr, MAKE_RED "Warning: failed to complete the list!\n" RESET_COLOR);
+	else if (!control_watching())
+		printf(MAKE_GREEN "Successfully completed the list, %d page%s\n" RESET_COLOR, pages, (pages == 1 ? "" : "s"));
 }
 
-void HELPBoot()
+/*
+ * Checked transfers move the data a page at a time. Each read or write status
+ * is followed by the number of the page within the buffer, then that page's
+ * data. After the page the PDP-8 sends the 12-bit sum of the words it received
+ * or sent. If the sum is wrong (or never arrives) the same page is asked for
+ * again, so a line error costs one page rather than the whole request.
+ */
+
+int checked_read()
 {
-	// If BOOT1 is toggled in and started,
-	// BOOT2 is sent in HELP loader format.
-	int boot2[] = {
-		//		00000, // Must be 0, not sent
-		00000, // Must have 01000 clear
-		00000, 05032,
-		07032, 07012, 01003, 03036,
-		04020, 03002, 04020, 03013,
-		05010, 00000, 00000, 00000,
-		00000, 04032, 07006, 07006,
-		07006, 03000, 04032, 01000,
-		03030,
-		05004-1, // Decrement because of ISZ
-		00000,   // Send NUL to get to JMP
-	};
-	// BOOT3 is then sent in BOOT2 loader format, followed
-	// by the important parts of block 0 in BOOT3 format.
-	int boot3[] = {
-		05420, 00000, 03402,	// Actually the required patch
-		00041, 04020,		// BOOT3 proper
-		00042, 03002,
-		00043, 04020,
-		00044, 03001,
-		00045, 04020,
-		00046, 03047,
-		00047, 00000,
-		00050, 04020,
-		00051, 03402,
-		00052, 02002,
-		00053, 07000,
-		00054, 02001,
-		00055, 05050,
-		00056, 05041,
-		00014, 05041,		// Kludge to start BOOT3
-	};
+	int num_pages = total_num_words / PAGE_SIZE;
+	int page_bytes = wire_bytes(PAGE_SIZE);
+	int tries = 0;
 
-	// This cooperates with a bootloader based on
-	// the HELP loarder.
-	printf("Booting...\n");
-	if (boot2[0] & 04) {
-		fprintf(stderr, MAKE_RED "Illegal initial word\n" RESET_COLOR);
-		return;
+	xfr_retransmits = 0;
+	for (int page = 0; page < num_pages; )
+	{
+		comm_hold();
+		if (page != 0 || tries != 0)
+			send_word(ACK_READ); //the first one went out with the request
+		send_word(page);
+		transmit_buf(converted_disk_buf + page * page_bytes, page_bytes);
+		comm_push(fd);
+		if (receive_checksum(page_bytes) == page_checksum(disk_buf + page * PAGE_SIZE * BYTES_PER_WORD))
+		{
+			selected_disk_state->checked_pages++;
+			page++;
+			tries = 0;
+		}
+		else if (retransmit(page, ++tries))
+			return 1;
 	}
-	for (int i = 0; i < sizeof(boot2)/sizeof(*boot2); i++) {
-		unsigned int intval;
-		unsigned char byteval;
-		int link;
+	return 0;
+}
+
+int checked_write()
+{
+	int num_pages = total_num_words / PAGE_SIZE;
+	int page_bytes = wire_bytes(PAGE_SIZE);
+	int tries = 0;
+	int sum;
 
-		if (boot2[i] & 0740) {
-			fprintf(stderr, MAKE_RED "Illegal bit set in %04o at %04o\n" RESET_COLOR,
-				boot2[i], i);
-			return;
+	xfr_retransmits = 0;
+	for (int page = 0; page < num_pages; )
+	{
+		char* page_buf = disk_buf + page * page_bytes;
+		char* converted_page_buf = converted_disk_buf + page * PAGE_SIZE * BYTES_PER_WORD;
+
+		comm_hold();
+		if (page != 0 || tries != 0)
+			send_word(ACK_WRITE); //the first one went out with the request
+		send_word(page);
+		comm_push(fd);
+		sum = -1;
+		if (receive_timed(page_buf, page_bytes, wire_ms(page_bytes + 4) + CHECK_SLACK_MS) == page_bytes &&
+		    receive_timed(buf, 2, wire_ms(2) + CHECK_SLACK_MS) == 2)
+		{
+			sum = decode_word(buf, 0);
+			if (dense_xfr)
+				dense_to_djg(page_buf, converted_page_buf, PAGE_SIZE);
+			else
+				pdp_to_djg(page_buf, converted_page_buf, PAGE_SIZE);
 		}
-		link = 0;
-		if (i+1 < sizeof(boot2)/sizeof(*boot2))
-			link = boot2[i+1] & 01000;
-		intval = (link<<3) | boot2[i];
-		byteval = (intval<<3) | (intval >> 10);
-		//		fprintf(stderr, "%03o %05o\n", byteval, intval);
-		if (transmit_buf(&byteval, 1))
-			fprintf(stderr, MAKE_RED "Error: failed to send byte!\n" RESET_COLOR);
-	}
-	for (int i = 0; i < sizeof(boot3)/sizeof(*boot3); i++) {
-		//		fprintf(stderr, "%03o\n%03o\n", boot3[i]>>6, boot3[i]&077);
-		disk_buf[0] = boot3[i] >> 6;
-		disk_buf[1] = boot3[i] & 077;
-		if (transmit_buf(disk_buf, 2))
-			fprintf(stderr, MAKE_RED "Warning: failed to send word!\n" RESET_COLOR);
-	}
-	if (!read_from_file(disks[0].fp, 0, disk_buf, BLOCK_SIZE * BYTES_PER_WORD))
-	{
-		djg_to_pdp(disk_buf, converted_disk_buf, BLOCK_SIZE);
-		// converted_disk_buf is sent as two
-		// blocks in BOOT3 format.
-		// Prepend the field 1 stuff with
-		// address, wc, and CDF 1.
-		// Address
-		converted_disk_buf[044*2+0] = 076;
-		converted_disk_buf[044*2+1] = 047;
-		// WC
-		converted_disk_buf[045*2+0] = 076;
-		converted_disk_buf[045*2+1] = 047;
-		// Field 1
-		converted_disk_buf[046*2+0] = 062;
-		converted_disk_buf[046*2+1] = 011;
-		//BUGBUG: THIS ISN'T WORKING YET!!
-		if (!transmit_buf(converted_disk_buf+044*BYTES_PER_WORD, 0131*BYTES_PER_WORD+6))
+		if (sum == page_checksum(converted_page_buf))
 		{
-			converted_disk_buf[0175*2+0] = 076; // Address
-			converted_disk_buf[0175*2+1] = 000;
-			converted_disk_buf[0176*2+0] = 076; // WC
-			converted_disk_buf[0176*2+1] = 000;
-			converted_disk_buf[0177*2+0] = 062; // Field 1
-			converted_disk_buf[0177*2+1] = 001;
-			if (!transmit_buf(converted_disk_buf+0175*BYTES_PER_WORD, 0200*BYTES_PER_WORD+6))
-			{
-				converted_disk_buf[0*2+0] = 076; // Address
-				converted_disk_buf[0*2+1] = 005;
-				converted_disk_buf[1*2+0] = 076; // WC
-				converted_disk_buf[1*2+1] = 005;
-				converted_disk_buf[2*2+0] = 054; // Field 1
-				converted_disk_buf[2*2+1] = 002;
-				if (!transmit_buf(converted_disk_buf, 6))
-					printf(MAKE_GREEN "Done sending OS/8 bootstrap\n" RESET_COLOR);
-				else
-					fprintf(stderr, MAKE_RED "Warning: failed to start OS/8!\n" RESET_COLOR);
-			} else
-				fprintf(stderr, MAKE_RED "Warning: failed to send driver content!\n" RESET_COLOR);
-		} else
-			fprintf(stderr, MAKE_RED "Warning: failed to send block 0!\n" RESET_COLOR);
-	} else
+			selected_disk_state->checked_pages++;
+			page++;
+			tries = 0;
+		}
+		else if (retransmit(page, ++tries))
+			return 1;
+	}
+	return 0;
+}
+
+// Get the PDP-8's sum for a page we sent, or -1 if it didn't come.
+int receive_checksum(int page_bytes)
+{
+	int got = receive_timed(buf, 2, wire_ms(page_bytes + 2) + CHECK_SLACK_MS);
+
+	// If a character was lost the PDP-8 is still waiting for the end of the
+	// page. Feed it filler until it answers; the sum will then be wrong.
+	for (int pad = 0; got == 0 && pad < page_bytes; pad++)
+	{
+		unsigned char filler = 0;
+		transmit_buf(&filler, 1);
+		got = receive_timed(buf, 2, wire_ms(1) + PAD_SLACK_MS);
+	}
+	if (got == 1)
+		got += receive_timed(buf + 1, 1, wire_ms(1) + CHECK_SLACK_MS);
+	if (got != 2)
+		return -1;
+	return decode_word(buf, 0);
+}
+
+// Account for a bad page. Returns 1 if it's time to give up on the request.
+int retransmit(int page, int tries)
+{
+	fprintf(stderr, MAKE_YELLOW "Warning: bad checksum on page %o, %s\n" RESET_COLOR, page,
+		(tries > MAX_RETRANSMITS ? "giving up" : "sending it again"));
+	drain_input();
+	if (tries > MAX_RETRANSMITS)
+		return 1;
+	selected_disk_state->retransmits++;
+	xfr_retransmits++;
+	return 0;
+}
+
+// 12-bit sum of a page in the disk file format.
+int page_checksum(char* buf)
+{
+	int sum = 0;
+	for (int i = 0; i < PAGE_SIZE * BYTES_PER_WORD; i += 2)
+		sum += ((buf[i + 1] & 017) << 8) | (buf[i] & 0377);
+	return sum & 07777;
+}
+
+void HELPBoot()
+{
+	// This cooperates with a bootloader based on
+	// the HELP loarder. The whole response is sent in one write.
+	printf("Booting...\n");
+	refresh_boot_images();
+	if (boot_response_length == 0)
 		fprintf(stderr, MAKE_RED "Warning: failed to read block 0!\n" RESET_COLOR);
+	else if (!transmit_buf(boot_response, boot_response_length))
+		printf(MAKE_GREEN "Done sending OS/8 bootstrap\n" RESET_COLOR);
+	else
+		fprintf(stderr, MAKE_RED "Warning: failed to send OS/8 bootstrap!\n" RESET_COLOR);
 }
 
 int decode_word(char* buf, int pos)
@@ -854,6 +1516,46 @@ void djg_to_pdp(char* buf_in, char* buf_out, int word_count)
 	}
 }
 
+/*
+ * Packed ("Mac") images: ABCD EFGH = aaabbbcc cdddeeef ffggghhh
+ * word_count is even.
+ */
+void mac_to_djg(char* buf_in, char* buf_out, int word_count)
+{
+	unsigned char *in = (unsigned char *) buf_in, *out = (unsigned char *) buf_out;
+	for (int i = 0; i < word_count / 2; i++, in += 3, out += 4)
+	{
+		out[0] = (in[0] << 4) | (in[1] >> 4); //bbcccddd
+		out[1] = in[0] >> 4; //0000aaab
+		out[2] = in[2];
+		out[3] = in[1] & 017;
+	}
+}
+
+void djg_to_mac(char* buf_in, char* buf_out, int word_count)
+{
+	unsigned char *in = (unsigned char *) buf_in, *out = (unsigned char *) buf_out;
+	for (int i = 0; i < word_count / 2; i++, in += 4, out += 3)
+	{
+		out[0] = (in[1] << 4) | (in[0] >> 4);
+		out[1] = (in[0] << 4) | (in[3] & 017);
+		out[2] = in[2];
+	}
+}
+
+// Straight from a packed image to the six bit encoding sent to the PDP-8.
+void mac_to_pdp(char* buf_in, char* buf_out, int word_count)
+{
+	unsigned char *in = (unsigned char *) buf_in, *out = (unsigned char *) buf_out;
+	for (int i = 0; i < word_count / 2; i++, in += 3, out += 4)
+	{
+		out[0] = in[0] >> 2; //00aaabbb
+		out[1] = ((in[0] << 4) | (in[1] >> 4)) & 077; //00cccddd
+		out[2] = ((in[1] << 2) | (in[2] >> 6)) & 077;
+		out[3] = in[2] & 077;
+	}
+}
+
 void pdp_to_djg(char* buf_in, char* buf_out, int word_count)
 {
 	for (int i = 0; i < word_count * 2; i += 2)
@@ -863,6 +1565,62 @@ void pdp_to_djg(char* buf_in, char* buf_out, int word_count)
 	}
 }
 
+/*
+ * Dense transfers carry two words in three bytes, high order first:
+ * Sent to/from PDP: abcd efgh -> aaabbbcc cdddeeef ffggghhh
+ * This is the same packing as the "Mac" image format.
+ */
+
+void djg_to_dense(char* buf_in, char* buf_out, int word_count)
+{
+	for (int i = 0, o = 0; i < word_count * 2; i += 4, o += 3)
+	{
+		int first = ((buf_in[i + 1] & 017) << 8) | (buf_in[i] & 0377);
+		int second = ((buf_in[i + 3] & 017) << 8) | (buf_in[i + 2] & 0377);
+		buf_out[o] = first >> 4; //make aaabbbcc
+		buf_out[o + 1] = ((first & 017) << 4) | (second >> 8); //make cdddeeef
+		buf_out[o + 2] = second & 0377; //make ffggghhh
+	}
+}
+
+void dense_to_djg(char* buf_in, char* buf_out, int word_count)
+{
+	for (int i = 0, o = 0; o < word_count * 2; i += 3, o += 4)
+	{
+		int first = ((buf_in[i] & 0377) << 4) | ((buf_in[i + 1] >> 4) & 017);
+		int second = ((buf_in[i + 1] & 017) << 8) | (buf_in[i + 2] & 0377);
+		buf_out[o] = first & 0377; //make bbcccddd
+		buf_out[o + 1] = first >> 8; //make 0000aaab
+		buf_out[o + 2] = second & 0377;
+		buf_out[o + 3] = second >> 8;
+	}
+}
+
+// Number of bytes on the wire for the data phase of the current transfer.
+int wire_bytes(int word_count)
+{
+	if (dense_xfr)
+		return (word_count / 2) * 3;
+	return word_count * BYTES_PER_WORD;
+}
+
+// The request headers are in; note how long they took beyond the line time.
+void note_turnaround(struct timespec *wakeup_time, int header_words)
+{
+	struct timespec now;
+	long bytes = header_words * BYTES_PER_WORD;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	comm_turnaround((now.tv_sec - wakeup_time->tv_sec) * 1000000 + (now.tv_nsec - wakeup_time->tv_nsec) / 1000,
+			bytes * 10 * 1000000 / bits_per_sec);
+}
+
+// Time in milliseconds to move some bytes over the line (11 bits each, to be safe).
+int wire_ms(int bytes)
+{
+	return bytes * 11 * 1000 / bits_per_sec + 1;
+}
+
 void send_word(int word)
 {
 	int c;
@@ -912,41 +1670,40 @@ void receive_buf(char* buf, int length)
 	}
 }
 
-int read_from_file(FILE* file, int offset, char* buf, int length)
+// Like receive_buf, but gives up after a while. Returns the number of bytes read.
+int receive_timed(char* buf, int length, int ms)
 {
+	struct timespec start, now;
 	int c;
-	fseek(file, offset, SEEK_SET);
-	if ((c = fread(buf, 1, length, file)) < 0)
-	{
-		perror("File read failure");
-		exit(1);
-	}
-	else if (c != length)
+	int offset = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (offset < length)
 	{
-		//fprintf(stderr, MAKE_RED "Warning: failed to complete read! Reached EOF?\n" RESET_COLOR);
-		return 1;
+		if ((c = ser_read(fd, (char *) buf + offset, length - offset)) < 0)
+		{
+			perror("Serial read failure");
+			exit(1);
+		}
+		offset += c;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= ms)
+			break;
 	}
-	else
-		return 0;
+	return offset;
 }
 
-int write_to_file(FILE* file, int offset, char* buf, int length)
+// Throw away input until the line goes quiet.
+void drain_input()
 {
 	int c;
-	fseek(file, offset, SEEK_SET);
-	if ((c = fwrite(buf, 1, length, file)) < 0)
-	{
-		perror("File write failure");
-		exit(1);
-	}
-	else if (c != length)
-	{
-		//fprintf(stderr, MAKE_RED "Warning: failed to complete write!\n" RESET_COLOR);
-		return 1;
-	}
-	else
+	do
 	{
-		fflush(file);
-		return 0;
-	}
+		if ((c = ser_read(fd, (char *) buf, sizeof(buf))) < 0)
+		{
+			perror("Serial read failure");
+			exit(1);
+		}
+	} while (c != 0);
 }
+
@@ -0,0 +1,569 @@
+/*
+	storage.c: disk image reads and writes
+
+	There are two engines. The io_uring one is used when the kernel has
+	it: a read for the current request and the read-ahead for the file
+	it starts are submitted together, and writes are copied aside and
+	completed in the background while the server goes on talking to the
+	PDP-8. The buffers reads and writes go through are registered with
+	the kernel, so it doesn't have to map them for every request. The
+	plain engine does the same with pread and pwrite, one call at a time,
+	and is used when io_uring isn't there (or with -U).
+
+	Durability (-S):
+	0	leave the data to the host's page cache, as fflush used to
+	1	follow each write with an fdatasync, still in the background
+	2	fdatasync each write before the PDP-8 is told it is done
+
+	A read waits for any pending write it overlaps, and a write waits
+	for any pending write it overlaps, so requests are seen in order.
+
+	OS/8 rewrites blocks it hasn't changed all the time (directory
+	segments on every ENTER and CLOSE, whole files from PIP), and every
+	write wears an SD card. write_changed compares each block with what
+	the image holds, from the read-ahead cache if it is there, and writes
+	only the runs of blocks that differ.
+
+	Images may also be packed, three bytes to two words as the "Mac"
+	images that rk05_converter handles are. read_from_file, write_to_file
+	and image_read_start take offsets in the usual two bytes per word
+	layout and translate; storage_read_start is the raw file.
+*/
+
+#define STORAGE_ENTRIES 16 //submission queue size
+#define STORAGE_READS 4 //reads that may be in flight
+#define STORAGE_WRITE_SLOTS 4 //writes that may be in flight
+#define STORAGE_SLOT_BYTES sizeof(disk_buf)
+
+#define PACKED_BYTES(djg_bytes) ((djg_bytes) / 4 * 3)
+
+#define STORAGE_WRITE_TAG 0100
+#define STORAGE_SYNC_TAG 0200
+
+int storage_uring = 1; //try io_uring
+int storage_durability = 0;
+
+struct storage_read
+{
+	int busy;
+	int done;
+	int file;
+	long offset;
+	unsigned char *buf;
+	int length;
+	int result; //bytes read or -errno
+	unsigned char *unpack; //for packed reads, where the words go
+};
+
+struct storage_slot
+{
+	int busy;
+	int pending; //completions still to come
+	int file;
+	long offset;
+	int length;
+};
+
+struct storage_read storage_reads[STORAGE_READS];
+struct storage_slot storage_slots[STORAGE_WRITE_SLOTS];
+unsigned char storage_slot_data[STORAGE_WRITE_SLOTS][STORAGE_SLOT_BYTES];
+unsigned char storage_packed_buf[PACKED_BYTES(sizeof(disk_buf))];
+long storage_writes, storage_write_waits, storage_syncs;
+unsigned char storage_compare_buf[sizeof(disk_buf)];
+long storage_blocks[DISK_COUNT * 2], storage_elided[DISK_COUNT * 2]; //blocks the PDP-8 wrote, and those unchanged
+
+// The rings shared with the kernel.
+struct
+{
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	int to_submit;
+} uring = { -1 };
+
+// Buffers registered for READ_FIXED and WRITE_FIXED.
+struct iovec storage_fixed[4];
+int storage_fixed_count;
+
+static int storage_fixed_index(void *buf, int length)
+{
+	for (int i = 0; i < storage_fixed_count; i++)
+	{
+		unsigned char *base = storage_fixed[i].iov_base;
+		if ((unsigned char *) buf >= base && (unsigned char *) buf + length <= base + storage_fixed[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+static int storage_setup_uring()
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	if ((uring.fd = syscall(__NR_io_uring_setup, STORAGE_ENTRIES, &p)) < 0)
+		return -1;
+	sq = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+	uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED)
+	{
+		close(uring.fd);
+		return -1;
+	}
+	uring.sq_head = (unsigned *) (sq + p.sq_off.head);
+	uring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	uring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	uring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	uring.cq_head = (unsigned *) (cq + p.cq_off.head);
+	uring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	uring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	storage_fixed[0].iov_base = disk_buf;
+	storage_fixed[0].iov_len = sizeof(disk_buf);
+	storage_fixed[1].iov_base = storage_slot_data;
+	storage_fixed[1].iov_len = sizeof(storage_slot_data);
+	storage_fixed[2].iov_base = prefetch_ahead;
+	storage_fixed[2].iov_len = sizeof(prefetch_ahead);
+	storage_fixed[3].iov_base = storage_packed_buf;
+	storage_fixed[3].iov_len = sizeof(storage_packed_buf);
+	storage_fixed_count = 4;
+	if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, storage_fixed, storage_fixed_count) < 0)
+		storage_fixed_count = 0; //e.g. RLIMIT_MEMLOCK too small; plain reads and writes still work
+	return 0;
+}
+
+void storage_init()
+{
+	if (storage_uring && storage_setup_uring() < 0)
+	{
+		fprintf(stderr, MAKE_YELLOW "io_uring is not available, using pread and pwrite\n" RESET_COLOR);
+		storage_uring = 0;
+	}
+	printf("Image I/O using %s%s, durability %d\n", (storage_uring ? "io_uring" : "pread/pwrite"),
+	       (storage_uring && storage_fixed_count == 0 ? " (buffers not registered)" : ""), storage_durability);
+}
+
+// pread until length bytes or the end of the image. Returns the count, or -errno.
+static int pread_all(int file, long offset, unsigned char *buf, int length)
+{
+	int done = 0, c;
+
+	while (done < length)
+	{
+		if ((c = pread(file, buf + done, length - done, offset + done)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (c == 0)
+			break;
+		done += c;
+	}
+	return done;
+}
+
+/*
+ * Decide whether a newly opened image is packed. -k or -K says; otherwise
+ * an image the usual size of one or two sides is not, and any other is
+ * read through: words read the usual way never have bits above the low
+ * twelve unless the image is packed, and a packed one of any size has them
+ * somewhere. An image of a size that divides into three byte groups and
+ * without such bits could be either, so it is refused rather than guessed
+ * at (writing it the wrong way would ruin it). Returns -1 after saying why.
+ */
+int storage_attach(struct disk_state *disk, const char *name)
+{
+	static unsigned char probe[0100000];
+	struct stat st;
+	long c, offset = 0;
+	int high = 0;
+
+	disk->packed = (disk->format > 0);
+	if (fstat(disk->file, &st) < 0)
+		return 0;
+	if (disk->packed && (st.st_size % 3 != 0 || st.st_size > PACKED_BYTES(2 * FILE_LENGTH)))
+	{
+		fprintf(stderr, "%s is not the size of a packed image\n", name);
+		return -1;
+	}
+	if (disk->format != 0 || st.st_size == 0 || st.st_size == FILE_LENGTH || st.st_size == 2 * FILE_LENGTH)
+		return 0;
+	while (!high && (c = pread_all(disk->file, offset, probe, sizeof(probe))) > 0)
+	{
+		for (long i = 1; i < c && !high; i += 2)
+			high = probe[i] & 0360;
+		offset += c;
+	}
+	if (high && st.st_size % 3 == 0 && st.st_size <= PACKED_BYTES(2 * FILE_LENGTH))
+		disk->packed = 1;
+	else if (high)
+	{
+		fprintf(stderr, "%s has words of more than 12 bits but is not the size of a packed image\n", name);
+		return -1;
+	}
+	else if (st.st_size % 3 == 0)
+	{
+		fprintf(stderr, "%s could be packed or not\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+// The next free submission entry; storage_push queues it once filled in.
+static struct io_uring_sqe *storage_sqe()
+{
+	struct io_uring_sqe *sqe = &uring.sqes[*uring.sq_tail & *uring.sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void storage_push()
+{
+	unsigned tail = *uring.sq_tail;
+
+	uring.sq_array[tail & *uring.sq_mask] = tail & *uring.sq_mask;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring.to_submit++;
+}
+
+static void storage_prep_rw(struct io_uring_sqe *sqe, int write, int file, long offset, void *buf, int length)
+{
+	int fixed = storage_fixed_index(buf, length);
+
+	if (fixed >= 0)
+	{
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = fixed;
+	}
+	else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = file;
+	sqe->off = offset;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = length;
+}
+
+// Hand queued entries to the kernel, and collect what has finished.
+static void storage_reap(int wait)
+{
+	unsigned head;
+
+	if (uring.to_submit || wait)
+	{
+		int c = syscall(__NR_io_uring_enter, uring.fd, uring.to_submit, wait, (wait ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+		if (c < 0 && errno != EINTR)
+		{
+			perror("io_uring_enter failure");
+			exit(1);
+		}
+		if (c > 0)
+			uring.to_submit -= c;
+	}
+	head = *uring.cq_head;
+	while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+		int tag = cqe->user_data;
+
+		if (tag & (STORAGE_WRITE_TAG | STORAGE_SYNC_TAG))
+		{
+			struct storage_slot *s = &storage_slots[tag & ~(STORAGE_WRITE_TAG | STORAGE_SYNC_TAG)];
+
+			if ((tag & STORAGE_WRITE_TAG) && cqe->res != s->length)
+				fprintf(stderr, MAKE_RED "Warning: failed to complete write at %ld: %s\n" RESET_COLOR,
+					s->offset, (cqe->res < 0 ? strerror(-cqe->res) : "short write"));
+			else if ((tag & STORAGE_SYNC_TAG) && cqe->res < 0 && cqe->res != -ECANCELED)
+				fprintf(stderr, MAKE_RED "Warning: fdatasync failed: %s\n" RESET_COLOR, strerror(-cqe->res));
+			if (--s->pending == 0)
+				s->busy = 0;
+		}
+		else
+		{
+			storage_reads[tag].result = cqe->res;
+			storage_reads[tag].done = 1;
+		}
+		head++;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int storage_overlaps(struct storage_slot *s, int file, long offset, int length)
+{
+	return s->busy && s->file == file && s->offset < offset + length && offset < s->offset + s->length;
+}
+
+// Wait for pending writes that overlap a range (or all of them if file < 0).
+static void storage_wait_writes(int file, long offset, int length)
+{
+	for (int i = 0; i < STORAGE_WRITE_SLOTS; i++)
+	{
+		if (file >= 0 && !storage_overlaps(&storage_slots[i], file, offset, length))
+			continue;
+		if (storage_slots[i].busy)
+			storage_write_waits++;
+		while (storage_slots[i].busy)
+			storage_reap(1);
+	}
+}
+
+/*
+ * Start reading length bytes at offset. Returns a handle for
+ * storage_read_finish. With io_uring the read is queued and goes to the
+ * kernel with the next one that is waited for; otherwise nothing happens
+ * until storage_read_finish.
+ */
+int storage_read_start(int file, long offset, unsigned char *buf, int length)
+{
+	int r;
+
+	for (r = 0; storage_reads[r].busy; r++)
+	{
+		if (r == STORAGE_READS - 1)
+		{
+			fprintf(stderr, MAKE_RED "Error: too many reads in flight\n" RESET_COLOR);
+			exit(1);
+		}
+	}
+	storage_reads[r] = (struct storage_read) { 1, 0, file, offset, buf, length, 0, NULL };
+	if (storage_uring)
+	{
+		struct io_uring_sqe *sqe;
+
+		storage_wait_writes(file, offset, length);
+		sqe = storage_sqe();
+		storage_prep_rw(sqe, 0, file, offset, buf, length);
+		sqe->user_data = r;
+		storage_push();
+	}
+	return r;
+}
+
+// Wait for a read. Returns 0, or 1 if it came up short (e.g. at the end of the image).
+int storage_read_finish(int r)
+{
+	struct storage_read *rd = &storage_reads[r];
+	int result;
+
+	if (storage_uring)
+	{
+		while (!rd->done)
+			storage_reap(1);
+		result = rd->result;
+		if (result > 0 && result < rd->length) //pick up the rest the slow way
+		{
+			int more = pread_all(rd->file, rd->offset + result, rd->buf + result, rd->length - result);
+			result = (more < 0 ? more : result + more);
+		}
+	}
+	else
+		result = pread_all(rd->file, rd->offset, rd->buf, rd->length);
+	rd->busy = 0;
+	if (result < 0)
+	{
+		errno = -result;
+		perror("File read failure");
+		exit(1);
+	}
+	if (rd->unpack)
+		mac_to_djg(rd->buf, rd->unpack, rd->length / 3 * 2);
+	return result != rd->length;
+}
+
+/*
+ * As storage_read_start, but offset and length are in the two bytes per
+ * word layout whatever the disk's image is.
+ */
+int image_read_start(struct disk_state *disk, long offset, unsigned char *buf, int length)
+{
+	int r;
+
+	if (!disk->packed)
+		return storage_read_start(disk->file, offset, buf, length);
+	for (r = 0; r < STORAGE_READS; r++)
+	{
+		if (storage_reads[r].busy && storage_reads[r].unpack)
+		{
+			fprintf(stderr, MAKE_RED "Error: packed read already in flight\n" RESET_COLOR);
+			exit(1);
+		}
+	}
+	r = storage_read_start(disk->file, PACKED_BYTES(offset), storage_packed_buf, PACKED_BYTES(length));
+	storage_reads[r].unpack = buf;
+	return r;
+}
+
+int read_from_file(struct disk_state *disk, int offset, char* buf, int length)
+{
+	return storage_read_finish(image_read_start(disk, offset, (unsigned char *) buf, length));
+}
+
+// fdatasync an image, as an rt_defer job.
+static void storage_sync(void *file)
+{
+	if (fdatasync((long) file) < 0)
+		perror("fdatasync failure");
+}
+
+/*
+ * Write length bytes at offset. With io_uring the data is copied aside and
+ * the write completes in the background, unless durability 2 asks to wait
+ * for it. Returns 0, or 1 if a plain write came up short.
+ */
+int write_to_file(struct disk_state *disk, int offset, char* buf, int length)
+{
+	int file = disk->file;
+	int words = length / BYTES_PER_WORD;
+
+	if (disk->packed)
+	{
+		offset = PACKED_BYTES(offset);
+		length = PACKED_BYTES(length);
+	}
+	storage_writes++;
+	if (!storage_uring)
+	{
+		if (disk->packed)
+		{
+			djg_to_mac(buf, storage_slot_data[0], words); //the slots are free without io_uring
+			buf = (char *) storage_slot_data[0];
+		}
+
+		int done = 0, c;
+
+		while (done < length)
+		{
+			if ((c = pwrite(file, buf + done, length - done, offset + done)) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				perror("File write failure");
+				exit(1);
+			}
+			done += c;
+		}
+		if (storage_durability == 1)
+			rt_defer(storage_sync, (void *) (long) file); //in the background with -R
+		else if (storage_durability && fdatasync(file) < 0)
+			perror("fdatasync failure");
+		storage_syncs += (storage_durability != 0);
+		return 0;
+	}
+
+	int slot;
+	struct io_uring_sqe *sqe;
+
+	storage_wait_writes(file, offset, length);
+	for (;;)
+	{
+		for (slot = 0; slot < STORAGE_WRITE_SLOTS && storage_slots[slot].busy; slot++)
+			;
+		if (slot < STORAGE_WRITE_SLOTS)
+			break;
+		storage_write_waits++;
+		storage_reap(1);
+	}
+	storage_slots[slot] = (struct storage_slot) { 1, 1, file, offset, length };
+	if (disk->packed)
+		djg_to_mac(buf, storage_slot_data[slot], words);
+	else
+		memcpy(storage_slot_data[slot], buf, length);
+	sqe = storage_sqe();
+	storage_prep_rw(sqe, 1, file, offset, storage_slot_data[slot], length);
+	sqe->user_data = STORAGE_WRITE_TAG | slot;
+	if (storage_durability)
+		sqe->flags |= IOSQE_IO_LINK;
+	storage_push();
+	if (storage_durability)
+	{
+		sqe = storage_sqe();
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = file;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->user_data = STORAGE_SYNC_TAG | slot;
+		storage_push();
+		storage_slots[slot].pending++;
+		storage_syncs++;
+	}
+	storage_reap(0);
+	while (storage_durability == 2 && storage_slots[slot].busy)
+		storage_reap(1);
+	return 0;
+}
+
+/*
+ * Write the blocks of buf (disk format) to a side, starting at block, leaving
+ * out those the image already holds. Returns the number of blocks written.
+ */
+int write_changed(int side, int block, char *buf, int blocks)
+{
+	struct disk_state *disk = &disks[side / 2];
+	long base = ((side & 1) * NUMBER_OF_BLOCKS + block) * BLOCK_BYTES;
+	unsigned char cached[BLOCK_BYTES];
+	char changed[sizeof(disk_buf) / BLOCK_BYTES];
+	int read = 0, written = 0;
+
+	for (int i = 0; i < blocks; i++)
+	{
+		if (prefetch_peek(side, block + i, cached))
+			changed[i] = memcmp(cached, buf + i * BLOCK_BYTES, BLOCK_BYTES) != 0;
+		else
+		{
+			// One read of the whole range covers every block not cached.
+			if (!read)
+				read = read_from_file(disk, base, (char *) storage_compare_buf, blocks * BLOCK_BYTES) ? -1 : 1;
+			changed[i] = read < 0 || memcmp(storage_compare_buf + i * BLOCK_BYTES, buf + i * BLOCK_BYTES, BLOCK_BYTES) != 0;
+		}
+	}
+	for (int i = 0; i < blocks; )
+	{
+		int run = 0;
+
+		while (i + run < blocks && changed[i + run])
+			run++;
+		if (run)
+		{
+			write_to_file(disk, base + i * BLOCK_BYTES, buf + i * BLOCK_BYTES, run * BLOCK_BYTES);
+			prefetch_after_write(side, block + i, run);
+			written += run;
+			i += run;
+		}
+		else
+			i++;
+	}
+	storage_blocks[side] += blocks;
+	storage_elided[side] += blocks - written;
+	return written;
+}
+
+// Finish every pending write, e.g. before exiting.
+void storage_flush()
+{
+	if (storage_uring)
+		storage_wait_writes(-1, 0, 0);
+	rt_drain();
+}
+
+void storage_report()
+{
+	if (storage_writes)
+		printf("Image I/O: %ld write%s, %ld fdatasync%s, %ld wait%s for an earlier write\n",
+		       storage_writes, (storage_writes == 1 ? "" : "s"), storage_syncs, (storage_syncs == 1 ? "" : "s"),
+		       storage_write_waits, (storage_write_waits == 1 ? "" : "s"));
+	for (int side = 0; side < DISK_COUNT * 2; side++)
+	{
+		if (storage_blocks[side])
+			printf("  side %d on %s disk: %ld of %ld block%s written were unchanged and skipped (%ld%%)\n", side & 1,
+			       disk_num_strings[side / 2], storage_elided[side], storage_blocks[side], (storage_blocks[side] == 1 ? "" : "s"),
+			       storage_elided[side] * 100 / storage_blocks[side]);
+	}
+}
@@ -0,0 +1,155 @@
+/*
+	trace.c: per-request phase tracing (-J)
+
+	With -J file the server times each phase of every request on the
+	monotonic clock: the wakeup, the headers coming in, checking the
+	request, the disk (or read-ahead cache), converting, receiving the
+	data of a write, each chunk written to the port (on the transmit
+	thread, see comm.c), the check for stray characters and the last
+	acknowledgment. At exit they are written in the Chrome trace-event
+	format, which chrome://tracing and ui.perfetto.dev open: one row
+	per thread, phases nested under the request they belong to.
+
+	Events go into a fixed ring of TRACE_EVENTS; when it is full the
+	oldest are overwritten, which caps both the memory and the file.
+	Recording one is a clock read and a few stores. Without -J
+	trace_now returns 0 and nothing is recorded.
+*/
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define TRACE_EVENTS 0200000 //kept, the latest
+
+struct trace_event
+{
+	uint64_t start_ns, end_ns; //end 0 for an instant
+	const char *name;
+	int tid;
+	int region; //for a request: disk * 2 + side, or -1
+	int block, pages, status;
+};
+
+char *trace_path;
+struct trace_event *trace_ring;
+_Atomic long trace_count; //recorded, including those overwritten
+__thread int trace_tid = 1; //1 for the main thread
+const char *trace_thread_names[4] = { NULL, "server", "serial receive", "serial transmit" };
+
+uint64_t trace_now()
+{
+	struct timespec now;
+
+	if (trace_ring == NULL)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static struct trace_event *trace_add(const char *name, uint64_t start, uint64_t end)
+{
+	struct trace_event *e = &trace_ring[atomic_fetch_add(&trace_count, 1) % TRACE_EVENTS];
+
+	*e = (struct trace_event) { start, end, name, trace_tid, -1 };
+	return e;
+}
+
+// A phase that began at start (from trace_now) and ends now.
+void trace_span(const char *name, uint64_t start)
+{
+	if (trace_ring != NULL && start != 0)
+		trace_add(name, start, trace_now());
+}
+
+// Something that happened now, e.g. a wakeup character.
+void trace_instant(const char *name)
+{
+	if (trace_ring != NULL)
+		trace_add(name, trace_now(), 0);
+}
+
+// A whole request (one extent of a list), with what it asked for and how it ended.
+void trace_request(uint64_t start, int region, int block, int pages, int write, int status)
+{
+	struct trace_event *e;
+
+	if (trace_ring == NULL || start == 0)
+		return;
+	e = trace_add((write ? "write" : "read"), start, trace_now());
+	e->region = region;
+	e->block = block;
+	e->pages = pages;
+	e->status = status;
+}
+
+// Which row of the trace this thread's events go on (see trace_thread_names).
+void trace_thread(int tid)
+{
+	trace_tid = tid;
+}
+
+void trace_init()
+{
+	if (trace_path == NULL)
+		return;
+	if ((trace_ring = malloc(TRACE_EVENTS * sizeof(struct trace_event))) == NULL)
+	{
+		fprintf(stderr, MAKE_RED "Warning: no memory for tracing\n" RESET_COLOR);
+		return;
+	}
+	printf("Tracing requests to %s (the last %d events)\n", trace_path, TRACE_EVENTS);
+}
+
+static int trace_compare(const void *a, const void *b)
+{
+	const struct trace_event *x = a, *y = b;
+
+	if (x->start_ns != y->start_ns)
+		return x->start_ns < y->start_ns ? -1 : 1;
+	return (x->end_ns < y->end_ns) - (x->end_ns > y->end_ns); //the longer (outer) one first
+}
+
+// Write the events kept, oldest first, times in microseconds from the first.
+void trace_write()
+{
+	long count = atomic_load(&trace_count), kept = (count < TRACE_EVENTS ? count : TRACE_EVENTS);
+	FILE *f;
+
+	if (trace_ring == NULL)
+		return;
+	if ((f = fopen(trace_path, "w")) == NULL)
+	{
+		fprintf(stderr, MAKE_RED "Warning: can't write the trace %s: %s\n" RESET_COLOR, trace_path, strerror(errno));
+		return;
+	}
+	qsort(trace_ring, kept, sizeof(struct trace_event), trace_compare);
+	uint64_t base = (kept ? trace_ring[0].start_ns : 0);
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (int tid = 1; tid < 4; tid++)
+		fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n", tid,
+			trace_thread_names[tid]);
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"sdsk server\"}}");
+	for (long i = 0; i < kept; i++)
+	{
+		struct trace_event *e = &trace_ring[i];
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"sdsk\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", e->name, e->tid,
+			(e->start_ns - base) / 1e3);
+		if (e->end_ns == 0)
+			fprintf(f, ",\"ph\":\"i\",\"s\":\"t\"}");
+		else
+			fprintf(f, ",\"ph\":\"X\",\"dur\":%.3f", (e->end_ns - e->start_ns) / 1e3);
+		if (e->end_ns != 0 && e->region >= 0)
+			fprintf(f, ",\"args\":{\"drive\":\"%c\",\"block\":\"%05o\",\"pages\":%d,\"status\":\"%04o\"}}",
+				'A' + e->region, e->block, e->pages, e->status);
+		else if (e->end_ns != 0)
+			fprintf(f, "}");
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	printf("Trace: %ld event%s written to %s", kept, (kept == 1 ? "" : "s"), trace_path);
+	if (count > kept)
+		printf(" (%ld older ones dropped)", count - kept);
+	printf("\n");
+}
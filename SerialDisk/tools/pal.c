@@ -31,6 +31,16 @@
 		-j	Do not pad TEXT or SIXBIT
 		-l	do not warn about offpage references
 		-r	produce output in rim format (default is bin format)
+		-t	report the time taken for each file and in all
+		-x	add a cross reference to the listing
+
+	Several source files may be given.  They are assembled at the same
+	time, each in a process of its own (so with its own symbol table),
+	as many at once as there are processors or $PALJOBS says, and the
+	messages for each file are printed together, after its name.  If
+	$PALCACHE names a directory, the outputs are kept there under a hash
+	of the source, the switches and this program's build, and a source
+	seen before is not assembled again.
 
 	PQS8 assembler switches:
 		-a	Include all symbols with -s
@@ -113,6 +123,11 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 #define isend(c) ((c=='\0')||(c=='\n')||(c=='\r'))
 #define isdone(c) ( (c == '/') || (isend(c)) || (c == ';') )
 
@@ -121,6 +136,9 @@
 #define NAMELEN 128
 FILE *in;		/* input file */
 char *filename = NULL;	/* input file's name */
+char **files;		/* all the input files */
+int nfiles = 0;
+char *progname;
 FILE *obj = NULL;	/* object file */
 FILE *objsave = NULL;	/* alternate object file (supports ENPUNCH/NOPUNCH) */
 char objname[NAMELEN];	/* object file's name */
@@ -131,6 +149,8 @@ int eflag = 0;		/* Add some more symbols */
 int jflag = 0;		/* Suppress zero word after TEXT, SIXBIT */
 int linkmsg = 1;	/* Suppress "off page" messages */
 int dumpflag = 0;	/* dump symtab if 1 (defaults to no dump) */
+int xflag = 0;		/* cross reference if 1 */
+int timeflag = 0;	/* report times if 1 */
 int rimflag = 0;	/* generate rim format if 1 (defaults bin) */
 int cksum = 0;		/* checksum generated for .bin files */
 int errors = 0;		/* number of errors found so far */
@@ -144,13 +164,14 @@ int c;
 }
 
 /* symbol table */
-#define SYMBOLS  2048
 #define SYMLEN 6
 struct symbol {
 	char sym[SYMLEN+1]; /* the textual name of the symbol, zero filled */
 	short int val;	  /* the value associated with the symbol */
-	short int refs;   /* the number of references to the symbol */
-} symtab[SYMBOLS] = {  /* values = 01xxxx indicate MRI */
+	int refs;	  /* the number of references to the symbol */
+	int *xref;	  /* pass 2 lines using (or, negated, defining) it */
+	int nxref, maxxref;
+} permsym[] = {        /* values = 01xxxx indicate MRI */
 		       /* values = 04xxxx indicate pseudo-ops */
 	{ "DECIMA", 040000 }, /* read literal constants in base 10 */
 	{ "OCTAL" , 040001 }, /* read literal constants in base 8 */
@@ -298,6 +319,115 @@ int firstsym = 82+pdp8e;
 int firstsym = 82;
 #endif
 
+/*
+ * The symbol table proper holds the first firstsym permanent symbols,
+ * then those the source defines, in order of definition.  It grows as
+ * needed.  An open hash table (linear probing, kept at most half full)
+ * of index + 1, 0 meaning empty, finds symbols by name.
+ */
+struct symbol *symtab = NULL;
+int nsyms = 0;		/* symbols in symtab */
+int maxsyms = 0;	/* room in symtab */
+int *symhash = NULL;
+int hashsize = 0;	/* a power of two */
+int pass;		/* 1 or 2 */
+
+int
+hashsym( sym )
+char sym[SYMLEN];
+{
+	unsigned h = 0;
+	int j;
+	for (j = 0; j < SYMLEN; j++) {
+		h = h * 31 + (unsigned char) sym[j];
+	}
+	return h & (hashsize - 1);
+}
+
+/* find a symbol, returns its index or -1 */
+int
+findsym( sym )
+char sym[SYMLEN];
+{
+	int h;
+	for (h = hashsym( sym ); symhash[h] != 0; h = (h + 1) & (hashsize - 1)) {
+		if (memcmp( symtab[symhash[h]-1].sym, sym, SYMLEN ) == 0) {
+			return symhash[h] - 1;
+		}
+	}
+	return -1;
+}
+
+/* add a symbol known not to be in the table, returns its index */
+int
+addsym( sym, val )
+char sym[SYMLEN];
+short int val;
+{
+	int h, i;
+	if (nsyms == maxsyms) {
+		maxsyms = maxsyms ? maxsyms * 2 : 1024;
+		symtab = realloc( symtab, maxsyms * sizeof(*symtab) );
+	}
+	if (2 * (nsyms + 1) > hashsize) { /* grow and rehash */
+		free( symhash );
+		hashsize = hashsize ? hashsize * 2 : 2048;
+		symhash = calloc( hashsize, sizeof(*symhash) );
+		if (symhash != NULL) {
+			for (i = 0; i < nsyms; i++) {
+				for (h = hashsym( symtab[i].sym ); symhash[h] != 0; h = (h + 1) & (hashsize - 1))
+					;
+				symhash[h] = i + 1;
+			}
+		}
+	}
+	if ((symtab == NULL) || (symhash == NULL)) {
+		fprintf( stderr, "out of memory for symbols\n" );
+		exit(-1);
+	}
+	memset( &symtab[nsyms], 0, sizeof(*symtab) );
+	memcpy( symtab[nsyms].sym, sym, SYMLEN );
+	symtab[nsyms].val = val;
+	for (h = hashsym( sym ); symhash[h] != 0; h = (h + 1) & (hashsize - 1))
+		;
+	symhash[h] = nsyms + 1;
+	return nsyms++;
+}
+
+/* enter the permanent symbols */
+void
+syminit()
+{
+	int i;
+	for (i = 0; i < firstsym; i++) {
+		addsym( permsym[i].sym, permsym[i].val );
+	}
+}
+
+/* note a use (or, with line negated, a definition) for the cross reference */
+void
+addxref( i, line )
+int i;
+int line;
+{
+	struct symbol *s = &symtab[i];
+	if ((pass != 2) || (i < firstsym) || (xflag == 0)) {
+		return;
+	}
+	if ((s->nxref > 0) && (s->xref[s->nxref-1] == line)) {
+		return; /* e.g. an MRI operand evaluated twice */
+	}
+	if (s->nxref == s->maxxref) {
+		s->maxxref = s->maxxref ? s->maxxref * 2 : 8;
+		s->xref = realloc( s->xref, s->maxxref * sizeof(*s->xref) );
+		if (s->xref == NULL) {
+			fprintf( stderr, "out of memory for cross reference\n" );
+			exit(-1);
+		}
+	}
+	s->xref[s->nxref++] = line;
+}
+
 /* command line argument processing */
 void
 getargs(argc, argv)
@@ -306,11 +436,17 @@ char *argv[];
 {
 	int i,j;
 
+	progname = argv[0];
+	files = malloc( argc * sizeof(*files) );
         for (i=1; i < argc; i++) {
 		if (argv[i][0] == '-') { /* a flag */
 			for (j=1; argv[i][j] != 0; j++) {
 				if (argv[i][1] == 'd') {
 					dumpflag = 1;
+				} else if (argv[i][1] == 't') {
+					timeflag = 1;
+				} else if (argv[i][1] == 'x') {
+					xflag = 1;
 #ifdef PDP8E
 				} else if (argv[i][1] == 'e') {
 					eflag = 1;
@@ -335,30 +471,38 @@ char *argv[];
 						 " -j -- don't pad TEXT\n" );
 					fprintf( stderr,
 						 " -r -- output rim file\n" );
+					fprintf( stderr,
+						 " -t -- time each file\n" );
+					fprintf( stderr,
+						 " -x -- cross reference listing\n" );
 					exit(-1);
 				}
 			}
 		} else { /* no - at front of argument, must be file name */
-			if (filename != NULL) {
-				fprintf( stderr, "%s: too many input files\n",
-					 argv[0] );
-				exit(-1);
-			}
-			filename = &argv[i][0];
+			files[nfiles++] = &argv[i][0];
 		} /* end if */
         } /* end for loop */
 
 #ifdef PDP8E
 	if (!eflag)
-		firstsym -= pdp8e;
-	symtab[firstsym].sym[0] = 0;	/* Truncate the defined symbols */
+		firstsym -= pdp8e;	/* Leave out the extra symbols */
 #endif
+	syminit();
 
-        if (filename == NULL) { /* no input file specified */
+        if (nfiles == 0) { /* no input file specified */
 		fprintf( stderr, "%s: no input file specified\n", argv[0] );
 		exit(-1);
 	}
+}
 
+/* set up the names of the outputs and open the input */
+void
+setfiles( name )
+char *name;
+{
+	int j;
+
+	filename = name;
 	/* now, fix up the file names */
 	{
 		int dot; /* location of last dot in filename */
@@ -367,7 +511,7 @@ char *argv[];
 			if (j > (NAMELEN - 5)) {
 				fprintf( stderr,
 					 "%s: file name too long %s\n",
-					 argv[0], filename );
+					 progname, filename );
 				exit(-1);
 			}
 			lstname[j] = objname[j] = filename[j];
@@ -400,7 +544,7 @@ char *argv[];
 
 	/* now, open up the input file */
 	if ((in = fopen(filename, "r")) == NULL) {
-		fprintf( stderr, "%s: cannot open %s\n", argv[0], filename );
+		fprintf( stderr, "%s: cannot open %s\n", progname, filename );
 		exit(-1);
 	}
 }
@@ -488,38 +632,85 @@ readline()
         dosmode = (line[strlen(line)-2] == '\r');
 }
 
+int
+symcmp( a, b )
+const void *a;
+const void *b;
+{
+	return memcmp( symtab[*(int *) a].sym, symtab[*(int *) b].sym, SYMLEN );
+}
+
+/* the symbols the source defined, in alphabetical order */
+int *
+sortsyms()
+{
+	int *order = malloc( (nsyms - firstsym + 1) * sizeof(*order) );
+	int i;
+	if (order == NULL) {
+		fprintf( stderr, "out of memory for sorting symbols\n" );
+		exit(-1);
+	}
+	for (i = firstsym; i < nsyms; i++) {
+		order[i - firstsym] = i;
+	}
+	qsort( order, nsyms - firstsym, sizeof(*order), symcmp );
+	return order;
+}
+
 /* dump symbol table */
 void
 dump()
 {
-	struct symbol tmp;
-	int i, again;
+	int *order = sortsyms();
+	int i;
 	fputc( '\f', lst );
 	if (dosmode)
 		fputc( '\r', lst );
 	fputc( '\n', lst );
-	/* Sort the symbol table with a ripple sort */
-sort:
-	again = 0;
-	for (i = firstsym; symtab[i+1].sym[0] != '\0'; i++) {
-		if (strncmp(symtab[i].sym, symtab[i+1].sym, SYMLEN) > 0) {
-			tmp = symtab[i];
-			symtab[i] = symtab[i+1];
-			symtab[i+1] = tmp;
-			again = 1;
-		}
-	}
-	if (again)
-		goto sort;
-	/* Dump the symbol table */
-	for (i = firstsym; symtab[i].sym[0] != '\0'; i++) {
+	for (i = 0; i < nsyms - firstsym; i++) {
+		struct symbol *s = &symtab[order[i]];
 		fprintf( lst, "%-6s  %04o%s",
-			 symtab[i].sym, symtab[i].val,
-			 symtab[i].refs? "" : " unreferenced");
+			 s->sym, s->val,
+			 s->refs? "" : " unreferenced");
 		if (dosmode)
 			fputc( '\r', lst );
 		fputc( '\n', lst );
 	}
+	free( order );
+}
+
+/* cross reference: each symbol's value and the lines using it, */
+/* with the lines defining it marked by a '#' */
+#define XREFLINE 10	/* line numbers per line of listing */
+void
+xref()
+{
+	int *order = sortsyms();
+	int i, j;
+	fputc( '\f', lst );
+	if (dosmode)
+		fputc( '\r', lst );
+	fputc( '\n', lst );
+	for (i = 0; i < nsyms - firstsym; i++) {
+		struct symbol *s = &symtab[order[i]];
+		fprintf( lst, "%-6s  %04o", s->sym, s->val & 07777 );
+		for (j = 0; j < s->nxref; j++) {
+			if ((j > 0) && (j % XREFLINE == 0)) {
+				if (dosmode)
+					fputc( '\r', lst );
+				fprintf( lst, "\n            " );
+			}
+			if (s->xref[j] < 0) {
+				fprintf( lst, " %5d#", -s->xref[j] );
+			} else {
+				fprintf( lst, " %5d ", s->xref[j] );
+			}
+		}
+		if (dosmode)
+			fputc( '\r', lst );
+		fputc( '\n', lst );
+	}
+	free( order );
 }
 
 /* define symbol, returns old value, if any */
@@ -528,53 +719,30 @@ define( sym, val )
 char sym[SYMLEN];
 short int val;
 {
-	int i,j, old;
-	for (i = 0; symtab[i].sym[0] != '\0'; i++) {
-		for (j = 0; j < SYMLEN; j++) {
-			if (symtab[i].sym[j] != sym[j]) {
-				goto mismatch;
-			}
-		}
-                old = symtab[i].val;
-		goto match;
-		mismatch:;
-	}
-	/* if it ever gets here, a new symbol must be defined */
-	if (i < (SYMBOLS - 1)) {
-		for (j = 0; j < SYMLEN; j++) {
-			symtab[i].sym[j] = sym[j];
-		}
+	int i, old;
+	i = findsym( sym );
+	if (i >= 0) {
+		old = symtab[i].val;
+		symtab[i].val = val;
 	} else {
-                error("full");
+		/* a new symbol must be defined */
+		i = addsym( sym, val );
+		old = -1;
 	}
-	symtab[i+1].sym[0] = 0; /* VRS: Don't allow deleted symbols to creep back in */
-	symtab[i].refs = 0;
-        old = -1;
-	match:;
-
-	symtab[i].val = val;
-        return old;
+	addxref( i, -lineno );
+	return old;
 }
 
 short int lookup( sym )
 char sym[SYMLEN];
 {
-	int i,j;
-	for (i = 0; symtab[i].sym[0] != '\0'; i++) {
-		for (j = 0; j < SYMLEN; j++) {
-			if (symtab[i].sym[j] != sym[j]) {
-				goto mismatch;
-			}
-		}
-		goto match;
-		mismatch:;
+	int i = findsym( sym );
+	if (i < 0) {
+		/* the symbol is undefined */
+		return -1;
 	}
-	/* if it ever gets here, the symbol is undefined */
-	return -1;
-
-	match:;
 	symtab[i].refs++;
-if (symtab[i].refs == 0) abort();
+	addxref( i, lineno );
 	return symtab[i].val;
 }
 
@@ -1538,14 +1706,14 @@ restart:
 }
 
 
-/* main program */
+/* assemble one file, returns 1 if there were errors */
 int
-main(argc, argv)
-int argc;
-char *argv[];
+assemble( name )
+char *name;
 {
-	getargs(argc, argv);
+	setfiles( name );
 
+	pass = 1;
 	onepass();
 
 	rewind(in);
@@ -1557,12 +1725,14 @@ char *argv[];
 	errors = 0;
 	cksum = 0;
 
+	pass = 2;
 	onepass();
 
 	if (lst == NULL) { /* undo effects of XLIST for any following dump */
 		lst = lstsave;
 	}
 	if (dumpflag != 0) dump();
+	if (xflag != 0) xref();
 	obj = objsave; /* undo effects of NOPUNCH for any following checksum */
 	if ((rimflag == 0) && (obj != NULL)) { /* checksum */
 		/* for now, put out the wrong value */
@@ -1570,6 +1740,281 @@ char *argv[];
 		fputc( cksum & 0077, obj );
 	}
 	putleader();
-	exit (errors != 0);
+	if (obj != NULL) fclose( obj );
+	if (lst != NULL) fclose( lst );
+	fclose( in );
+	return (errors != 0);
+}
+
+#ifndef _WIN32
+/* batch assembly: several files at once, and the output cache */
+
+char *cachedir = NULL;	/* $PALCACHE */
+
+double
+now()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* FNV-1a hash of this build, the switches that change the output and */
+/* the source; 0 if the source can't be read */
+unsigned long long
+srchash( name )
+char *name;
+{
+	static char build[] = __DATE__ " " __TIME__;
+	char flags[16], *p;
+	unsigned long long h = 14695981039346656037ULL;
+	FILE *f = fopen( name, "rb" );
+	int c;
+
+	if (f == NULL)
+		return 0;
+	sprintf( flags, "%d%d%d%d%d%d", dumpflag, eflag, jflag, linkmsg, rimflag, xflag );
+	for (p = build; *p; p++)
+		h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+	for (p = flags; *p; p++)
+		h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+	while ((c = getc( f )) != EOF)
+		h = (h ^ c) * 1099511628211ULL;
+	fclose( f );
+	return h;
+}
+
+/* copy a file, returns 0 on success */
+int
+copyfile( from, to )
+char *from;
+char *to;
+{
+	char buf[8192];
+	FILE *f = fopen( from, "rb" ), *t;
+	size_t n;
+	int bad = 0;
+
+	if (f == NULL)
+		return -1;
+	if ((t = fopen( to, "wb" )) == NULL) {
+		fclose( f );
+		return -1;
+	}
+	while ((n = fread( buf, 1, sizeof(buf), f )) > 0)
+		bad |= (fwrite( buf, 1, n, t ) != n);
+	fclose( f );
+	return (fclose( t ) != 0) || bad;
+}
+
+/* write the messages for a file, after its name if there are several files */
+void
+putmsgs( name, msgs, len )
+char *name;
+char *msgs;
+long len;
+{
+	char *buf = malloc( strlen( name ) + len + 3 );
+	long n = 0;
+
+	if ((buf == NULL) || (len == 0))
+		return;
+	if (nfiles > 1)
+		n = sprintf( buf, "%s:\n", name );
+	memcpy( buf + n, msgs, len );
+	write( 2, buf, n + len ); /* in one piece, as other jobs write too */
+	free( buf );
+}
+
+/* read a whole file into memory */
+char *
+slurp( f, len )
+FILE *f;
+long *len;
+{
+	char *buf;
+
+	fseek( f, 0, SEEK_END );
+	*len = ftell( f );
+	rewind( f );
+	if ((buf = malloc( *len + 1 )) == NULL || fread( buf, 1, *len, f ) != *len)
+		*len = 0;
+	return buf;
+}
+
+/* the cache file for a hash: obj, lst or msg (status, then messages) */
+char *
+cachename( hash, kind )
+unsigned long long hash;
+char *kind;
+{
+	static char name[3][NAMELEN + 40];
+	static int next = 0;
+	char *n = name[next++ % 3];
+
+	snprintf( n, sizeof(name[0]), "%s/%016llx.%s", cachedir, hash, kind );
+	return n;
+}
+
+/* use the cached outputs if there are any, returns the status or -1 */
+int
+fromcache( name, hash )
+char *name;
+unsigned long long hash;
+{
+	FILE *f;
+	char *msgs;
+	long len;
+	int status;
+
+	if ((cachedir == NULL) || (hash == 0))
+		return -1;
+	if ((f = fopen( cachename( hash, "msg" ), "rb" )) == NULL)
+		return -1;
+	setfiles( name );
+	fclose( in );
+	if (copyfile( cachename( hash, "obj" ), objname ) ||
+	    copyfile( cachename( hash, "lst" ), lstname )) {
+		fclose( f );
+		return -1;
+	}
+	msgs = slurp( f, &len );
+	fclose( f );
+	if (len < 2) {
+		free( msgs );
+		return -1;
+	}
+	status = msgs[0] - '0';
+	putmsgs( name, msgs + 2, len - 2 );
+	free( msgs );
+	return status;
+}
+
+/* put a result in the cache; each file is written aside and renamed */
+void
+tocache( hash, status, msgs, len )
+unsigned long long hash;
+int status;
+char *msgs;
+long len;
+{
+	char tmp[NAMELEN + 60];
+	FILE *f;
+
+	if ((cachedir == NULL) || (hash == 0))
+		return;
+	snprintf( tmp, sizeof(tmp), "%s/tmp.%ld", cachedir, (long) getpid() );
+	if (copyfile( objname, tmp ) || rename( tmp, cachename( hash, "obj" ) ))
+		return;
+	if (copyfile( lstname, tmp ) || rename( tmp, cachename( hash, "lst" ) ))
+		return;
+	if ((f = fopen( tmp, "wb" )) == NULL)
+		return;
+	fprintf( f, "%d\n", status );
+	fwrite( msgs, 1, len, f );
+	if (fclose( f ) == 0)
+		rename( tmp, cachename( hash, "msg" ) ); /* last: it marks a hit */
+}
+
+/* in a child: assemble one file with its messages gathered up */
+void
+runone( name, hash )
+char *name;
+unsigned long long hash;
+{
+	FILE *msg = tmpfile();
+	int saved = dup( 2 ), status;
+	char *msgs;
+	long len;
+
+	if ((msg == NULL) || (saved < 0)) {
+		perror( progname );
+		_exit( -1 );
+	}
+	dup2( fileno( msg ), 2 );
+	status = assemble( name );
+	fflush( stderr );
+	dup2( saved, 2 );
+	msgs = slurp( msg, &len );
+	tocache( hash, status, msgs, len );
+	putmsgs( name, msgs, len );
+	exit( status );
+}
+
+/* assemble all the files, returns 1 if any had errors */
+int
+batch()
+{
+	char *env = getenv( "PALJOBS" );
+	int jobs = env ? atoi( env ) : sysconf( _SC_NPROCESSORS_ONLN );
+	int *pids = calloc( nfiles, sizeof(*pids) );
+	double *times = calloc( nfiles, sizeof(*times) );
+	double start = now();
+	int i, running = 0, failed = 0, hits = 0, status;
+	pid_t pid;
+
+	cachedir = getenv( "PALCACHE" );
+	if (jobs < 1)
+		jobs = 1;
+	for (i = 0; (i < nfiles) || (running > 0); ) {
+		if ((i < nfiles) && (running < jobs)) {
+			unsigned long long hash = srchash( files[i] );
+			times[i] = now();
+			if ((status = fromcache( files[i], hash )) >= 0) {
+				failed |= status;
+				hits++;
+				times[i] = now() - times[i];
+			} else if ((pid = fork()) == 0) {
+				runone( files[i], hash );
+			} else if (pid < 0) {
+				perror( progname );
+				exit( -1 );
+			} else {
+				pids[i] = pid;
+				running++;
+			}
+			i++;
+			continue;
+		}
+		if ((pid = wait( &status )) < 0)
+			break;
+		running--;
+		failed |= !WIFEXITED( status ) || (WEXITSTATUS( status ) != 0);
+		for (int j = 0; j < nfiles; j++) {
+			if (pids[j] == pid) {
+				times[j] = now() - times[j];
+				pids[j] = 0;
+			}
+		}
+	}
+	if (timeflag) {
+		for (i = 0; i < nfiles; i++)
+			fprintf( stderr, "%8.1f ms  %s\n", times[i] * 1e3, files[i] );
+		fprintf( stderr, "%8.1f ms  %d file%s, %d from the cache, %d at a time\n",
+			 (now() - start) * 1e3, nfiles, (nfiles == 1 ? "" : "s"), hits, jobs );
+	}
+	return failed;
+}
+#endif
+
+/* main program */
+int
+main(argc, argv)
+int argc;
+char *argv[];
+{
+	getargs(argc, argv);
+
+#ifndef _WIN32
+	if ((nfiles > 1) || timeflag || getenv( "PALCACHE" )) {
+		exit( batch() );
+	}
+#else
+	if (nfiles > 1) {
+		fprintf( stderr, "%s: too many input files\n", argv[0] );
+		exit(-1);
+	}
+#endif
+	exit( assemble( files[0] ) );
 	return 0;
 }